@@ -0,0 +1,350 @@
+#include <chainbase/chainbase.hpp>
+
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace boost::multi_index;
+namespace bfs = boost::filesystem;
+
+/**
+ *  Measures throughput and latency of the common database operations on a synthetic table, for each map mode
+ *  asked for, and writes the results as JSON. Run with --help for the options.
+ */
+
+struct bench_object : public chainbase::object<0, bench_object> {
+   template<typename Constructor, typename Allocator>
+   bench_object( Constructor&& c, Allocator&& a ) : payload( chainbase::allocator<char>( a.get_segment_manager() ) ) {
+      c(*this);
+   }
+
+   id_type                 id;
+   uint64_t                key = 0;
+   uint32_t                group = 0;
+   uint64_t                hash_key = 0;
+   chainbase::shared_string payload;
+};
+
+struct by_key;
+struct by_group;
+struct by_hash;
+
+typedef chainbase::shared_multi_index_container<
+   bench_object,
+   indexed_by<
+      ordered_unique< member<bench_object, bench_object::id_type, &bench_object::id> >,
+      ordered_unique< tag<by_key>, member<bench_object, uint64_t, &bench_object::key> >,
+      ordered_non_unique< tag<by_group>, member<bench_object, uint32_t, &bench_object::group> >,
+      hashed_unique< tag<by_hash>, member<bench_object, uint64_t, &bench_object::hash_key> >
+   >
+> bench_index;
+
+CHAINBASE_SET_INDEX_TYPE( bench_object, bench_index )
+
+namespace {
+
+struct options {
+   uint64_t                 rows = 100000;
+   size_t                   value_size = 64;
+   uint64_t                 blocks = 200;
+   uint64_t                 transactions_per_block = 50;
+   uint64_t                 changes_per_transaction = 4;
+   uint64_t                 db_size_mb = 0;
+   std::vector<std::string> modes = { "mapped", "heap" };
+   std::vector<std::string> hugepage_paths;
+   bfs::path                dir;
+   std::string              output;
+   uint64_t                 seed = 1;
+};
+
+typedef std::chrono::steady_clock clock_type;
+
+/// latencies of one operation, in nanoseconds
+class recorder {
+   public:
+      explicit recorder( std::string name ) : _name( std::move(name) ) {}
+
+      template<typename F>
+      void time( F&& f ) {
+         const auto start = clock_type::now();
+         f();
+         _samples.push_back( std::chrono::duration_cast<std::chrono::nanoseconds>( clock_type::now() - start ).count() );
+      }
+
+      /// times f, which performs count operations, and records their average latency for each of them
+      template<typename F>
+      void time_batch( uint64_t count, F&& f ) {
+         const auto start = clock_type::now();
+         f();
+         const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>( clock_type::now() - start ).count();
+         _samples.insert( _samples.end(), count, ns / std::max<uint64_t>( count, 1 ) );
+      }
+
+      void write_json( std::ostream& out ) {
+         std::sort( _samples.begin(), _samples.end() );
+         uint64_t total = 0;
+         for( uint64_t s : _samples )
+            total += s;
+         out << "{\"op\":\"" << _name << "\",\"count\":" << _samples.size()
+             << ",\"total_ns\":" << total
+             << ",\"ops_per_sec\":" << ( total ? double(_samples.size()) * 1e9 / double(total) : 0.0 )
+             << ",\"p50_ns\":" << percentile( 0.50 )
+             << ",\"p90_ns\":" << percentile( 0.90 )
+             << ",\"p99_ns\":" << percentile( 0.99 )
+             << ",\"p999_ns\":" << percentile( 0.999 )
+             << ",\"max_ns\":" << ( _samples.empty() ? 0 : _samples.back() ) << "}";
+      }
+
+   private:
+      uint64_t percentile( double p )const {
+         if( _samples.empty() )
+            return 0;
+         return _samples[ std::min<size_t>( _samples.size() - 1, size_t( p * _samples.size() ) ) ];
+      }
+
+      std::string           _name;
+      std::vector<uint64_t> _samples;
+};
+
+chainbase::pinnable_mapped_file::map_mode parse_mode( const std::string& s ) {
+   std::istringstream in( s );
+   chainbase::pinnable_mapped_file::map_mode mode;
+   in >> mode;
+   if( in.fail() )
+      throw std::runtime_error( "unknown map mode " + s );
+   return mode;
+}
+
+std::vector<std::string> split( const std::string& s ) {
+   std::vector<std::string> parts;
+   std::istringstream in( s );
+   std::string part;
+   while( std::getline( in, part, ',' ) )
+      if( !part.empty() )
+         parts.push_back( part );
+   return parts;
+}
+
+void usage() {
+   std::cerr << "usage: chainbase_bench [options]\n"
+                "  --rows N                     rows created, modified, read and removed (100000)\n"
+                "  --value-size BYTES           size of each row's payload (64)\n"
+                "  --blocks N                   nested session rounds (200)\n"
+                "  --transactions-per-block N   sessions squashed into each block (50)\n"
+                "  --changes-per-transaction N  writes per transaction (4)\n"
+                "  --db-size MB                 database size, estimated from the row count if 0 (0)\n"
+                "  --modes LIST                 comma separated map modes: mapped,heap,locked (mapped,heap)\n"
+                "  --hugepage-paths LIST        comma separated hugetlbfs mounts for locked mode\n"
+                "  --dir PATH                   where to create the databases (a temporary directory)\n"
+                "  --output FILE                write the JSON report here instead of stdout\n"
+                "  --seed N                     random seed (1)\n";
+}
+
+options parse_options( int argc, char** argv ) {
+   options o;
+   for( int i = 1; i < argc; ++i ) {
+      const std::string arg = argv[i];
+      if( arg == "--help" || arg == "-h" ) {
+         usage();
+         exit( 0 );
+      }
+      if( i + 1 >= argc ) {
+         usage();
+         throw std::runtime_error( "missing value for " + arg );
+      }
+      const std::string value = argv[++i];
+      if( arg == "--rows" )                           o.rows = std::stoull( value );
+      else if( arg == "--value-size" )                o.value_size = std::stoull( value );
+      else if( arg == "--blocks" )                    o.blocks = std::stoull( value );
+      else if( arg == "--transactions-per-block" )    o.transactions_per_block = std::stoull( value );
+      else if( arg == "--changes-per-transaction" )   o.changes_per_transaction = std::stoull( value );
+      else if( arg == "--db-size" )                   o.db_size_mb = std::stoull( value );
+      else if( arg == "--modes" )                     o.modes = split( value );
+      else if( arg == "--hugepage-paths" )            o.hugepage_paths = split( value );
+      else if( arg == "--dir" )                       o.dir = value;
+      else if( arg == "--output" )                    o.output = value;
+      else if( arg == "--seed" )                      o.seed = std::stoull( value );
+      else {
+         usage();
+         throw std::runtime_error( "unknown option " + arg );
+      }
+   }
+   if( o.rows == 0 )
+      throw std::runtime_error( "--rows must be at least 1" );
+   if( o.db_size_mb == 0 ) {
+      // rows live in the table and up to twice more in undo history; leave room for fragmentation
+      const uint64_t per_row = 512 + o.value_size * 4;
+      o.db_size_mb = std::max<uint64_t>( 64, ( o.rows + o.blocks * o.transactions_per_block * o.changes_per_transaction ) * per_row * 2 / (1024*1024) );
+   }
+   return o;
+}
+
+void run_mode( const options& o, const std::string& mode_name, std::ostream& out ) {
+   const auto mode = parse_mode( mode_name );
+   const bfs::path dir = o.dir / mode_name;
+   bfs::remove_all( dir );
+   std::mt19937_64 rng( o.seed );
+   const std::string payload( o.value_size, 'x' );
+   const uint64_t db_size = o.db_size_mb * 1024 * 1024;
+
+   recorder open_create( "open_create" ), create( "create" ), get( "get" ), find_by_key( "find_by_key" ),
+            find_by_hash( "find_by_hash" ), modify( "modify" ), start_session( "start_undo_session" ),
+            squash( "squash" ), undo( "undo" ), commit( "commit" ), remove( "remove" ), close( "close" ),
+            reopen( "open_existing" ), bulk_create( "bulk_create" );
+
+   std::unique_ptr<chainbase::database> db;
+   open_create.time( [&]() {
+      db.reset( new chainbase::database( dir, chainbase::database::read_write, db_size, false, mode, o.hugepage_paths ) );
+      db->add_index< bench_index >();
+   });
+
+   uint64_t next_key = 0;
+   for( uint64_t i = 0; i < o.rows; ++i ) {
+      create.time( [&]() {
+         db->create<bench_object>( [&]( bench_object& b ) {
+            b.key = next_key;
+            b.group = uint32_t( next_key % 1024 );
+            b.hash_key = next_key * 0x9e3779b97f4a7c15ULL;
+            b.payload.assign( payload.data(), payload.size() );
+         });
+      });
+      ++next_key;
+   }
+
+   std::uniform_int_distribution<uint64_t> any_row( 0, o.rows - 1 );
+   for( uint64_t i = 0; i < o.rows; ++i ) {
+      const auto id = bench_object::id_type( int64_t( any_row( rng ) ) );
+      get.time( [&]() { db->get<bench_object>( id ); } );
+   }
+   for( uint64_t i = 0; i < o.rows; ++i ) {
+      const uint64_t key = any_row( rng );
+      find_by_key.time( [&]() { db->find<bench_object, by_key>( key ); } );
+   }
+   for( uint64_t i = 0; i < o.rows; ++i ) {
+      const uint64_t hash_key = any_row( rng ) * 0x9e3779b97f4a7c15ULL;
+      find_by_hash.time( [&]() { db->find<bench_object, by_hash>( hash_key ); } );
+   }
+   for( uint64_t i = 0; i < o.rows; ++i ) {
+      const auto& obj = db->get<bench_object>( bench_object::id_type( int64_t( any_row( rng ) ) ) );
+      modify.time( [&]() {
+         db->modify( obj, [&]( bench_object& b ) { b.group = uint32_t( rng() % 1024 ); } );
+      });
+   }
+
+   // blocks of transactions, as a blockchain applies them: each transaction is a nested session squashed into
+   // its block, every few blocks one is undone, and blocks become irreversible some distance behind the head
+   const int64_t irreversible_distance = 16;
+   for( uint64_t block = 0; block < o.blocks; ++block ) {
+      std::unique_ptr<chainbase::database::session> block_session;
+      start_session.time( [&]() { block_session.reset( new chainbase::database::session( db->start_undo_session( true ) ) ); } );
+      for( uint64_t t = 0; t < o.transactions_per_block; ++t ) {
+         std::unique_ptr<chainbase::database::session> trx;
+         start_session.time( [&]() { trx.reset( new chainbase::database::session( db->start_undo_session( true ) ) ); } );
+         for( uint64_t c = 0; c < o.changes_per_transaction; ++c ) {
+            if( c % 4 == 3 ) {
+               db->create<bench_object>( [&]( bench_object& b ) {
+                  b.key = next_key;
+                  b.group = uint32_t( next_key % 1024 );
+                  b.hash_key = next_key * 0x9e3779b97f4a7c15ULL;
+                  b.payload.assign( payload.data(), payload.size() );
+               });
+               ++next_key;
+            } else {
+               const auto* obj = db->find<bench_object>( bench_object::id_type( int64_t( any_row( rng ) ) ) );
+               if( obj )
+                  db->modify( *obj, [&]( bench_object& b ) { b.group = uint32_t( rng() % 1024 ); } );
+            }
+         }
+         squash.time( [&]() { trx->squash(); } );
+      }
+      if( block % 10 == 9 ) {
+         undo.time( [&]() { block_session->undo(); } );
+         continue;
+      }
+      block_session->push();
+      const int64_t lib = db->revision() - irreversible_distance;
+      commit.time( [&]() { db->commit( lib ); } );
+   }
+   db->commit( db->revision() );
+
+   for( uint64_t i = 0; i < o.rows; i += 2 ) {
+      const auto* obj = db->find<bench_object>( bench_object::id_type( int64_t( i ) ) );
+      if( obj )
+         remove.time( [&]() { db->remove( *obj ); } );
+   }
+
+   close.time( [&]() { db.reset(); } );
+   reopen.time( [&]() {
+      db.reset( new chainbase::database( dir, chainbase::database::read_write, db_size, false, mode, o.hugepage_paths ) );
+      db->add_index< bench_index >();
+   });
+
+   bulk_create.time_batch( o.rows, [&]() {
+      db->bulk_create<bench_object>( o.rows, [&]( bench_object& b, size_t i ) {
+         const uint64_t key = next_key + i;
+         b.key = key;
+         b.group = uint32_t( key % 1024 );
+         b.hash_key = key * 0x9e3779b97f4a7c15ULL;
+         b.payload.assign( payload.data(), payload.size() );
+      });
+   });
+   next_key += o.rows;
+   db.reset();
+   bfs::remove_all( dir );
+
+   out << "{\"mode\":\"" << mode_name << "\",\"results\":[";
+   recorder* all[] = { &open_create, &create, &get, &find_by_key, &find_by_hash, &modify, &start_session,
+                       &squash, &undo, &commit, &remove, &close, &reopen, &bulk_create };
+   for( size_t i = 0; i < sizeof(all)/sizeof(all[0]); ++i ) {
+      if( i )
+         out << ",";
+      out << "\n    ";
+      all[i]->write_json( out );
+   }
+   out << "\n  ]}";
+}
+
+}
+
+int main( int argc, char** argv ) {
+   try {
+      options o = parse_options( argc, argv );
+      const bool temporary_dir = o.dir.empty();
+      if( temporary_dir )
+         o.dir = bfs::temp_directory_path() / bfs::unique_path( "chainbase-bench-%%%%-%%%%" );
+
+      std::ofstream file;
+      if( !o.output.empty() ) {
+         file.open( o.output );
+         if( !file )
+            throw std::runtime_error( "could not open " + o.output );
+      }
+      std::ostream& out = o.output.empty() ? std::cout : file;
+
+      out << "{\"rows\":" << o.rows << ",\"value_size\":" << o.value_size << ",\"blocks\":" << o.blocks
+          << ",\"transactions_per_block\":" << o.transactions_per_block
+          << ",\"changes_per_transaction\":" << o.changes_per_transaction
+          << ",\"db_size_mb\":" << o.db_size_mb << ",\"modes\":[";
+      for( size_t i = 0; i < o.modes.size(); ++i ) {
+         out << ( i ? ",\n  " : "\n  " );
+         run_mode( o, o.modes[i], out );
+      }
+      out << "\n]}" << std::endl;
+
+      if( temporary_dir )
+         bfs::remove_all( o.dir );
+   } catch( const std::exception& e ) {
+      std::cerr << "chainbase_bench: " << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -12,6 +12,7 @@
 #include <boost/core/demangle.hpp>
 
 #include <boost/multi_index_container.hpp>
+#include <boost/mpl/size.hpp>
 
 #include <boost/chrono.hpp>
 #include <boost/config.hpp>
@@ -19,15 +20,24 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/throw_exception.hpp>
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <typeindex>
 #include <typeinfo>
+#include <utility>
 
 #include <chainbase/pinnable_mapped_file.hpp>
+#include <chainbase/node_allocator.hpp>
+#include <chainbase/id_table.hpp>
+#include <chainbase/state_hash.hpp>
+#include <chainbase/undo_log.hpp>
+#include <chainbase/stats.hpp>
 
 #ifndef CHAINBASE_NUM_RW_LOCKS
    #define CHAINBASE_NUM_RW_LOCKS 10
@@ -122,32 +132,42 @@ namespace chainbase {
    #define CHAINBASE_SET_INDEX_TYPE( OBJECT_TYPE, INDEX_TYPE )  \
    namespace chainbase { template<> struct get_index_type<OBJECT_TYPE> { typedef INDEX_TYPE type; }; }
 
+   /**
+    *  Whether generic_index keeps an id_table for a type, making lookups by id a table read instead of a tree
+    *  descent at the cost of 8 bytes per id. Off unless enabled with CHAINBASE_SET_DENSE_ID_LOOKUP.
+    */
+   template<typename T>
+   struct dense_id_lookup : std::false_type {};
+
+   /**
+    *  This macro must be used at global scope and OBJECT_TYPE must be fully qualified
+    */
+   #define CHAINBASE_SET_DENSE_ID_LOOKUP( OBJECT_TYPE )  \
+   namespace chainbase { template<> struct dense_id_lookup<OBJECT_TYPE> : std::true_type {}; }
+
    #define CHAINBASE_DEFAULT_CONSTRUCTOR( OBJECT_TYPE ) \
    template<typename Constructor, typename Allocator> \
    OBJECT_TYPE( Constructor&& c, Allocator&&  ) { c(*this); }
 
-   template< typename value_type >
-   class undo_state
-   {
-      public:
-         typedef typename value_type::id_type                      id_type;
-         typedef allocator< std::pair<const id_type, value_type> > id_value_allocator_type;
-         typedef allocator< id_type >                              id_allocator_type;
-
-         template<typename T>
-         undo_state( allocator<T> al )
-         :old_values( id_value_allocator_type( al.get_segment_manager() ) ),
-          removed_values( id_value_allocator_type( al.get_segment_manager() ) ),
-          new_ids( id_allocator_type( al.get_segment_manager() ) ){}
-
-         typedef boost::interprocess::map< id_type, value_type, std::less<id_type>, id_value_allocator_type >  id_value_type_map;
-         typedef boost::interprocess::set< id_type, std::less<id_type>, id_allocator_type >                    id_type_set;
-
-         id_value_type_map            old_values;
-         id_value_type_map            removed_values;
-         id_type_set                  new_ids;
-         id_type                      old_next_id = 0;
-         int64_t                      revision = 0;
+   /**
+    *  Undo session bookkeeping shared by every index of a database, kept in the segment. Sessions are numbered
+    *  by revision at the database level only: an index gets undo state for a revision the first time it is
+    *  written to in that revision, and records that in touched so undo, squash and commit visit just the
+    *  indices that changed.
+    */
+   struct undo_session_state {
+      struct touched_index {
+         int64_t  revision;
+         uint16_t type_id;
+      };
+
+      undo_session_state( allocator<touched_index> a ) : touched(a) {}
+
+      bool enabled()const { return revision != begin; }
+
+      int64_t                                                 revision = 0; ///< the head revision
+      int64_t                                                 begin = 0;    ///< the revision undo_all() returns to
+      bip::deque< touched_index, allocator<touched_index> >   touched;      ///< in increasing revision order
    };
 
    /**
@@ -187,14 +207,22 @@ namespace chainbase {
          typedef MultiIndexType                                        index_type;
          typedef typename index_type::value_type                       value_type;
          typedef bip::allocator< generic_index, segment_manager_type > allocator_type;
-         typedef undo_state< value_type >                              undo_state_type;
+         typedef undo_log< value_type >                                undo_log_type;
+         typedef id_table< value_type >                                id_table_type;
+
+         /// see dense_id_lookup
+         constexpr static bool dense_ids = dense_id_lookup< value_type >::value;
+         /// see object_digest
+         constexpr static bool hashed = has_object_digest< value_type >::value;
 
          generic_index( allocator<value_type> a )
-         :_stack(a),_indices( a ),_size_of_value_type( sizeof(typename MultiIndexType::node_type) ),_size_of_this(sizeof(*this)){}
+         :_undo(a),_indices( a ),_ids( a ),_size_of_value_type( sizeof(typename MultiIndexType::node_type) ),_size_of_this(sizeof(*this)){}
 
          void validate()const {
             if( sizeof(typename MultiIndexType::node_type) != _size_of_value_type || sizeof(*this) != _size_of_this )
                BOOST_THROW_EXCEPTION( std::runtime_error("content of memory does not match data expected by executable") );
+            if( !_undo.compatible() )
+               BOOST_THROW_EXCEPTION( std::runtime_error("undo history was written with a different undo_delta setting than this executable's") );
          }
 
          /**
@@ -203,7 +231,10 @@ namespace chainbase {
           */
          template<typename Constructor>
          const value_type& emplace( Constructor&& c ) {
+            touch();
             auto new_id = _next_id;
+            if( dense_ids )
+               _ids.reserve( new_id._id );
 
             auto constructor = [&]( value_type& v ) {
                v.id = new_id;
@@ -216,32 +247,105 @@ namespace chainbase {
                BOOST_THROW_EXCEPTION( std::logic_error("could not insert object, most likely a uniqueness constraint was violated") );
             }
 
+            if( dense_ids )
+               _ids.set( new_id._id, &*insert_result.first );
+            if( hashed )
+               _digest += digest( *insert_result.first );
             ++_next_id;
-            on_create( *insert_result.first );
             return *insert_result.first;
          }
 
          /**
+          *  Prepares for count more objects: with chainbase::node_allocator their nodes are drawn from the pool in
+          *  one contiguous allocation, and hashed indices get enough buckets not to rehash while they are added.
+          *  Only an optimization; whatever cannot be reserved now is allocated as usual later.
+          */
+         void reserve( size_t count ) {
+            try {
+               reserve_nodes( count, std::is_same< typename index_type::allocator_type, node_allocator<value_type> >() );
+            } catch( const bip::bad_alloc& ) {
+            }
+            reserve_buckets( _indices.size() + count, std::make_index_sequence< boost::mpl::size<typename index_type::index_type_list>::value >() );
+         }
+
+         /**
+          *  Creates count objects with consecutive ids, calling c( obj, i ) with i from 0 to count-1 to construct
+          *  each. Cheaper per object than emplace() because new ids always sort last, so the primary index is
+          *  appended to at its end instead of being searched. Only the primary index is built that way; every
+          *  other index still inserts each object on its own, at O(log n). Objects created before a constructor
+          *  throws are kept.
+          *
+          *  Bulk creation is not undoable: it throws std::logic_error while there is an undo stack.
+          */
+         template<typename Constructor>
+         void bulk_emplace( size_t count, Constructor&& c ) {
+            if( _sessions && _sessions->enabled() )
+               BOOST_THROW_EXCEPTION( std::logic_error("cannot bulk create objects while there is an existing undo stack") );
+            for( size_t i = 0; i < count; ++i ) {
+               const auto new_id = _next_id;
+               if( dense_ids )
+                  _ids.reserve( new_id._id );
+
+               auto constructor = [&]( value_type& v ) {
+                  v.id = new_id;
+                  c( v, i );
+               };
+               auto itr = _indices.emplace_hint( _indices.end(), constructor, _indices.get_allocator() );
+               if( itr->id != new_id ) // points at the object that prevented the insertion
+                  BOOST_THROW_EXCEPTION( std::logic_error("could not insert object, most likely a uniqueness constraint was violated") );
+
+               if( dense_ids )
+                  _ids.set( new_id._id, &*itr );
+               if( hashed )
+                  _digest += digest( *itr );
+               ++_next_id;
+            }
+         }
+
+         /**
+          *  If the modifier throws, the object is removed, which is what multi_index does with it, and the
+          *  exception is rethrown.
+          *
           *  @pre modifier cannot change the object in such a way that causes a uniqueness violation for any unique indices
           *  @pre any modifications done within an undo session for a given generic_index must satisfy the condition that the compacted set of modifications in the session can be undone in any order without causing a uniqueness violation in any intermediate step
           */
          template<typename Modifier>
          void modify( const value_type& obj, Modifier&& m ) {
             on_modify( obj );
-            auto ok = _indices.modify( _indices.iterator_to( obj ), m );
+            if( hashed )
+               _digest -= digest( obj );
+            const auto id = obj.id;
+            auto ok = _indices.modify( _indices.iterator_to( obj ), [&]( value_type& v ) {
+               try {
+                  m( v );
+               } catch( ... ) {
+                  // multi_index erases v on the way out, so it has to go as if remove() had been called; its
+                  // digest was taken out of _digest above and stays out
+                  _undo.on_erase( id, v );
+                  if( dense_ids )
+                     _ids.erase( id._id );
+                  throw;
+               }
+            });
             if( !ok ) std::abort(); // uniqueness violation
+            if( hashed )
+               _digest += digest( obj );
          }
 
          void remove( const value_type& obj ) {
             on_remove( obj );
+            if( dense_ids )
+               _ids.erase( obj.id._id );
+            if( hashed )
+               _digest -= digest( obj );
             _indices.erase( _indices.iterator_to( obj ) );
          }
 
+         /// looks ids up in the id table when there is one; any other key goes to the primary index
          template<typename CompatibleKey>
          const value_type* find( CompatibleKey&& key )const {
-            auto itr = _indices.find( std::forward<CompatibleKey>(key) );
-            if( itr != _indices.end() ) return &*itr;
-            return nullptr;
+            typedef std::is_same< std::decay_t<CompatibleKey>, typename value_type::id_type > is_id;
+            return find( std::forward<CompatibleKey>(key), std::integral_constant<bool, dense_ids && is_id::value>() );
          }
 
          template<typename CompatibleKey>
@@ -257,232 +361,122 @@ namespace chainbase {
 
          const index_type& indices()const { return _indices; }
 
-         class session {
-            public:
-               session( session&& mv )
-               :_index(mv._index),_apply(mv._apply){ mv._apply = false; }
-
-               ~session() {
-                  if( _apply ) {
-                     _index.undo();
-                  }
-               }
-
-               /** leaves the UNDO state on the stack when session goes out of scope */
-               void push()   { _apply = false; }
-               /** combines this session with the prior session */
-               void squash() { if( _apply ) _index.squash(); _apply = false; }
-               void undo()   { if( _apply ) _index.undo();  _apply = false; }
-
-               session& operator = ( session&& mv ) {
-                  if( this == &mv ) return *this;
-                  if( _apply ) _index.undo();
-                  _apply = mv._apply;
-                  mv._apply = false;
-                  return *this;
-               }
-
-               int64_t revision()const { return _revision; }
+         /// the id the next object created will get
+         typename value_type::id_type next_id()const { return _next_id; }
 
-            private:
-               friend class generic_index;
-
-               session( generic_index& idx, int64_t revision )
-               :_index(idx),_revision(revision) {
-                  if( revision == -1 )
-                     _apply = false;
-               }
-
-               generic_index& _index;
-               bool           _apply = true;
-               int64_t        _revision = 0;
-         };
-
-         session start_undo_session( bool enabled ) {
-            if( enabled ) {
-               _stack.emplace_back( _indices.get_allocator() );
-               _stack.back().old_next_id = _next_id;
-               _stack.back().revision = ++_revision;
-               return session( *this, _revision );
-            } else {
-               return session( *this, -1 );
-            }
-         }
-
-         int64_t revision()const { return _revision; }
+         /// the revision of the database this index belongs to
+         int64_t revision()const { return _sessions ? _sessions->revision : 0; }
 
          /**
-          *  Restores the state to how it was prior to the current session discarding all changes
-          *  made between the last revision and the current revision.
+          *  Restores the state to how it was prior to the head session discarding all changes made in it.
+          *  Only called by the database for an index touched in the head revision.
           *
           *  This function will not throw an exception but will abort if a uniqueness constraint violation
           *  is encountered while undoing, likely because of a prior violation of the preconditions of modify.
           */
          void undo() {
-            if( !enabled() ) return;
-
-            const auto& head = _stack.back();
-
-            for( auto id : head.new_ids )
-            {
-               _indices.erase( _indices.find( id ) );
-            }
-            _next_id = head.old_next_id;
-
-            for( auto& item : head.old_values ) {
-               auto ok = _indices.modify( _indices.find( item.second.id ), [&]( value_type& v ) {
-                  v = std::move( item.second );
-               });
-               if( !ok ) std::abort(); // uniqueness violation
-            }
-
-            for( auto& item : head.removed_values ) {
-               bool ok = _indices.emplace( std::move( item.second ) ).second;
-               if( !ok ) std::abort(); // uniqueness violation
+            if( _undo.empty() ) return;
+
+            const auto old_next_id = _undo.top().old_next_id;
+            for( int64_t id = _next_id._id; id-- > old_next_id._id; ) {
+               auto itr = _indices.find( typename value_type::id_type( id ) );
+               if( itr != _indices.end() ) {
+                  if( dense_ids )
+                     _ids.erase( id );
+                  if( hashed )
+                     _digest -= digest( *itr );
+                  _indices.erase( itr );
+               }
             }
-
-            _stack.pop_back();
-            --_revision;
+            _next_id = old_next_id;
+
+            _undo.undo( [&]( typename undo_log_type::entry& e ) {
+               if( e.op == undo_log_type::modified ) {
+                  auto ok = _indices.modify( _indices.find( e.object_id() ), [&]( value_type& v ) {
+                     if( hashed )
+                        _digest -= digest( v );
+                     e.restore( v );
+                     if( hashed )
+                        _digest += digest( v );
+                  });
+                  if( !ok ) std::abort(); // uniqueness violation
+               } else {
+                  value_type& old = e.whole();
+                  const int64_t id = old.id._id;
+                  if( dense_ids )
+                     _ids.reserve( id );
+                  auto result = _indices.emplace( std::move( old ) );
+                  if( !result.second ) std::abort(); // uniqueness violation
+                  if( dense_ids )
+                     _ids.set( id, &*result.first );
+                  if( hashed )
+                     _digest += digest( *result.first );
+               }
+            });
          }
 
          /**
-          *  This method works similar to git squash, it merges the change set from the two most
-          *  recent revision numbers into one revision number (reducing the head revision number)
+          *  This method works similar to git squash, it merges the change set of the head session into the
+          *  session of the given (previous) revision. Returns true if this index already had changes in that
+          *  revision, false if the head session's changes were simply relabelled.
           *
           *  This method does not change the state of the index, only the state of the undo buffer.
           */
-         void squash()
+         bool squash( int64_t revision )
          {
-            if( !enabled() ) return;
-            if( _stack.size() == 1 ) {
-               _stack.pop_front();
-               --_revision;
-               return;
-            }
-
-            auto& state = _stack.back();
-            auto& prev_state = _stack[_stack.size()-2];
-
-            // An object's relationship to a state can be:
-            // in new_ids            : new
-            // in old_values (was=X) : upd(was=X)
-            // in removed (was=X)    : del(was=X)
-            // not in any of above   : nop
-            //
-            // When merging A=prev_state and B=state we have a 4x4 matrix of all possibilities:
-            //
-            //                   |--------------------- B ----------------------|
-            //
-            //                +------------+------------+------------+------------+
-            //                | new        | upd(was=Y) | del(was=Y) | nop        |
-            //   +------------+------------+------------+------------+------------+
-            // / | new        | N/A        | new       A| nop       C| new       A|
-            // | +------------+------------+------------+------------+------------+
-            // | | upd(was=X) | N/A        | upd(was=X)A| del(was=X)C| upd(was=X)A|
-            // A +------------+------------+------------+------------+------------+
-            // | | del(was=X) | N/A        | N/A        | N/A        | del(was=X)A|
-            // | +------------+------------+------------+------------+------------+
-            // \ | nop        | new       B| upd(was=Y)B| del(was=Y)B| nop      AB|
-            //   +------------+------------+------------+------------+------------+
-            //
-            // Each entry was composed by labelling what should occur in the given case.
-            //
-            // Type A means the composition of states contains the same entry as the first of the two merged states for that object.
-            // Type B means the composition of states contains the same entry as the second of the two merged states for that object.
-            // Type C means the composition of states contains an entry different from either of the merged states for that object.
-            // Type N/A means the composition of states violates causal timing.
-            // Type AB means both type A and type B simultaneously.
-            //
-            // The merge() operation is defined as modifying prev_state in-place to be the state object which represents the composition of
-            // state A and B.
-            //
-            // Type A (and AB) can be implemented as a no-op; prev_state already contains the correct value for the merged state.
-            // Type B (and AB) can be implemented by copying from state to prev_state.
-            // Type C needs special case-by-case logic.
-            // Type N/A can be ignored or assert(false) as it can only occur if prev_state and state have illegal values
-            // (a serious logic error which should never happen).
-            //
-
-            // We can only be outside type A/AB (the nop path) if B is not nop, so it suffices to iterate through B's three containers.
-
-            for( const auto& item : state.old_values )
-            {
-               if( prev_state.new_ids.find( item.second.id ) != prev_state.new_ids.end() )
-               {
-                  // new+upd -> new, type A
-                  continue;
-               }
-               if( prev_state.old_values.find( item.second.id ) != prev_state.old_values.end() )
-               {
-                  // upd(was=X) + upd(was=Y) -> upd(was=X), type A
-                  continue;
-               }
-               // del+upd -> N/A
-               assert( prev_state.removed_values.find(item.second.id) == prev_state.removed_values.end() );
-               // nop+upd(was=Y) -> upd(was=Y), type B
-               prev_state.old_values.emplace( std::move(item) );
-            }
-
-            // *+new, but we assume the N/A cases don't happen, leaving type B nop+new -> new
-            for( auto id : state.new_ids )
-               prev_state.new_ids.insert(id);
-
-            // *+del
-            for( auto& obj : state.removed_values )
-            {
-               if( prev_state.new_ids.find(obj.second.id) != prev_state.new_ids.end() )
-               {
-                  // new + del -> nop (type C)
-                  prev_state.new_ids.erase(obj.second.id);
-                  continue;
-               }
-               auto it = prev_state.old_values.find(obj.second.id);
-               if( it != prev_state.old_values.end() )
-               {
-                  // upd(was=X) + del(was=Y) -> del(was=X)
-                  prev_state.removed_values.emplace( std::move(*it) );
-                  prev_state.old_values.erase(obj.second.id);
-                  continue;
-               }
-               // del + del -> N/A
-               assert( prev_state.removed_values.find( obj.second.id ) == prev_state.removed_values.end() );
-               // nop + del(was=Y) -> del(was=Y)
-               prev_state.removed_values.emplace( std::move(obj) ); //[obj.second->id] = std::move(obj.second);
-            }
-
-            _stack.pop_back();
-            --_revision;
+            return _undo.squash( revision );
          }
 
          /**
-          * Discards all undo history prior to revision
+          * Discards all undo history prior to revision. The discarded values are destroyed by reclaim() and,
+          * a few at a time, by later writes to this index.
           */
          void commit( int64_t revision )
          {
-            while( _stack.size() && _stack[0].revision <= revision )
-            {
-               _stack.pop_front();
-            }
+            _undo.commit( revision );
          }
 
-         /**
-          * Unwinds all undo states
-          */
-         void undo_all()
+         /// destroys up to max_entries values of committed undo history; returns how many were destroyed
+         size_t reclaim( size_t max_entries )
          {
-            while( enabled() )
-               undo();
+            return _undo.reclaim( max_entries );
          }
 
-         void set_revision( uint64_t revision )
-         {
-            if( _stack.size() != 0 )
-               BOOST_THROW_EXCEPTION( std::logic_error("cannot set revision while there is an existing undo stack") );
+         const undo_log_type& undo_history()const { return _undo; }
+
+         /// connects the index to its database's sessions; undo state is only recorded while one is open
+         void set_session_state( undo_session_state* sessions ) { _sessions = sessions; }
 
-            if( revision > std::numeric_limits<int64_t>::max() )
-               BOOST_THROW_EXCEPTION( std::logic_error("revision to set is too high") );
+         const id_table_type& id_lookup()const { return _ids; }
+
+         /**
+          *  Builds the id table if this executable wants one and the segment does not hold an up to date one, for
+          *  instance because the database was last written by an executable without it; frees it otherwise.
+          */
+         void sync_id_table() {
+            if( !dense_ids )
+               _ids.clear();
+            else if( !_ids.ready() || _ids.size() != _indices.size() )
+               _ids.rebuild( _indices );
+         }
 
-            _revision = static_cast<int64_t>(revision);
+         /**
+          *  The sum of the digests of all objects, or nullptr if value_type has no object_digest or the sum is not
+          *  up to date because the database was last written by an executable without it.
+          */
+         const state_digest* state_hash()const { return hashed && _digest_ready ? &_digest : nullptr; }
+
+         /// recomputes the state hash if this executable wants one and the segment does not hold an up to date one
+         void sync_state_hash() {
+            if( !hashed ) {
+               _digest = state_digest();
+               _digest_ready = false;
+            } else if( !_digest_ready ) {
+               _digest = state_digest();
+               for( const value_type& v : _indices )
+                  _digest += digest( v );
+               _digest_ready = true;
+            }
          }
 
          void remove_object( int64_t id )
@@ -492,128 +486,104 @@ namespace chainbase {
             remove( *val );
          }
 
-         std::pair<int64_t, int64_t> undo_stack_revision_range()const {
-            int64_t begin = _revision;
-            int64_t end   = _revision;
-
-            if( _stack.size() > 0 ) {
-               begin = _stack.front().revision - 1;
-               end   = _stack.back().revision;
-            }
-
-            return {begin, end};
-         }
-
-         const auto& stack()const { return _stack; }
-
       private:
-         bool enabled()const { return _stack.size(); }
-
-         void on_modify( const value_type& v ) {
-            if( !enabled() ) return;
-
-            auto& head = _stack.back();
-
-            if( head.new_ids.find( v.id ) != head.new_ids.end() )
-               return;
+         void reserve_nodes( size_t count, std::true_type ) {
+            typedef typename index_type::final_node_type node_type;
+            auto* manager = _indices.get_allocator().get_segment_manager();
+            node_allocator<node_type>( manager ).pool().reserve( manager, count );
+         }
+         void reserve_nodes( size_t, std::false_type ) {}
 
-            auto itr = head.old_values.find( v.id );
-            if( itr != head.old_values.end() )
-               return;
+         template<bool H = hashed>
+         static std::enable_if_t<H, state_digest> digest( const value_type& v ) { return digest_object( v ); }
+         template<bool H = hashed>
+         static std::enable_if_t<!H, state_digest> digest( const value_type& ) { return state_digest(); }
 
-            head.old_values.emplace( std::pair< typename value_type::id_type, const value_type& >( v.id, v ) );
+         template<size_t... N>
+         void reserve_buckets( size_t size, std::index_sequence<N...> ) {
+            int expand[] = { 0, ( reserve_buckets( _indices.template get<N>(), size, 0 ), 0 )... };
+            (void)expand;
          }
+         /// only hashed indices have buckets to reserve
+         template<typename Index>
+         static auto reserve_buckets( Index& idx, size_t size, int ) -> decltype( idx.reserve( size ), void() ) { idx.reserve( size ); }
+         template<typename Index>
+         static void reserve_buckets( Index&, size_t, long ) {}
 
-         void on_remove( const value_type& v ) {
-            if( !enabled() ) return;
+         template<typename CompatibleKey>
+         const value_type* find( CompatibleKey&& key, std::false_type )const {
+            auto itr = _indices.find( std::forward<CompatibleKey>(key) );
+            if( itr != _indices.end() ) return &*itr;
+            return nullptr;
+         }
 
-            auto& head = _stack.back();
-            if( head.new_ids.count(v.id) ) {
-               head.new_ids.erase( v.id );
-               return;
-            }
+         const value_type* find( const typename value_type::id_type& id, std::true_type )const {
+            if( BOOST_LIKELY( _ids.ready() ) )
+               return _ids.find( id._id );
+            return find( id, std::false_type() );
+         }
 
-            auto itr = head.old_values.find( v.id );
-            if( itr != head.old_values.end() ) {
-               head.removed_values.emplace( std::move( *itr ) );
-               head.old_values.erase( v.id );
+         /// opens this index's undo state for the head revision on its first write in that revision
+         void touch() {
+            if( !_sessions || !_sessions->enabled() )
                return;
+            if( _undo.empty() || _undo.top().revision != _sessions->revision ) {
+               _undo.push_session( _sessions->revision, _next_id );
+               _sessions->touched.push_back( { _sessions->revision, value_type::type_id } );
             }
-
-            if( head.removed_values.count( v.id ) )
-               return;
-
-            head.removed_values.emplace( std::pair< typename value_type::id_type, const value_type& >( v.id, v ) );
          }
 
-         void on_create( const value_type& v ) {
-            if( !enabled() ) return;
-            auto& head = _stack.back();
-
-            head.new_ids.insert( v.id );
+         void on_modify( const value_type& v ) {
+            touch();
+            _undo.on_modify( v );
          }
 
-         boost::interprocess::deque< undo_state_type, allocator<undo_state_type> > _stack;
+         void on_remove( const value_type& v ) {
+            touch();
+            _undo.on_remove( v );
+         }
 
-         /**
-          *  Each new session increments the revision, a squash will decrement the revision by combining
-          *  the two most recent revisions into one revision.
-          *
-          *  Commit will discard all revisions prior to the committed revision.
-          */
-         int64_t                         _revision = 0;
+         undo_log_type                            _undo;
+         bip::offset_ptr<undo_session_state>      _sessions;
          typename value_type::id_type    _next_id = 0;
          index_type                      _indices;
+         id_table_type                   _ids;
+         state_digest                    _digest;
+         bool                            _digest_ready = false;
          uint32_t                        _size_of_value_type = 0;
          uint32_t                        _size_of_this = 0;
    };
 
-   class abstract_session {
-      public:
-         virtual ~abstract_session(){};
-         virtual void push()             = 0;
-         virtual void squash()           = 0;
-         virtual void undo()             = 0;
-         virtual int64_t revision()const  = 0;
-   };
-
-   template<typename SessionType>
-   class session_impl : public abstract_session
-   {
-      public:
-         session_impl( SessionType&& s ):_session( std::move( s ) ){}
-
-         virtual void push() override  { _session.push();  }
-         virtual void squash() override{ _session.squash(); }
-         virtual void undo() override  { _session.undo();  }
-         virtual int64_t revision()const override  { return _session.revision();  }
-      private:
-         SessionType _session;
-   };
-
    class abstract_index
    {
       public:
          abstract_index( void* i ):_idx_ptr(i){}
          virtual ~abstract_index(){}
-         virtual void     set_revision( uint64_t revision ) = 0;
-         virtual unique_ptr<abstract_session> start_undo_session( bool enabled ) = 0;
 
-         virtual int64_t revision()const = 0;
          virtual void    undo()const = 0;
-         virtual void    squash()const = 0;
+         virtual bool    squash( int64_t revision )const = 0;
          virtual void    commit( int64_t revision )const = 0;
-         virtual void    undo_all()const = 0;
+         virtual size_t  reclaim( size_t max_entries )const = 0;
          virtual uint32_t type_id()const  = 0;
          virtual uint64_t row_count()const = 0;
          virtual const std::string& type_name()const = 0;
-         virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const = 0;
+         virtual index_stats stats()const = 0;
+         /// whether the index keeps a state hash, and its value; see generic_index::state_hash()
+         virtual bool hashed()const = 0;
+         virtual const state_digest* state_hash()const = 0;
 
          virtual void remove_object( int64_t id ) = 0;
 
          void* get()const { return _idx_ptr; }
+
+#ifdef CHAINBASE_COLLECT_STATS
+         latency_recorder& operation_stats( index_operation op )const { return _operation_stats[size_t(op)]; }
+#endif
       private:
          void* _idx_ptr;
+#ifdef CHAINBASE_COLLECT_STATS
+         mutable index_operation_recorders _operation_stats;
+#endif
    };
 
    template<typename BaseIndex>
@@ -621,20 +591,42 @@ namespace chainbase {
       public:
          index_impl( BaseIndex& base ):abstract_index( &base ),_base(base){}
 
-         virtual unique_ptr<abstract_session> start_undo_session( bool enabled ) override {
-            return unique_ptr<abstract_session>(new session_impl<typename BaseIndex::session>( _base.start_undo_session( enabled ) ) );
-         }
-
-         virtual void     set_revision( uint64_t revision ) override { _base.set_revision( revision ); }
-         virtual int64_t  revision()const  override { return _base.revision(); }
          virtual void     undo()const  override { _base.undo(); }
-         virtual void     squash()const  override { _base.squash(); }
+         virtual bool     squash( int64_t revision )const  override { return _base.squash( revision ); }
          virtual void     commit( int64_t revision )const  override { _base.commit(revision); }
-         virtual void     undo_all() const override {_base.undo_all(); }
+         virtual size_t   reclaim( size_t max_entries )const  override { return _base.reclaim(max_entries); }
          virtual uint32_t type_id()const override { return BaseIndex::value_type::type_id; }
          virtual uint64_t row_count()const override { return _base.indices().size(); }
          virtual const std::string& type_name() const override { return BaseIndex_name; }
-         virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const override { return _base.undo_stack_revision_range(); }
+         virtual bool     hashed()const override { return BaseIndex::hashed; }
+         virtual const state_digest* state_hash()const override { return _base.state_hash(); }
+
+         virtual index_stats stats()const override {
+            index_stats s;
+            s.type_name = BaseIndex_name;
+            s.type_id = type_id();
+            s.row_count = row_count();
+            typedef typename BaseIndex::index_type::final_node_type node_type;
+            s.node_bytes = s.row_count * sizeof( node_type );
+            if( std::is_same< typename BaseIndex::index_type::allocator_type, node_allocator<typename BaseIndex::value_type> >::value ) {
+               const auto* pool = node_pool<node_type>::find( _base.indices().get_allocator().get_segment_manager() );
+               if( pool ) {
+                  s.pool_bytes = pool->reserved_bytes();
+                  s.pool_free_nodes = pool->free_nodes();
+               }
+            }
+            const auto& history = _base.undo_history();
+            s.undo_sessions = history.sessions();
+            s.undo_values = history.size();
+            s.undo_retired = history.retired();
+            s.undo_bytes = history.memory_bytes();
+            s.id_table_bytes = _base.id_lookup().memory_bytes();
+#ifdef CHAINBASE_COLLECT_STATS
+            for( size_t op = 0; op < num_index_operations; ++op )
+               s.operations[op] = operation_stats( index_operation( op ) ).snapshot();
+#endif
+            return s;
+         }
 
          virtual void     remove_object( int64_t id ) override { return _base.remove_object( id ); }
       private:
@@ -681,6 +673,95 @@ namespace chainbase {
    };
 
 
+   /**
+    *  A read-only copy of a database as of the revision it was published at, see database::begin_read(). Any
+    *  number of threads can read through views while the writer keeps modifying the database; a view is never
+    *  affected by those modifications. References obtained through a view remain valid while the view, or a
+    *  copy of it, is held.
+    */
+   class read_view {
+      public:
+         read_view() = default;
+
+         /// the database revision this view shows
+         int64_t revision()const { return _state->revision; }
+
+         /// false if the view could not be kept isolated from the writer; see pinnable_mapped_file::view
+         bool consistent()const { return _state->mapping->consistent(); }
+
+         template<typename MultiIndexType>
+         const generic_index<MultiIndexType>& get_index()const
+         {
+            typedef generic_index<MultiIndexType> index_type;
+            typedef const index_type*             index_type_ptr;
+            assert( _state->indices.size() > index_type::value_type::type_id );
+            assert( _state->indices[index_type::value_type::type_id] );
+            return *_state->mapping->translate( index_type_ptr( _state->indices[index_type::value_type::type_id] ) );
+         }
+
+         template<typename MultiIndexType, typename ByIndex>
+         auto get_index()const -> decltype( ((generic_index<MultiIndexType>*)( nullptr ))->indices().template get<ByIndex>() )
+         {
+            return get_index<MultiIndexType>().indices().template get<ByIndex>();
+         }
+
+         template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
+         const ObjectType* find( CompatibleKey&& key )const
+         {
+             typedef typename get_index_type< ObjectType >::type index_type;
+             const auto& idx = get_index< index_type >().indices().template get< IndexedByType >();
+             auto itr = idx.find( std::forward< CompatibleKey >( key ) );
+             if( itr == idx.end() ) return nullptr;
+             return &*itr;
+         }
+
+         template< typename ObjectType >
+         const ObjectType* find( oid< ObjectType > key = oid< ObjectType >() ) const
+         {
+             typedef typename get_index_type< ObjectType >::type index_type;
+             return get_index< index_type >().find( key );
+         }
+
+         template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
+         const ObjectType& get( CompatibleKey&& key )const
+         {
+             auto obj = find< ObjectType, IndexedByType >( std::forward< CompatibleKey >( key ) );
+             if( !obj ) {
+                std::stringstream ss;
+                ss << "unknown key (" << boost::core::demangle( typeid( key ).name() ) << "): " << key;
+                BOOST_THROW_EXCEPTION( std::out_of_range( ss.str().c_str() ) );
+             }
+             return *obj;
+         }
+
+         template< typename ObjectType >
+         const ObjectType& get( const oid< ObjectType >& key = oid< ObjectType >() )const
+         {
+             auto obj = find< ObjectType >( key );
+             if( !obj ) {
+                std::stringstream ss;
+                ss << "unknown key (" << boost::core::demangle( typeid( key ).name() ) << "): " << key._id;
+                BOOST_THROW_EXCEPTION( std::out_of_range( ss.str().c_str() ) );
+             }
+             return *obj;
+         }
+
+      private:
+         friend class database;
+
+         struct state {
+            std::shared_ptr<const pinnable_mapped_file::view>  mapping;
+            int64_t                                            revision = 0;
+            std::vector<const void*>                           indices;  ///< address in the database of each index, by type_id
+         };
+
+         read_view( std::shared_ptr<const state> s ):_state( std::move( s ) ){}
+
+         std::shared_ptr<const state> _state;
+   };
+
+   class worker_pool;
+
    /**
     *  This class
     */
@@ -696,12 +777,17 @@ namespace chainbase {
 
          database(const bfs::path& dir, open_flags write = read_only, uint64_t shared_file_size = 0, bool allow_dirty = false,
                   pinnable_mapped_file::map_mode = pinnable_mapped_file::map_mode::mapped,
-                  std::vector<std::string> hugepage_paths = std::vector<std::string>());
+                  std::vector<std::string> hugepage_paths = std::vector<std::string>(),
+                  const map_options& options = map_options());
          ~database();
          database(database&&) = default;
          database& operator=(database&&) = default;
          bool is_read_only() const { return _read_only; }
          void flush();
+         /// writes a compressed snapshot of the whole database; see pinnable_mapped_file::write_snapshot()
+         void write_snapshot(const bfs::path& path, unsigned num_threads = 0) const;
+         /// creates the database in dir from a snapshot, to be opened afterwards as usual
+         static void restore_snapshot(const bfs::path& snapshot_path, const bfs::path& dir, unsigned num_threads = 0);
          void set_require_locking( bool enable_require_locking );
 
 #ifdef CHAINBASE_CHECK_LOCKING
@@ -720,35 +806,46 @@ namespace chainbase {
          }
 #endif
 
+         /**
+          *  An undo session of the whole database. Opening one only bumps the revision; indices pick up undo
+          *  state for it lazily when first written to.
+          */
          struct session {
             public:
-               session( session&& s ):_index_sessions( std::move(s._index_sessions) ),_revision( s._revision ){}
-               session( vector<std::unique_ptr<abstract_session>>&& s ):_index_sessions( std::move(s) )
-               {
-                  if( _index_sessions.size() )
-                     _revision = _index_sessions[0]->revision();
-               }
+               session( session&& s ):_db( s._db ),_revision( s._revision ){ s._db = nullptr; }
 
                ~session() {
                   undo();
                }
 
+               /**
+                *  Leaves the UNDO state on the stack when session goes out of scope. Pushing the outermost open
+                *  session publishes a read view of the revision it completes, see database::begin_read().
+                */
                void push()
                {
-                  for( auto& i : _index_sessions ) i->push();
-                  _index_sessions.clear();
+                  if( _db && --_db->_open_sessions == 0 )
+                     _db->publish_read_view();
+                  _db = nullptr;
                }
 
+               /** combines this session with the prior session */
                void squash()
                {
-                  for( auto& i : _index_sessions ) i->squash();
-                  _index_sessions.clear();
+                  if( _db ) {
+                     --_db->_open_sessions;
+                     _db->squash();
+                  }
+                  _db = nullptr;
                }
 
                void undo()
                {
-                  for( auto& i : _index_sessions ) i->undo();
-                  _index_sessions.clear();
+                  if( _db ) {
+                     --_db->_open_sessions;
+                     _db->undo();
+                  }
+                  _db = nullptr;
                }
 
                int64_t revision()const { return _revision; }
@@ -756,30 +853,73 @@ namespace chainbase {
             private:
                friend class database;
                session(){}
+               session( database& db, int64_t revision ):_db( &db ),_revision( revision ){}
 
-               vector< std::unique_ptr<abstract_session> > _index_sessions;
-               int64_t _revision = -1;
+               database* _db = nullptr;
+               int64_t   _revision = -1;
          };
 
          session start_undo_session( bool enabled );
 
+         /**
+          *  Returns a view of the database as of the last published revision, to be read from any thread while
+          *  the writer continues. Requires the read_views and track_dirty_chunks map options. A view is published
+          *  whenever the outermost open undo session is pushed, so with a session per block and nested ones per
+          *  transaction the view shows the last pushed block, never a block in progress.
+          */
+         read_view begin_read()const;
+         /**
+          *  Publishes the current state for begin_read(). Returns false, leaving the previous view in place, if
+          *  no view could be mapped (for instance while too many older ones are still being read).
+          */
+         bool publish_read_view();
+
          int64_t revision()const {
              if( _index_list.size() == 0 ) return -1;
-             return _index_list[0]->revision();
+             return _undo_sessions->revision;
+         }
+
+         /// the revision undo_all() would return to, and the head revision
+         std::pair<int64_t, int64_t> undo_stack_revision_range()const {
+             return { _undo_sessions->begin, _undo_sessions->revision };
          }
 
          void undo();
          void squash();
+         /**
+          * Discards undo history up to and including revision. At most the configured commit reclaim limit
+          * of discarded values is destroyed right away; the rest is left to reclaim_undo_history() and to later
+          * writes, keeping large commits off the critical path when the limit is low.
+          */
          void commit( int64_t revision );
          void undo_all();
 
+         /// sets how many discarded undo values commit() destroys before returning; unlimited by default
+         void set_commit_reclaim_limit( size_t max_entries ) { _commit_reclaim_limit = max_entries; }
+         /// destroys up to max_entries values of committed undo history across all indices; returns how many
+         size_t reclaim_undo_history( size_t max_entries = std::numeric_limits<size_t>::max() );
 
-         void set_revision( uint64_t revision )
-         {
-             CHAINBASE_REQUIRE_WRITE_LOCK( "set_revision", uint64_t );
-             for( auto i : _index_list ) i->set_revision( revision );
-         }
+         /**
+          * Spreads the per-index work of undo() and of reclaiming committed history over up to threads threads,
+          * the calling one included; 1, the default, keeps everything on the calling thread. Each index is only
+          * ever worked on by one thread at a time, so the resulting contents match a serial run, but the order
+          * in which indices allocate from the segment, and so where their nodes land, varies between runs.
+          * While writes are tracked (track_dirty_chunks or read views), everything stays on the calling thread.
+          *
+          * Objects must not share node pools across types (i.e. a member container using node_allocator for
+          * the same node type in two different object types), as those pools are not synchronized.
+          */
+         void set_undo_threads( unsigned threads );
 
+         void set_revision( uint64_t revision );
+
+         /**
+          *  A digest of the contents of every index whose object type has an object_digest, independent of the
+          *  order objects were created, modified and removed in. Indices keep their part up to date as they change,
+          *  so this costs O(number of indices). Throws if an index's part is out of date, which opening the database
+          *  read_write fixes.
+          */
+         state_digest state_hash()const;
 
          template<typename MultiIndexType>
          void add_index() {
@@ -798,47 +938,29 @@ namespace chainbase {
                idx_ptr = _db_file.get_segment_manager()->find_no_lock< index_type >( type_name.c_str() ).first;
             else
                idx_ptr = _db_file.get_segment_manager()->find< index_type >( type_name.c_str() ).first;
-            bool first_time_adding = false;
             if( !idx_ptr ) {
                if( _read_only ) {
                   BOOST_THROW_EXCEPTION( std::runtime_error( "unable to find index for " + type_name + " in read only database" ) );
                }
-               first_time_adding = true;
                idx_ptr = _db_file.get_segment_manager()->construct< index_type >( type_name.c_str() )( index_alloc( _db_file.get_segment_manager() ) );
              }
 
             idx_ptr->validate();
 
-            // Ensure the undo stack of added index is consistent with the other indices in the database
-            if( _index_list.size() > 0 ) {
-               auto expected_revision_range = _index_list.front()->undo_stack_revision_range();
-               auto added_index_revision_range = idx_ptr->undo_stack_revision_range();
-
-               if( added_index_revision_range.first != expected_revision_range.first ||
-                   added_index_revision_range.second != expected_revision_range.second ) {
-
-                  if( !first_time_adding ) {
-                     BOOST_THROW_EXCEPTION( std::logic_error(
-                        "existing index for " + type_name + " has an undo stack (revision range [" +
-                        std::to_string(added_index_revision_range.first) + ", " + std::to_string(added_index_revision_range.second) +
-                        "]) that is inconsistent with other indices in the database (revision range [" +
-                        std::to_string(expected_revision_range.first) + ", " + std::to_string(expected_revision_range.second) +
-                        "]); corrupted database?"
-                     ) );
-                  }
-
-                  if( _read_only ) {
-                     BOOST_THROW_EXCEPTION( std::logic_error(
-                        "new index for " + type_name +
-                        " requires an undo stack that is consistent with other indices in the database; cannot fix in read-only mode"
-                     ) );
-                  }
-
-                  idx_ptr->set_revision( static_cast<uint64_t>(expected_revision_range.first) );
-                  while( idx_ptr->revision() < expected_revision_range.second ) {
-                     idx_ptr->start_undo_session(true).push();
-                  }
-               }
+            const auto& history = idx_ptr->undo_history();
+            if( !history.empty() && ( history.front().revision <= _undo_sessions->begin || history.top().revision > _undo_sessions->revision ) ) {
+               BOOST_THROW_EXCEPTION( std::logic_error(
+                  "existing index for " + type_name + " has undo history (revision range [" +
+                  std::to_string(history.front().revision - 1) + ", " + std::to_string(history.top().revision) +
+                  "]) outside the undo sessions of the database (revision range [" +
+                  std::to_string(_undo_sessions->begin) + ", " + std::to_string(_undo_sessions->revision) +
+                  "]); corrupted database?"
+               ) );
+            }
+            if( !_read_only ) {
+               idx_ptr->set_session_state( _undo_sessions );
+               idx_ptr->sync_id_table();
+               idx_ptr->sync_state_hash();
             }
 
             if( type_id >= _index_map.size() )
@@ -862,6 +984,22 @@ namespace chainbase {
             return _db_file.get_segment_manager()->get_free_memory();
          }
 
+         /**
+          *  Grows the database to new_size bytes without moving any object; see pinnable_mapped_file::grow().
+          *  With map_options::grow_threshold set this also happens by itself as objects are created and modified.
+          */
+         void grow( uint64_t new_size ) { _db_file.grow( new_size ); }
+         /// the size the database can grow to, see map_options::max_size
+         uint64_t max_size()const { return _db_file.max_size(); }
+
+         /**
+          *  True while a database opened with map_options::load_in_background is still used from its file. It
+          *  switches over to memory by itself at the first start_undo_session() or commit() after the load
+          *  finished; finish_loading() waits for the load and switches right away.
+          */
+         bool loading()const { return _db_file.loading(); }
+         void finish_loading() { _db_file.finish_loading( true ); }
+
          template<typename MultiIndexType>
          const generic_index<MultiIndexType>& get_index()const
          {
@@ -899,6 +1037,7 @@ namespace chainbase {
          const ObjectType* find( CompatibleKey&& key )const
          {
              CHAINBASE_REQUIRE_READ_LOCK("find", ObjectType);
+             CHAINBASE_TIME_OPERATION( operation_stats( ObjectType::type_id, index_operation::find ) );
              typedef typename get_index_type< ObjectType >::type index_type;
              const auto& idx = get_index< index_type >().indices().template get< IndexedByType >();
              auto itr = idx.find( std::forward< CompatibleKey >( key ) );
@@ -910,11 +1049,9 @@ namespace chainbase {
          const ObjectType* find( oid< ObjectType > key = oid< ObjectType >() ) const
          {
              CHAINBASE_REQUIRE_READ_LOCK("find", ObjectType);
+             CHAINBASE_TIME_OPERATION( operation_stats( ObjectType::type_id, index_operation::find ) );
              typedef typename get_index_type< ObjectType >::type index_type;
-             const auto& idx = get_index< index_type >().indices();
-             auto itr = idx.find( key );
-             if( itr == idx.end() ) return nullptr;
-             return &*itr;
+             return get_index< index_type >().find( key );
          }
 
          template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
@@ -947,6 +1084,8 @@ namespace chainbase {
          void modify( const ObjectType& obj, Modifier&& m )
          {
              CHAINBASE_REQUIRE_WRITE_LOCK("modify", ObjectType);
+             CHAINBASE_TIME_OPERATION( operation_stats( ObjectType::type_id, index_operation::modify ) );
+             grow_if_needed();
              typedef typename get_index_type<ObjectType>::type index_type;
              get_mutable_index<index_type>().modify( obj, m );
          }
@@ -955,6 +1094,7 @@ namespace chainbase {
          void remove( const ObjectType& obj )
          {
              CHAINBASE_REQUIRE_WRITE_LOCK("remove", ObjectType);
+             CHAINBASE_TIME_OPERATION( operation_stats( ObjectType::type_id, index_operation::remove ) );
              typedef typename get_index_type<ObjectType>::type index_type;
              return get_mutable_index<index_type>().remove( obj );
          }
@@ -963,10 +1103,43 @@ namespace chainbase {
          const ObjectType& create( Constructor&& con )
          {
              CHAINBASE_REQUIRE_WRITE_LOCK("create", ObjectType);
+             CHAINBASE_TIME_OPERATION( operation_stats( ObjectType::type_id, index_operation::emplace ) );
+             grow_if_needed();
              typedef typename get_index_type<ObjectType>::type index_type;
              return get_mutable_index<index_type>().emplace( std::forward<Constructor>(con) );
          }
 
+         /**
+          *  Creates count objects of ObjectType, calling con( obj, i ) with i from 0 to count-1 to construct each,
+          *  and returns the id of the first. Meant for loading snapshots and genesis state, where it is much
+          *  cheaper than count calls to create(); see generic_index::reserve() and generic_index::bulk_emplace().
+          *  Secondary indices are not bulk built, each object is inserted into them as create() would. Throws
+          *  std::logic_error while there is an undo stack, as what it creates cannot be undone.
+          */
+         template<typename ObjectType, typename Constructor>
+         typename ObjectType::id_type bulk_create( size_t count, Constructor&& con )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("bulk_create", ObjectType);
+             if( _undo_sessions->enabled() )
+                BOOST_THROW_EXCEPTION( std::logic_error("cannot bulk create objects while there is an existing undo stack") );
+             typedef typename get_index_type<ObjectType>::type index_type;
+             auto& idx = get_mutable_index<index_type>();
+             const typename ObjectType::id_type first = idx.next_id();
+             grow_if_needed();
+             idx.reserve( count );
+             // in batches, so the database can grow in between
+             for( size_t done = 0; done < count; ) {
+                const size_t batch = std::min<size_t>( count - done, 4096 );
+                idx.bulk_emplace( batch, [&]( ObjectType& obj, size_t i ) { con( obj, done + i ); } );
+                done += batch;
+                grow_if_needed();
+             }
+             return first;
+         }
+
+         /// a copy of the database's current statistics, see database_stats
+         database_stats stats()const;
+
          database_index_row_count_multiset row_count_per_index()const {
             database_index_row_count_multiset ret;
             for(const auto& ai_ptr : _index_map) {
@@ -978,8 +1151,31 @@ namespace chainbase {
          }
 
       private:
+         abstract_index& touched_index( const undo_session_state::touched_index& t )const;
+         /// calls f on every index in indices, on the undo threads when there are any
+         void for_each_index( const std::vector<abstract_index*>& indices, const std::function<void( abstract_index& )>& f );
+
+         void grow_if_needed() {
+            if( BOOST_UNLIKELY( get_free_memory() < _db_file.grow_threshold() ) )
+               _db_file.grow_if_needed();
+         }
+
+#ifdef CHAINBASE_COLLECT_STATS
+         latency_recorder& operation_stats( uint16_t type_id, index_operation op )const {
+            return _index_map[type_id]->operation_stats( op );
+         }
+         /// held by pointer so the database stays movable
+         std::unique_ptr<latency_recorder>                           _session_stats{ new latency_recorder };
+#endif
+
          pinnable_mapped_file                                        _db_file;
          bool                                                        _read_only = false;
+         undo_session_state*                                         _undo_sessions = nullptr;
+         size_t                                                      _commit_reclaim_limit = std::numeric_limits<size_t>::max();
+         std::shared_ptr<worker_pool>                                _undo_workers;  ///< held by shared_ptr so the type can stay private
+         bool                                                        _read_views = false;
+         std::shared_ptr<const read_view::state>                     _read_view;  ///< accessed with std::atomic_load/store
+         int64_t                                                     _open_sessions = 0;  ///< enabled sessions not pushed, squashed or undone yet
 
          /**
           * This is a sparse list of known indices kept to accelerate creation of undo sessions
@@ -999,5 +1195,5 @@ namespace chainbase {
    };
 
    template<typename Object, typename... Args>
-   using shared_multi_index_container = boost::multi_index_container<Object,Args..., chainbase::allocator<Object> >;
+   using shared_multi_index_container = boost::multi_index_container<Object,Args..., chainbase::node_allocator<Object> >;
 }  // namepsace chainbase
@@ -5,7 +5,8 @@
 namespace chainbase {
 
 constexpr size_t header_size = 1024;
-constexpr uint64_t header_id = 0x3242444f49534f45ULL; //"EOSIODB2" little endian
+/// raised whenever what the segment holds changes layout, so older files are refused instead of misread
+constexpr uint64_t header_id = 0x3442444f49534f45ULL; //"EOSIODB4" little endian
 
 struct environment  {
    environment() {
@@ -68,9 +69,11 @@ struct db_header  {
    uint64_t id = header_id;
    bool dirty = false;
    environment dbenviron;
+   uint64_t epoch = 0; ///< checkpoints written through a journal so far; files from before it have zeros here
 } __attribute__ ((packed));
 
 constexpr size_t header_dirty_bit_offset = offsetof(db_header, dirty);
+constexpr size_t header_epoch_offset = offsetof(db_header, epoch);
 
 static_assert(sizeof(db_header) <= header_size, "DB header struct too large");
 
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/vector.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+
+#include <chainbase/pinnable_mapped_file.hpp>
+
+namespace chainbase {
+
+   namespace bip = boost::interprocess;
+
+   /**
+    *  Maps the ids of one generic_index to its objects, kept inside the segment next to the index. Ids are handed
+    *  out densely, so the table is a directory of fixed size chunks indexed by id: finding an object costs a read
+    *  of the directory, which stays cached, and one of the chunk, instead of a descent through the ordered index.
+    *
+    *  Chunks are allocated as ids reach them and freed once every id in them was removed, so the table grows
+    *  without reallocating more than the small directory, and a table whose oldest objects are removed first
+    *  gives that memory back.
+    */
+   template<typename value_type>
+   class id_table {
+      public:
+         typedef pinnable_mapped_file::segment_manager       segment_manager;
+         template<typename T>
+         using allocator = bip::allocator<T, segment_manager>;
+
+         constexpr static unsigned chunk_bits = 12;
+         constexpr static size_t   chunk_size = size_t(1) << chunk_bits;
+
+         template<typename Allocator>
+         id_table( const Allocator& a ) : _chunks( allocator<chunk_ptr>( a.get_segment_manager() ) ) {}
+         ~id_table() { clear(); }
+
+         id_table( const id_table& ) = delete;
+         id_table& operator=( const id_table& ) = delete;
+
+         /// false until rebuild(); lookups must not rely on a table that is not ready
+         bool   ready()const { return _ready; }
+         /// number of ids mapped
+         size_t size()const { return _size; }
+         /// bytes of segment memory held by the directory and the chunks
+         size_t memory_bytes()const { return _chunks.capacity() * sizeof(chunk_ptr) + _chunk_count * sizeof(chunk); }
+
+         const value_type* find( int64_t id )const {
+            const uint64_t c = uint64_t(id) >> chunk_bits;
+            if( c >= _chunks.size() || !_chunks[c] )
+               return nullptr;
+            return _chunks[c]->slots[id & (chunk_size - 1)].get();
+         }
+
+         /// allocates what set( id, ... ) needs, so that set() itself cannot fail
+         void reserve( int64_t id ) {
+            if( id < 0 )
+               BOOST_THROW_EXCEPTION( std::logic_error( "negative object id" ) );
+            const uint64_t c = uint64_t(id) >> chunk_bits;
+            if( c >= _chunks.size() )
+               _chunks.resize( c + 1 );
+            if( !_chunks[c] ) {
+               segment_manager* manager = _chunks.get_allocator().get_segment_manager();
+               _chunks[c] = new( manager->allocate( sizeof(chunk) ) ) chunk;
+               ++_chunk_count;
+            }
+         }
+
+         /// @pre reserve( id ) was called and id is not mapped
+         void set( int64_t id, const value_type* v ) {
+            chunk& ch = *_chunks[uint64_t(id) >> chunk_bits];
+            ch.slots[id & (chunk_size - 1)] = v;
+            ++ch.live;
+            ++_size;
+         }
+
+         void erase( int64_t id ) {
+            const uint64_t c = uint64_t(id) >> chunk_bits;
+            if( c >= _chunks.size() || !_chunks[c] )
+               return;
+            chunk& ch = *_chunks[c];
+            auto& slot = ch.slots[id & (chunk_size - 1)];
+            if( !slot )
+               return;
+            slot = nullptr;
+            --_size;
+            if( --ch.live == 0 )
+               free_chunk( c );
+         }
+
+         /// frees everything; the table is not ready afterwards
+         void clear() {
+            _ready = false;
+            for( uint64_t c = 0; c < _chunks.size(); ++c )
+               if( _chunks[c] )
+                  free_chunk( c );
+            _chunks.clear();
+            _chunks.shrink_to_fit();
+            _size = 0;
+         }
+
+         /// maps the id of every object in the range, replacing whatever the table held, and marks it ready
+         template<typename Range>
+         void rebuild( const Range& objects ) {
+            clear();
+            for( const value_type& v : objects ) {
+               reserve( v.id._id );
+               set( v.id._id, &v );
+            }
+            _ready = true;
+         }
+
+      private:
+         struct chunk {
+            bip::offset_ptr<const value_type>  slots[chunk_size];
+            uint32_t                           live = 0;
+         };
+         typedef bip::offset_ptr<chunk> chunk_ptr;
+
+         void free_chunk( uint64_t c ) {
+            chunk* ch = _chunks[c].get();
+            _chunks[c] = nullptr;
+            ch->~chunk();
+            _chunks.get_allocator().get_segment_manager()->deallocate( ch );
+            --_chunk_count;
+         }
+
+         bip::vector< chunk_ptr, allocator<chunk_ptr> >  _chunks;
+         size_t                                          _chunk_count = 0;
+         size_t                                          _size = 0;
+         bool                                            _ready = false;
+   };
+
+}  // namespace chainbase
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+
+#include <algorithm>
+#include <cstddef>
+
+#include <chainbase/pinnable_mapped_file.hpp>
+
+namespace chainbase {
+
+   namespace bip = boost::interprocess;
+
+   /**
+    *  A free list of equally sized nodes carved out of blocks taken from the segment manager. It lives inside
+    *  the segment, one per node type, so every container of that type recycles the same nodes. Blocks are never
+    *  handed back to the segment manager: nodes of a type that shrinks stay reserved for that type.
+    *
+    *  Like the rest of the database it is not synchronized; all writes must be serialized by the caller.
+    */
+   template<typename T>
+   class node_pool {
+      public:
+         typedef pinnable_mapped_file::segment_manager segment_manager;
+
+         constexpr static size_t nodes_per_block = 64;
+         constexpr static size_t node_size = (std::max(sizeof(T), sizeof(void*)) + alignof(T) - 1) / alignof(T) * alignof(T);
+
+         T* allocate( segment_manager* manager ) {
+            if( !_free_list )
+               add_blocks( manager, 1 );
+            free_node* result = _free_list.get();
+            _free_list = result->next;
+            --_free_count;
+            return reinterpret_cast<T*>( result );
+         }
+
+         /// makes sure the next count allocations need no more memory, drawing what is missing in one contiguous block
+         void reserve( segment_manager* manager, size_t count ) {
+            if( count > _free_count )
+               add_blocks( manager, ( count - _free_count + nodes_per_block - 1 ) / nodes_per_block );
+         }
+
+         void deallocate( T* p ) {
+            free_node* node = reinterpret_cast<free_node*>( p );
+            node->next = _free_list;
+            _free_list = node;
+            ++_free_count;
+         }
+
+         /// nodes allocated from the segment manager but currently unused
+         size_t free_nodes()const { return _free_count; }
+         /// bytes taken from the segment manager, in use or not
+         size_t reserved_bytes()const { return _block_count * nodes_per_block * node_size; }
+
+         /// the pool for T in the segment, or nullptr if no node of T was allocated yet
+         static const node_pool* find( segment_manager* manager ) {
+            return manager->template find_no_lock<node_pool>( bip::unique_instance ).first;
+         }
+
+      private:
+         struct free_node {
+            bip::offset_ptr<free_node> next;
+         };
+
+         /// nodes are handed out in address order, so consecutive allocations end up next to each other
+         void add_blocks( segment_manager* manager, size_t blocks ) {
+            static_assert( alignof(T) <= 16, "segment manager allocations are only 16 byte aligned" );
+            const size_t nodes = blocks * nodes_per_block;
+            char* block = static_cast<char*>( manager->allocate( nodes * node_size ) );
+            for( size_t i = nodes; i-- > 0; ) {
+               free_node* node = reinterpret_cast<free_node*>( block + i * node_size );
+               node->next = _free_list;
+               _free_list = node;
+            }
+            _free_count += nodes;
+            _block_count += blocks;
+         }
+
+         bip::offset_ptr<free_node> _free_list;
+         size_t                     _free_count = 0;
+         size_t                     _block_count = 0;
+   };
+
+   /**
+    *  Drop-in replacement for chainbase::allocator<T> for node based containers (multi_index_container,
+    *  boost::interprocess::map/set). Single element allocations come from the segment resident node_pool<T>
+    *  instead of the segment manager's best-fit search, which keeps nodes of the same table together and avoids
+    *  fragmenting the segment as tables grow and shrink. Array allocations still go to the segment manager.
+    *
+    *  It converts to and from chainbase::allocator<U>, so objects constructed with it can pass it on to
+    *  shared_string and other members that use the general purpose allocator.
+    */
+   template<typename T>
+   class node_allocator {
+      public:
+         typedef pinnable_mapped_file::segment_manager  segment_manager;
+         typedef T                                      value_type;
+         typedef bip::offset_ptr<T>                     pointer;
+         typedef bip::offset_ptr<const T>               const_pointer;
+         typedef bip::offset_ptr<void>                  void_pointer;
+         typedef T&                                     reference;
+         typedef const T&                               const_reference;
+         typedef std::size_t                            size_type;
+         typedef std::ptrdiff_t                         difference_type;
+
+         template<typename U>
+         struct rebind { typedef node_allocator<U> other; };
+
+         node_allocator( segment_manager* manager ) : _manager(manager) {}
+         node_allocator( const node_allocator& o ) : _manager(o._manager), _pool(o._pool) {}
+         template<typename U>
+         node_allocator( const node_allocator<U>& o ) : _manager(o.get_segment_manager()) {}
+         template<typename U>
+         node_allocator( const bip::allocator<U, segment_manager>& o ) : _manager(o.get_segment_manager()) {}
+
+         node_allocator& operator=( const node_allocator& o ) {
+            _manager = o._manager;
+            _pool = o._pool;
+            return *this;
+         }
+
+         template<typename U>
+         operator bip::allocator<U, segment_manager>()const { return bip::allocator<U, segment_manager>( get_segment_manager() ); }
+
+         pointer allocate( size_type n ) {
+            if( n == 1 )
+               return pointer( pool().allocate( get_segment_manager() ) );
+            return pointer( static_cast<T*>( get_segment_manager()->allocate( n * sizeof(T) ) ) );
+         }
+
+         void deallocate( const pointer& p, size_type n ) {
+            if( n == 1 )
+               pool().deallocate( p.get() );
+            else
+               get_segment_manager()->deallocate( p.get() );
+         }
+
+         segment_manager* get_segment_manager()const { return _manager.get(); }
+
+         /// the pool single nodes are drawn from, created in the segment on first use
+         node_pool<T>& pool() {
+            if( !_pool )
+               _pool = get_segment_manager()->template find_or_construct< node_pool<T> >( bip::unique_instance )();
+            return *_pool;
+         }
+
+         friend bool operator==( const node_allocator& a, const node_allocator& b ) { return a._manager == b._manager; }
+         friend bool operator!=( const node_allocator& a, const node_allocator& b ) { return a._manager != b._manager; }
+
+      private:
+         bip::offset_ptr<segment_manager> _manager;
+         bip::offset_ptr<node_pool<T>>    _pool;
+   };
+
+}  // namespace chainbase
@@ -5,11 +5,106 @@
 #include <boost/filesystem.hpp>
 #include <boost/asio/io_service.hpp>
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
 namespace chainbase {
 
 namespace bip = boost::interprocess;
 namespace bfs = boost::filesystem;
 
+/// where the memory of a database in heap or locked mode is placed on hosts with several NUMA nodes
+enum class numa_policy : uint8_t {
+   none,        ///< left to the process' policy, usually the node of the thread that first touches a page
+   bind,        ///< only on the given nodes
+   interleave,  ///< page by page round robin over the given nodes
+   preferred    ///< on the first given node while it has memory, elsewhere once it does not
+};
+
+/**
+ * Tuning knobs for how a database file is brought into and out of memory. The defaults are
+ * suitable for most deployments; none of these change the on-disk format.
+ */
+struct map_options {
+   /**
+    * worker threads used to preload the database file in heap and locked mode, or to warm it up in mapped mode,
+    * and to read and write it when direct_file_io cannot use io_uring; 0 uses one per core
+    */
+   unsigned preload_threads = 0;
+   /**
+    * In heap and locked mode, and with journal, track which parts of memory were written so only those are saved
+    * back to the file, and let checkpoints run in the background. Without it every checkpoint writes the whole database while
+    * writes are held off. Required by read_views. Nothing else turns it on. It comes at a cost to the whole
+    * process: tracked memory is write protected until written, and the first write to it is caught by a
+    * SIGSEGV and SIGBUS handler installed for the process. A system call such as read(), pread() or
+    * recv() writing straight into the database fails with EFAULT, and debuggers and crash reporters see those
+    * faults too; a handler installed later must pass faults it does not recognise on. Not available on win32
+    */
+   bool     track_dirty_chunks = false;
+   /// in heap and locked mode, or with journal, how often database::commit() checkpoints to the file, in the background with track_dirty_chunks; 0 disables
+   std::chrono::seconds checkpoint_interval = std::chrono::seconds(0);
+   /// keep a read-only view of the last pushed revision that other threads can read while the writer continues; needs track_dirty_chunks
+   bool     read_views = false;
+   /// address space reserved up front for the database to grow into without moving; 0 keeps the size it is opened with
+   uint64_t max_size = 0;
+   /// with max_size set, grow the database once its free memory drops below this many bytes; 0 only grows on request
+   uint64_t grow_threshold = 0;
+   /// bytes added each time the database grows by itself; 0 doubles it. Growth always stops at max_size
+   uint64_t grow_increment = 0;
+   /**
+    * In heap and locked mode, a writer keeps the in-memory database in a POSIX shared memory object of this
+    * name, or a file of this name in the hugepage mount it uses, instead of private memory. A read_only open in
+    * heap or locked mode with the same name then maps that memory rather than loading the file, and sees the
+    * writer's live state without copying it. Linux only; empty keeps the memory private.
+    */
+   std::string shared_name;
+   /**
+    * In heap and mapped mode, place the database at an address suitable for transparent huge pages and ask the
+    * kernel to back it with them, cutting TLB misses on lookups. Whether it does depends on its settings
+    * (transparent_hugepage/shmem_enabled for heap mode) and, in mapped mode, on the file system. Linux only
+    */
+   bool transparent_huge_pages = false;
+   /// in heap and locked mode, how the memory holding the database is spread over NUMA nodes (Linux only)
+   numa_policy numa = numa_policy::none;
+   /// the nodes numa refers to, one bit per node starting at node 0
+   uint64_t numa_nodes = 0;
+   /**
+    * In mapped mode, remember which parts of the file were in memory when a writer closes the database, and read
+    * those parts back in the background, in file order, when it is opened again
+    */
+   bool     warm_up = false;
+   /**
+    * In heap and locked mode, open a writable database on its file mapping right away and load it into memory
+    * on a background thread. The database switches over to memory at the first undo session or commit after
+    * the load finished, at the same address, so nothing it holds has to move. With track_dirty_chunks only the
+    * chunks written in the meantime are copied again at the switch, otherwise the whole database is. Cannot be combined with read_views or shared_name. Linux only
+    */
+   bool     load_in_background = false;
+   /**
+    * In heap and locked mode, read the database file when loading it and write it back at checkpoints with
+    * O_DIRECT, queued on io_uring where the kernel allows it, so neither fills the page cache with a second
+    * copy of the database. Falls back to going through the page cache where the file system does not support
+    * it. Linux only
+    */
+   bool     direct_file_io = false;
+   /**
+    * Keep the database file consistent across crashes instead of marking it dirty while it is open. In mapped mode
+    * the file is mapped privately, so changes only reach it at checkpoints: flush(), close, and commits every
+    * checkpoint_interval. A checkpoint first writes everything it changes to shared_memory.journal and syncs it,
+    * then updates the file; an open after a crash finishes a checkpoint whose journal was completely written and
+    * otherwise finds the file at the previous one. Heap and locked mode checkpoint through the journal as well.
+    * Cannot be combined with load_in_background, or with read_views in mapped mode. Not available on win32
+    */
+   bool     journal = false;
+};
+
+class write_tracker;
+class working_set;
+class direct_io;
+class journal;
+
 class pinnable_mapped_file {
    public:
       typedef typename bip::managed_mapped_file::segment_manager segment_manager;
@@ -20,21 +115,135 @@ class pinnable_mapped_file {
          locked
       };
 
-      pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty, map_mode mode, std::vector<std::string> hugepage_paths);
+      pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty, map_mode mode, std::vector<std::string> hugepage_paths,
+                           const map_options& options = map_options());
       pinnable_mapped_file(pinnable_mapped_file&& o);
       pinnable_mapped_file& operator=(pinnable_mapped_file&&);
       pinnable_mapped_file(const pinnable_mapped_file&) = delete;
       pinnable_mapped_file& operator=(const pinnable_mapped_file&) = delete;
       ~pinnable_mapped_file();
 
+      /**
+       * A read-only mapping of the whole database as it was when the view was published. It aliases the live
+       * memory until the writer first touches a chunk after publishing; the write fault then gives the view a
+       * private copy of that chunk's old contents. Every object of the database can therefore be read through
+       * the view at its translated address, from any thread, while the writer continues.
+       */
+      class view {
+         public:
+            virtual ~view() = default;
+
+            /// the address in this view of what lives at p in the database
+            template<typename T>
+            const T* translate(const T* p) const {
+               return reinterpret_cast<const T*>(_base + (reinterpret_cast<const char*>(p) - _live_base));
+            }
+            /// false once a write could not be kept out of this view, or the database was closed
+            virtual bool consistent() const = 0;
+
+         protected:
+            view(const char* base, const char* live_base) : _base(base), _live_base(live_base) {}
+
+         private:
+            const char* const _base;
+            const char* const _live_base;
+      };
+
       segment_manager* get_segment_manager() const { return _segment_manager;}
 
+      /// bytes of the database, header included
+      uint64_t size() const { return _size; }
+      /// the size the database can grow to without moving, see map_options::max_size
+      uint64_t max_size() const { return _capacity; }
+
+      /**
+       * Grows the database to new_size bytes, a multiple of 1MB and of the page size no larger than max_size().
+       * The file and, in heap and locked mode, the memory holding the database are extended into the address
+       * range reserved at open, so nothing moves. Must not run concurrently with writes to the database.
+       * Other processes that have the file mapped only see the added memory once they reopen it.
+       */
+      void grow(uint64_t new_size);
+      /// free memory below which grow_if_needed() grows the database; 0 once it cannot grow any further
+      uint64_t grow_threshold() const { return _grow_threshold; }
+      /**
+       * Grows the database by the configured increment if its free memory is below grow_threshold(). A failure
+       * to grow is reported rather than thrown, and stops further attempts; allocations then fail as usual
+       * once the memory is used up.
+       */
+      void grow_if_needed();
+
+      /**
+       * Makes the file on disk reflect the current state. In mapped mode this syncs the mapping; in heap and
+       * locked mode, and with the journal map option, it writes back everything modified since the last
+       * checkpoint and, once that is durable, clears the dirty flag in the file. Must not run concurrently with
+       * writes to the database.
+       */
+      void flush();
+      /// true when a checkpoint interval is configured, has elapsed, and no checkpoint is in progress
+      bool checkpoint_due() const;
+      /**
+       * Starts a checkpoint of the current state and returns once the modified chunks are write protected;
+       * a background thread copies them to the file. A write that reaches a chunk before it has been copied
+       * preserves that chunk first, so the file ends up with exactly the state at the time of this call.
+       * Must not run concurrently with writes to the database.
+       */
+      void begin_checkpoint();
+
+      /**
+       * Writes a compressed copy of the whole database file to path. All-zero regions are left out and the
+       * rest is compressed in independent blocks on num_threads threads (0 uses one per core). Must not run
+       * concurrently with writes to the database.
+       */
+      void write_snapshot(const bfs::path& path, unsigned num_threads = 0) const;
+      /**
+       * Recreates the database file in dir from a snapshot made by write_snapshot(). Refuses to overwrite an
+       * existing database file, verifies every block's checksum, and only moves the file into place once it
+       * is complete.
+       */
+      static void restore_snapshot(const bfs::path& snapshot_path, const bfs::path& dir, unsigned num_threads = 0);
+
+      /**
+       * Publishes a view of the current state; see view. Requires the read_views map option on a writable
+       * database. Returns nullptr if no view could be mapped, for instance because too many are still held.
+       * Must not run concurrently with writes to the database.
+       */
+      std::shared_ptr<const view> publish_view();
+      /// true while writes to the database are caught by the write tracker, for track_dirty_chunks or read views
+      bool tracking_writes() const { return _write_tracker != nullptr; }
+
+      /// true while the database is served from its file and loaded into memory in the background
+      bool loading() const { return _loader != nullptr; }
+      /**
+       * Switches a database that is loading in the background over to memory once the load has finished, or
+       * with wait set, after waiting for it to finish. Does nothing if it is not loading. Must not run
+       * concurrently with writes to the database.
+       */
+      void finish_loading(bool wait);
+
    private:
+      class checkpointer;
+      class background_loader;
+
       void                                          set_mapped_file_db_dirty(bool);
-      void                                          load_database_file(boost::asio::io_service& sig_ios);
-      void                                          save_database_file();
-      bool                                          all_zeros(char* data, size_t sz);
+      void                                          load_database_file(boost::asio::io_service& sig_ios, const map_options& options);
+      static void                                   copy_database_file(const char* src, char* dst, size_t size, const std::vector<char>& has_data,
+                                                                       unsigned num_threads, direct_io* direct, bool report,
+                                                                       const std::function<bool()>& keep_going);
+      std::unique_ptr<direct_io>                    open_direct_io(const map_options& options, bool writable) const;
+      std::vector<char>                             find_data_pieces() const;
+      static bool                                   all_zeros(const char* data, size_t sz);
       bip::mapped_region                            get_huge_region(const std::vector<std::string>& huge_paths);
+      bip::mapped_region                            get_growable_region();
+      int                                           create_memory_file();
+      bip::mapped_region                            attach_shared_region(const std::vector<std::string>& hugepage_paths);
+      size_t                                        tracking_chunk_size() const;
+      void                                          start_write_tracking(bip::mapped_region& region, bool track_dirty_chunks);
+      void                                          use_memory(const map_options& options);
+      bip::mapped_region                            map_database_file(bip::mode_t access, uint64_t size, size_t alignment);
+      void                                          place_memory(bip::mapped_region& region, const map_options& options);
+      bfs::path                                     working_set_path() const { return _data_file_path.parent_path() / "shared_memory.working_set"; }
+      bfs::path                                     journal_path() const { return _data_file_path.parent_path() / "shared_memory.journal"; }
+      std::unique_ptr<journal>                      open_journal(const map_options& options) const;
 
       bip::file_lock                                _mapped_file_lock;
       bfs::path                                     _data_file_path;
@@ -52,8 +261,26 @@ class pinnable_mapped_file {
 #endif
 
       segment_manager*                              _segment_manager = nullptr;
+      map_mode                                      _mode = mapped;
+      size_t                                        _region_page_size = 0;
+      size_t                                        _huge_page_alignment = 0; ///< transparent huge page size when they are requested
+      uint64_t                                      _size = 0;
+      uint64_t                                      _capacity = 0;
+      uint64_t                                      _grow_threshold = 0;
+      uint64_t                                      _grow_increment = 0;
+      int                                           _memory_fd = -1; ///< backs the in-memory copy when it can grow or is shared
+      std::string                                   _shared_name;    ///< see map_options::shared_name
+      std::string                                   _shared_object;  ///< the shared memory object or hugepage file to remove on close
+      bool                                          _shared_object_is_shm = false;
+      std::unique_ptr<write_tracker>                _write_tracker;
+      std::unique_ptr<checkpointer>                 _checkpointer;
+      std::unique_ptr<working_set>                  _warm_up;
+      bool                                          _record_working_set = false;
+      bool                                          _background_load = false; ///< see map_options::load_in_background
+      std::unique_ptr<background_loader>            _loader;
 
       constexpr static unsigned                     _db_size_multiple_requirement = 1024*1024; //1MB
+      constexpr static size_t                       _preload_batch_size = 64*1024*1024; //64MB
 };
 
 std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runtime);
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <boost/interprocess/containers/string.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace chainbase {
+
+   namespace bip = boost::interprocess;
+
+   /**
+    *  A 128 bit hash of a multiset of objects: the sum, modulo 2^128, of the hashes of its members. Adding and
+    *  removing members in any order gives the same digest as building the set from scratch, so an index can keep
+    *  the digest of its contents up to date with a constant amount of work per change.
+    *
+    *  The member hashes are not cryptographic; digests tell apart states that diverged by accident, not states
+    *  crafted to collide.
+    */
+   struct state_digest {
+      uint64_t low = 0;
+      uint64_t high = 0;
+
+      state_digest& operator+=( const state_digest& o ) {
+         low += o.low;
+         high += o.high + ( low < o.low );
+         return *this;
+      }
+
+      state_digest& operator-=( const state_digest& o ) {
+         const uint64_t borrow = low < o.low;
+         low -= o.low;
+         high -= o.high + borrow;
+         return *this;
+      }
+
+      friend bool operator==( const state_digest& a, const state_digest& b ) { return a.low == b.low && a.high == b.high; }
+      friend bool operator!=( const state_digest& a, const state_digest& b ) { return !( a == b ); }
+
+      /// 32 hex digits, most significant first
+      std::string to_string()const {
+         static const char digits[] = "0123456789abcdef";
+         std::string s( 32, '0' );
+         for( int i = 0; i < 16; ++i ) {
+            s[15 - i] = digits[( high >> ( 4 * i ) ) & 0xf];
+            s[31 - i] = digits[( low >> ( 4 * i ) ) & 0xf];
+         }
+         return s;
+      }
+   };
+
+   /**
+    *  Hashes the bytes fed to it into a state_digest. Values are fed in their in-memory representation, so
+    *  digests only compare between machines of the same byte order.
+    */
+   class object_hasher {
+      public:
+         void update( const void* data, size_t size ) {
+            const char* p = static_cast<const char*>( data );
+            _length += size;
+            while( size ) {
+               const size_t n = std::min( size, sizeof(_buffer) - _buffered );
+               std::memcpy( reinterpret_cast<char*>( &_buffer ) + _buffered, p, n );
+               _buffered += n;
+               p += n;
+               size -= n;
+               if( _buffered == sizeof(_buffer) ) {
+                  mix( _a, _b, _buffer );
+                  _buffer = 0;
+                  _buffered = 0;
+               }
+            }
+         }
+
+         /// feeds v's bytes; T must not contain padding or pointers
+         template<typename T>
+         object_hasher& operator()( const T& v ) {
+            static_assert( std::is_trivially_copyable<T>::value, "only values without indirection can be hashed bytewise" );
+            update( &v, sizeof(v) );
+            return *this;
+         }
+
+         template<typename C, typename Traits, typename Allocator>
+         object_hasher& operator()( const bip::basic_string<C, Traits, Allocator>& s ) {
+            return hash_string( s );
+         }
+
+         template<typename C, typename Traits, typename Allocator>
+         object_hasher& operator()( const std::basic_string<C, Traits, Allocator>& s ) {
+            return hash_string( s );
+         }
+
+         state_digest digest()const {
+            uint64_t a = _a, b = _b;
+            mix( a, b, _buffer ^ ( uint64_t(_length) << 56 ) );
+            state_digest d;
+            d.low = fmix( a ^ _length );
+            d.high = fmix( b + d.low );
+            return d;
+         }
+
+      private:
+         template<typename String>
+         object_hasher& hash_string( const String& s ) {
+            ( *this )( uint64_t( s.size() ) );
+            update( s.data(), s.size() * sizeof( typename String::value_type ) );
+            return *this;
+         }
+
+         static uint64_t rotl( uint64_t x, int r ) { return ( x << r ) | ( x >> ( 64 - r ) ); }
+
+         static void mix( uint64_t& a, uint64_t& b, uint64_t w ) {
+            a = rotl( a ^ ( w * 0x87c37b91114253d5ULL ), 31 ) * 0x4cf5ad432745937fULL;
+            b = ( rotl( b, 27 ) ^ ( w * 0x9e3779b97f4a7c15ULL ) ) * 0xc2b2ae3d27d4eb4fULL + a;
+         }
+
+         /// the MurmurHash3 finalizer
+         static uint64_t fmix( uint64_t k ) {
+            k ^= k >> 33;
+            k *= 0xff51afd7ed558ccdULL;
+            k ^= k >> 33;
+            k *= 0xc4ceb9fe1a85ec53ULL;
+            k ^= k >> 33;
+            return k;
+         }
+
+         uint64_t _a = 0x243f6a8885a308d3ULL;
+         uint64_t _b = 0x13198a2e03707344ULL;
+         uint64_t _buffer = 0;
+         size_t   _buffered = 0;
+         size_t   _length = 0;
+   };
+
+   /**
+    *  Specialize to include the objects of a type in database::state_hash():
+    *
+    *     template<> struct object_digest<book> {
+    *        static void write( const book& b, object_hasher& h ) { h( b.id )( b.a )( b.b ); }
+    *     };
+    *
+    *  write() must feed everything that makes up the object's state, and nothing that depends on where the
+    *  object is stored, such as pointers or padding bytes.
+    */
+   template<typename T>
+   struct object_digest {};
+
+   template<typename T, typename = void>
+   struct has_object_digest : std::false_type {};
+
+   template<typename T>
+   struct has_object_digest<T, decltype( void( &object_digest<T>::write ) )> : std::true_type {};
+
+   template<typename T>
+   state_digest digest_object( const T& v ) {
+      object_hasher h;
+      object_digest<T>::write( v, h );
+      return h.digest();
+   }
+
+}  // namespace chainbase
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#ifdef CHAINBASE_COLLECT_STATS
+   #define CHAINBASE_TIME_OPERATION(recorder) chainbase::operation_timer _chainbase_operation_timer( recorder )
+#else
+   #define CHAINBASE_TIME_OPERATION(recorder)
+#endif
+
+namespace chainbase {
+
+   /// the operations timed per index when built with CHAINBASE_COLLECT_STATS
+   enum class index_operation : uint8_t {
+      emplace,
+      modify,
+      remove,
+      find,
+      undo,
+      squash,
+      commit
+   };
+   constexpr size_t num_index_operations = 7;
+
+   const char* to_string( index_operation op );
+
+   /**
+    *  Operation latencies in power of two buckets. Bucket i counts operations that took less than
+    *  upper_bound_ns( i ); the last bucket counts everything slower than that.
+    */
+   struct latency_histogram {
+      constexpr static size_t num_buckets = 29;
+
+      static uint64_t upper_bound_ns( size_t bucket ) { return uint64_t(16) << bucket; }
+      static size_t bucket_of( uint64_t ns ) {
+         size_t bucket = 0;
+         for( ns >>= 4; ns && bucket < num_buckets - 1; ns >>= 1 )
+            ++bucket;
+         return bucket;
+      }
+
+      uint64_t                               count = 0;
+      uint64_t                               total_ns = 0;
+      std::array<uint64_t, num_buckets>      buckets{};
+   };
+
+   /// collects a latency_histogram; safe to record into from concurrent readers
+   class latency_recorder {
+      public:
+         void record( uint64_t ns ) {
+            _count.fetch_add( 1, std::memory_order_relaxed );
+            _total_ns.fetch_add( ns, std::memory_order_relaxed );
+            _buckets[latency_histogram::bucket_of( ns )].fetch_add( 1, std::memory_order_relaxed );
+         }
+
+         latency_histogram snapshot()const {
+            latency_histogram h;
+            h.count = _count.load( std::memory_order_relaxed );
+            h.total_ns = _total_ns.load( std::memory_order_relaxed );
+            for( size_t i = 0; i < latency_histogram::num_buckets; ++i )
+               h.buckets[i] = _buckets[i].load( std::memory_order_relaxed );
+            return h;
+         }
+
+      private:
+         std::atomic<uint64_t>                                             _count{0};
+         std::atomic<uint64_t>                                             _total_ns{0};
+         std::array<std::atomic<uint64_t>, latency_histogram::num_buckets> _buckets{};
+   };
+
+   typedef std::array<latency_recorder, num_index_operations> index_operation_recorders;
+
+   /// records the time from its construction to its destruction
+   class operation_timer {
+      public:
+         explicit operation_timer( latency_recorder& recorder )
+         :_recorder( recorder ),_start( std::chrono::steady_clock::now() ){}
+
+         ~operation_timer() {
+            _recorder.record( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - _start ).count() );
+         }
+
+      private:
+         latency_recorder&                      _recorder;
+         std::chrono::steady_clock::time_point  _start;
+   };
+
+   /**
+    *  Segment memory attributed to one index. Bytes count the fixed size part of each node or undo value; what
+    *  values allocate themselves (strings, vectors) and the bucket arrays of hashed indices are not attributed.
+    */
+   struct index_stats {
+      std::string        type_name;
+      uint32_t           type_id = 0;
+      uint64_t           row_count = 0;
+      uint64_t           node_bytes = 0;      ///< estimate: row_count times the size of a container node, without allocator overhead
+      uint64_t           pool_bytes = 0;      ///< bytes reserved by the node pool, used or not; 0 without chainbase::node_allocator
+      uint64_t           pool_free_nodes = 0; ///< nodes of the pool that are not in use
+      uint64_t           undo_sessions = 0;   ///< sessions this index holds undo state for
+      uint64_t           undo_values = 0;     ///< values held by the undo log, including retired ones
+      uint64_t           undo_retired = 0;    ///< values of committed sessions waiting to be reclaimed
+      uint64_t           undo_bytes = 0;      ///< bytes of the undo log's entries, session markers and lookup table
+      uint64_t           id_table_bytes = 0;  ///< bytes of the id table, see dense_id_lookup
+      /// by index_operation; all zero unless built with CHAINBASE_COLLECT_STATS
+      std::array<latency_histogram, num_index_operations> operations{};
+   };
+
+   /**
+    *  A point in time copy of a database's statistics, see database::stats(). Sizes and undo depths are always
+    *  filled in; operation counts and latencies are only collected when chainbase and everything including it
+    *  is built with CHAINBASE_COLLECT_STATS, and cost nothing otherwise.
+    *
+    *  There is no fragmentation figure. The segment's allocator only tells how much memory is free, not how it
+    *  is split into blocks, so free_memory may be large while no single allocation of that size succeeds.
+    */
+   struct database_stats {
+      bool                       operations_collected = false;
+      int64_t                    revision = 0;
+      uint64_t                   undo_depth = 0;      ///< sessions undo_all() would undo
+      uint64_t                   size = 0;
+      uint64_t                   free_memory = 0;     ///< total over all free blocks, however small
+      latency_histogram          start_undo_session;
+      std::vector<index_stats>   indices;
+   };
+
+   /// writes stats in the Prometheus text exposition format, every metric name starting with prefix
+   void write_prometheus( std::ostream& out, const database_stats& stats, const std::string& prefix = "chainbase" );
+
+}  // namespace chainbase
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/deque.hpp>
+#include <boost/interprocess/containers/vector.hpp>
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <chainbase/pinnable_mapped_file.hpp>
+
+namespace chainbase {
+
+   namespace bip = boost::interprocess;
+
+   /**
+    *  Specialize for an object type whose modifications within undo sessions only ever change a small part of it,
+    *  so the undo history saves that part instead of a copy of the whole object and everything it allocates:
+    *
+    *     template<> struct undo_delta<account_object> {
+    *        struct type { int64_t balance; uint32_t sequence; };
+    *        static type capture( const account_object& a ) { return { a.balance, a.sequence }; }
+    *        static void restore( account_object& a, type& d ) { a.balance = d.balance; a.sequence = d.sequence; }
+    *     };
+    *
+    *  type is stored in the database, so it must not point outside of it. Every modification made while an undo
+    *  session is open must leave the rest of the object as it was. Removed objects are still saved whole.
+    */
+   template<typename T>
+   struct undo_delta {};
+
+   template<typename T, typename = void>
+   struct has_undo_delta : std::false_type {};
+
+   template<typename T>
+   struct has_undo_delta<T, decltype( void( sizeof( typename undo_delta<T>::type ) ) )> : std::true_type {};
+
+   /**
+    *  The undo history of one generic_index, kept inside the segment as a single append-only log of the values
+    *  objects had before they were first modified or removed within a session, plus one marker per session
+    *  saying where in the log that session starts.
+    *
+    *  Creations are not logged at all: a session remembers the next id at its start, and every object with an
+    *  id at or above it was created within the session. Undoing a session erases those and then replays the
+    *  session's part of the log backwards. Squashing a session into its parent only drops its marker, and
+    *  committing drops the oldest markers and retires their part of the log. Retired entries are destroyed
+    *  later and a few at a time by reclaim(), which every append also calls, so a commit of a long history
+    *  does not have to pay for destroying all of it at once.
+    *
+    *  To log an object at most once per session, a small open addressing table remembers for each recently
+    *  saved id where in the log it was last saved. Entries older than the newest session are ignored, and
+    *  entries of undone sessions are cleared while replaying them, so a stale entry can at worst cause a value
+    *  to be logged twice, which replay handles.
+    *
+    *  For a value_type with an undo_delta, a modification logs only the delta; replaying a session's deltas
+    *  newest first composes them, so sessions squashed into each other need no extra work.
+    */
+   template<typename value_type>
+   class undo_log {
+      public:
+         typedef pinnable_mapped_file::segment_manager       segment_manager;
+         typedef typename value_type::id_type                 id_type;
+         template<typename T>
+         using allocator = bip::allocator<T, segment_manager>;
+
+         enum op_type : uint8_t {
+            modified,   ///< value is the object as it was before its first modification in the session
+            removed     ///< value is the object as it was when removed
+         };
+
+         /// true if modifications log an undo_delta of the object instead of all of it
+         constexpr static bool uses_deltas = has_undo_delta<value_type>::value;
+
+         struct full_entry {
+            full_entry( op_type o, const value_type& v, value_type* ) : value(v), op(o) {}
+
+            const id_type& object_id()const { return value.id; }
+            /// puts the saved state of a modified entry back into v, the object as it is now
+            void           restore( value_type& v ) { v = std::move( value ); }
+            /// the saved object of a removed entry
+            value_type&    whole() { return value; }
+            /// a separately allocated whole object owned by the entry, if any
+            value_type*    detached()const { return nullptr; }
+
+            value_type value;
+            op_type    op;
+         };
+
+         struct delta_entry {
+            typedef undo_delta<value_type> traits;
+
+            delta_entry( op_type o, const value_type& v, value_type* w )
+            : delta( traits::capture( v ) ), id( v.id ), removed( w ), op( o ) {}
+
+            const id_type& object_id()const { return id; }
+            void           restore( value_type& v ) { traits::restore( v, delta ); }
+            value_type&    whole() { return *removed; }
+            value_type*    detached()const { return removed.get(); }
+
+            typename traits::type         delta;
+            id_type                       id;
+            bip::offset_ptr<value_type>   removed;  ///< the whole object, allocated separately, for removed entries
+            op_type                       op;
+         };
+
+         typedef std::conditional_t< uses_deltas, delta_entry, full_entry > entry;
+
+         struct marker {
+            int64_t   revision = 0;
+            uint64_t  begin = 0;        ///< log position of the session's first entry
+            id_type   old_next_id = 0;  ///< ids at or above this were created within the session
+         };
+
+         template<typename Allocator>
+         undo_log( const Allocator& a )
+         :_entries( allocator<entry>( a.get_segment_manager() ) ),
+          _markers( allocator<marker>( a.get_segment_manager() ) ),
+          _saved( allocator<saved_slot>( a.get_segment_manager() ) ) {}
+
+         ~undo_log() {
+            for( entry& e : _entries )
+               free_whole( e );
+         }
+
+         undo_log( const undo_log& ) = delete;
+         undo_log& operator=( const undo_log& ) = delete;
+
+         /// false if the log holds entries written by an executable that disagrees on whether value_type has an undo_delta
+         bool          compatible()const { return _entries.empty() || _deltas == uses_deltas; }
+
+         bool          empty()const { return _markers.empty(); }
+         size_t        sessions()const { return _markers.size(); }
+         const marker& front()const { return _markers.front(); }
+         const marker& top()const { return _markers.back(); }
+         /// number of values held, including retired ones not reclaimed yet
+         size_t        size()const { return _entries.size(); }
+         /// number of values that belong to committed sessions and are waiting to be reclaimed
+         size_t        retired()const { return _retired_end - _base; }
+         /// bytes of segment memory held, not counting what values allocate themselves
+         size_t        memory_bytes()const {
+            return _entries.size() * sizeof(entry) + _detached * sizeof(value_type) + _markers.size() * sizeof(marker) +
+                   _saved.capacity() * sizeof(saved_slot);
+         }
+
+         void push_session( int64_t revision, id_type next_id ) {
+            marker m;
+            m.revision = revision;
+            m.begin = end_position();
+            m.old_next_id = next_id;
+            _markers.push_back( m );
+         }
+
+         void on_modify( const value_type& v ) {
+            if( empty() || created_in_session( v.id ) || saved_in_session( v.id ) )
+               return;
+            append( modified, v );
+         }
+
+         void on_remove( const value_type& v ) {
+            if( empty() || created_in_session( v.id ) )
+               return;
+            append( removed, v );
+         }
+
+         /**
+          *  Turns the newest entry of an object logged by on_modify() into a removed one, for an object erased
+          *  in the middle of that modification, as multi_index does when the modifier throws. v is the object
+          *  about to be erased, with whatever part of the modification was done.
+          */
+         void on_erase( const id_type& id, const value_type& v ) {
+            if( empty() || created_in_session( id ) )
+               return;
+            entry& e = _entries[_saved[slot_of( id._id )].position - first_position - _base];
+            make_whole( e, v );
+            e.op = removed;
+         }
+
+         /**
+          *  Hands the newest session's entries to f( entry ), newest first, then drops them along with the
+          *  session's marker. f may move from the entry's saved state. Entries for objects created in the
+          *  session, which a nested session squashed into it leaves behind, are dropped without reaching f:
+          *  undoing the session removes those objects altogether.
+          */
+         template<typename F>
+         void undo( F&& f ) {
+            const uint64_t begin = top().begin;
+            while( end_position() > begin ) {
+               entry& e = _entries.back();
+               const id_type id = e.object_id();
+               if( !created_in_session( id ) )
+                  f( e );
+               forget( id );
+               free_whole( e );
+               _entries.pop_back();
+            }
+            _markers.pop_back();
+         }
+
+         /**
+          *  Moves the newest session to an earlier revision, merging it into the session before it if that one
+          *  already has that revision. Returns true if the sessions were merged.
+          */
+         bool squash( int64_t revision ) {
+            if( _markers.size() > 1 && _markers[_markers.size() - 2].revision == revision ) {
+               _markers.pop_back();
+               return true;
+            }
+            _markers.back().revision = revision;
+            return false;
+         }
+
+         /// discards every session with a revision at or below revision; their values are only retired
+         void commit( int64_t revision ) {
+            while( !empty() && _markers.front().revision <= revision )
+               _markers.pop_front();
+            _retired_end = empty() ? end_position() : _markers.front().begin;
+         }
+
+         /// destroys up to max_entries retired values, oldest first; returns how many were destroyed
+         size_t reclaim( size_t max_entries ) {
+            size_t count = 0;
+            for( ; count < max_entries && _base < _retired_end; ++count ) {
+               free_whole( _entries.front() );
+               _entries.pop_front();
+               ++_base;
+            }
+            return count;
+         }
+
+      private:
+         struct saved_slot {
+            int64_t  id = 0;
+            uint64_t position = unused;  ///< log position the id was last saved at, offset by first_position
+         };
+         constexpr static uint64_t unused = 0;
+         constexpr static uint64_t forgotten = 1;
+         constexpr static uint64_t first_position = 2;
+         /// retired values destroyed per value appended, so reclaiming outpaces new history
+         constexpr static size_t   reclaim_per_append = 2;
+
+         static bool saved_since( const saved_slot& s, uint64_t position ) {
+            return s.position >= first_position && s.position - first_position >= position;
+         }
+
+         uint64_t end_position()const { return _base + _entries.size(); }
+
+         bool created_in_session( const id_type& id )const { return id._id >= top().old_next_id._id; }
+
+         void append( op_type op, const value_type& v ) {
+            reclaim( reclaim_per_append );
+            if( _entries.empty() )
+               _deltas = uses_deltas;
+            remember( v.id, end_position() );
+            value_type* w = uses_deltas && op == removed ? copy_whole( v ) : nullptr;
+            try {
+               _entries.emplace_back( op, v, w );
+            } catch( ... ) {
+               if( w )
+                  destroy_whole( w );
+               throw;
+            }
+         }
+
+         value_type* copy_whole( const value_type& v ) {
+            segment_manager* manager = _entries.get_allocator().get_segment_manager();
+            void* p = manager->allocate( sizeof(value_type) );
+            try {
+               value_type* w = new( p ) value_type( v );
+               ++_detached;
+               return w;
+            } catch( ... ) {
+               manager->deallocate( p );
+               throw;
+            }
+         }
+
+         void destroy_whole( value_type* w ) {
+            w->~value_type();
+            _entries.get_allocator().get_segment_manager()->deallocate( w );
+            --_detached;
+         }
+
+         /// a full entry already holds the whole object
+         void make_whole( full_entry&, const value_type& ) {}
+         /// v with the entry's delta put back is the object as the entry saved it, since only the delta ever changes
+         void make_whole( delta_entry& e, const value_type& v ) {
+            try {
+               value_type* w = copy_whole( v );
+               e.restore( *w );
+               e.removed = w;
+            } catch( ... ) {
+               std::abort(); // the session could no longer be undone
+            }
+         }
+
+         void free_whole( entry& e ) {
+            if( value_type* w = e.detached() )
+               destroy_whole( w );
+         }
+
+         size_t slot_of( int64_t id )const {
+            const size_t mask = _saved.size() - 1;
+            size_t i = (uint64_t(id) * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+            while( _saved[i].position != unused && _saved[i].id != id )
+               i = (i + 1) & mask;
+            return i;
+         }
+
+         bool saved_in_session( const id_type& id )const {
+            if( _saved.empty() )
+               return false;
+            const saved_slot& s = _saved[slot_of( id._id )];
+            return saved_since( s, top().begin );
+         }
+
+         void remember( const id_type& id, uint64_t position ) {
+            if( (_saved_count + 1) * 2 > _saved.size() )
+               rehash();
+            saved_slot& s = _saved[slot_of( id._id )];
+            if( s.position == unused )
+               ++_saved_count;
+            s.id = id._id;
+            s.position = position + first_position;
+         }
+
+         /// the slot stays occupied so other ids probing past it are still found
+         void forget( const id_type& id ) {
+            if( _saved.empty() )
+               return;
+            saved_slot& s = _saved[slot_of( id._id )];
+            if( s.position != unused )
+               s.position = forgotten;
+         }
+
+         /// drops entries that no longer matter to the newest session and grows the table if still half full
+         void rehash() {
+            const uint64_t threshold = top().begin;
+            bip::vector< saved_slot, allocator<saved_slot> > old( std::move( _saved ) );
+            size_t live = 0;
+            for( const saved_slot& s : old )
+               live += saved_since( s, threshold );
+            size_t capacity = 64;
+            while( capacity < live * 4 )
+               capacity *= 2;
+            _saved = bip::vector< saved_slot, allocator<saved_slot> >( capacity, saved_slot(), old.get_allocator() );
+            _saved_count = 0;
+            for( const saved_slot& s : old ) {
+               if( saved_since( s, threshold ) ) {
+                  _saved[slot_of( s.id )] = s;
+                  ++_saved_count;
+               }
+            }
+         }
+
+         bip::deque< entry, allocator<entry> >              _entries;
+         bip::deque< marker, allocator<marker> >            _markers;
+         bip::vector< saved_slot, allocator<saved_slot> >   _saved;
+         size_t                                             _saved_count = 0;
+         uint64_t                                           _base = 0;         ///< log position of _entries.front()
+         uint64_t                                           _retired_end = 0;  ///< entries before this position are retired
+         size_t                                             _detached = 0;     ///< whole objects held by delta entries
+         bool                                               _deltas = uses_deltas;  ///< the kind of entries in the log
+   };
+
+}  // namespace chainbase
@@ -1,6 +1,8 @@
 #include <chainbase/chainbase.hpp>
 #include <boost/array.hpp>
 
+#include "worker_pool.hpp"
+
 #include <iostream>
 
 #ifndef _WIN32
@@ -10,10 +12,20 @@
 namespace chainbase {
 
    database::database(const bfs::path& dir, open_flags flags, uint64_t shared_file_size, bool allow_dirty,
-                      pinnable_mapped_file::map_mode db_map_mode, std::vector<std::string> hugepage_paths ) :
-      _db_file(dir, flags & database::read_write, shared_file_size, allow_dirty, db_map_mode, hugepage_paths),
-      _read_only(flags == database::read_only)
+                      pinnable_mapped_file::map_mode db_map_mode, std::vector<std::string> hugepage_paths,
+                      const map_options& options ) :
+      _db_file(dir, flags & database::read_write, shared_file_size, allow_dirty, db_map_mode, hugepage_paths, options),
+      _read_only(flags == database::read_only),
+      _read_views(options.read_views && !_read_only)
    {
+      auto* segment_manager = _db_file.get_segment_manager();
+      const char* const name = "chainbase::undo_session_state";
+      if( _read_only )
+         _undo_sessions = segment_manager->find_no_lock< undo_session_state >( name ).first;
+      else
+         _undo_sessions = segment_manager->find_or_construct< undo_session_state >( name )( allocator<undo_session_state::touched_index>( segment_manager ) );
+      if( !_undo_sessions )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "unable to find undo session state in read only database" ) );
    }
 
    database::~database()
@@ -22,6 +34,21 @@ namespace chainbase {
       _index_map.clear();
    }
 
+   void database::flush()
+   {
+      _db_file.flush();
+   }
+
+   void database::write_snapshot(const bfs::path& path, unsigned num_threads) const
+   {
+      _db_file.write_snapshot(path, num_threads);
+   }
+
+   void database::restore_snapshot(const bfs::path& snapshot_path, const bfs::path& dir, unsigned num_threads)
+   {
+      pinnable_mapped_file::restore_snapshot(snapshot_path, dir, num_threads);
+   }
+
    void database::set_require_locking( bool enable_require_locking )
    {
 #ifdef CHAINBASE_CHECK_LOCKING
@@ -38,47 +65,205 @@ namespace chainbase {
    }
 #endif
 
+   abstract_index& database::touched_index( const undo_session_state::touched_index& t )const
+   {
+      if( t.type_id >= _index_map.size() || !_index_map[t.type_id] )
+         BOOST_THROW_EXCEPTION( std::logic_error( "index with type_id " + std::to_string( t.type_id ) +
+                                                  " has undo history but was not added to the database" ) );
+      return *_index_map[t.type_id];
+   }
+
+   void database::set_undo_threads( unsigned threads )
+   {
+      _undo_workers.reset();
+      if( threads > 1 )
+         _undo_workers = std::make_shared<worker_pool>( threads - 1 );
+   }
+
+   void database::for_each_index( const std::vector<abstract_index*>& indices, const std::function<void( abstract_index& )>& f )
+   {
+      // the write tracker's fault handling is only exercised from the writing thread
+      if( _undo_workers && indices.size() > 1 && !_db_file.tracking_writes() )
+         _undo_workers->run( indices.size(), [&]( size_t i ) { f( *indices[i] ); } );
+      else
+         for( auto* index : indices )
+            f( *index );
+   }
+
    void database::undo()
    {
-      for( auto& item : _index_list )
-      {
-         item->undo();
-      }
+      if( !_undo_sessions->enabled() )
+         return;
+
+      // each index is touched at most once per revision; resolve them all before undoing any
+      auto& touched = _undo_sessions->touched;
+      std::vector<abstract_index*> indices;
+      for( auto itr = touched.rbegin(); itr != touched.rend() && itr->revision == _undo_sessions->revision; ++itr )
+         indices.push_back( &touched_index( *itr ) );
+
+      for_each_index( indices, []( abstract_index& index ) {
+         CHAINBASE_TIME_OPERATION( index.operation_stats( index_operation::undo ) );
+         index.undo();
+      } );
+      touched.erase( touched.end() - indices.size(), touched.end() );
+      --_undo_sessions->revision;
    }
 
    void database::squash()
    {
-      for( auto& item : _index_list )
-      {
-         item->squash();
+      if( !_undo_sessions->enabled() )
+         return;
+
+      const int64_t head = _undo_sessions->revision;
+      if( head - 1 == _undo_sessions->begin ) {
+         // squashing the only session leaves nothing to squash into; its changes become permanent
+         commit( head );
+         _undo_sessions->begin = _undo_sessions->revision = head - 1;
+         return;
+      }
+
+      auto& touched = _undo_sessions->touched;
+      std::vector<undo_session_state::touched_index> relabelled;
+      while( touched.size() && touched.back().revision == head ) {
+         CHAINBASE_TIME_OPERATION( operation_stats( touched.back().type_id, index_operation::squash ) );
+         if( !touched_index( touched.back() ).squash( head - 1 ) )
+            relabelled.push_back( { head - 1, touched.back().type_id } );
+         touched.pop_back();
       }
+      for( const auto& t : relabelled )
+         touched.push_back( t );
+      --_undo_sessions->revision;
    }
 
    void database::commit( int64_t revision )
    {
-      for( auto& item : _index_list )
-      {
-         item->commit( revision );
+      revision = std::min( revision, _undo_sessions->revision );
+      if( revision > _undo_sessions->begin ) {
+         auto& touched = _undo_sessions->touched;
+         while( touched.size() && touched.front().revision <= revision ) {
+            CHAINBASE_TIME_OPERATION( operation_stats( touched.front().type_id, index_operation::commit ) );
+            touched_index( touched.front() ).commit( revision );
+            touched.pop_front();
+         }
+         _undo_sessions->begin = revision;
       }
+      reclaim_undo_history( _commit_reclaim_limit );
+
+      if( _db_file.loading() )
+         _db_file.finish_loading( false );
+      if( _db_file.checkpoint_due() )
+         _db_file.begin_checkpoint();
+   }
+
+   size_t database::reclaim_undo_history( size_t max_entries )
+   {
+      if( _undo_workers && max_entries == std::numeric_limits<size_t>::max() ) {
+         // without a limit no index depends on how much the others reclaimed
+         std::atomic<size_t> total{0};
+         for_each_index( _index_list, [&]( abstract_index& index ) {
+            total += index.reclaim( max_entries );
+         } );
+         return total;
+      }
+
+      size_t reclaimed = 0;
+      for( auto* index : _index_list ) {
+         if( reclaimed == max_entries )
+            break;
+         reclaimed += index->reclaim( max_entries - reclaimed );
+      }
+      return reclaimed;
    }
 
    void database::undo_all()
    {
-      for( auto& item : _index_list )
-      {
-         item->undo_all();
+      while( _undo_sessions->enabled() )
+         undo();
+   }
+
+   void database::set_revision( uint64_t revision )
+   {
+      CHAINBASE_REQUIRE_WRITE_LOCK( "set_revision", uint64_t );
+      if( _undo_sessions->enabled() )
+         BOOST_THROW_EXCEPTION( std::logic_error("cannot set revision while there is an existing undo stack") );
+
+      if( revision > std::numeric_limits<int64_t>::max() )
+         BOOST_THROW_EXCEPTION( std::logic_error("revision to set is too high") );
+
+      _undo_sessions->begin = _undo_sessions->revision = static_cast<int64_t>(revision);
+   }
+
+   state_digest database::state_hash()const
+   {
+      state_digest total;
+      for( const auto* index : _index_list ) {
+         if( !index->hashed() )
+            continue;
+         const state_digest* d = index->state_hash();
+         if( !d )
+            BOOST_THROW_EXCEPTION( std::logic_error( "state hash of " + index->type_name() + " is not up to date" ) );
+         // mixing in the type keeps equal objects of different types apart
+         object_hasher h;
+         h( index->type_id() )( d->low )( d->high );
+         total += h.digest();
       }
+      return total;
+   }
+
+   read_view database::begin_read()const
+   {
+      if( !_read_views )
+         BOOST_THROW_EXCEPTION( std::logic_error( "read views are not enabled for this database" ) );
+      auto s = std::atomic_load( &_read_view );
+      if( !s )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "no read view has been published yet" ) );
+      return read_view( std::move( s ) );
+   }
+
+   bool database::publish_read_view()
+   {
+      if( !_read_views )
+         return false;
+      auto mapping = _db_file.publish_view();
+      if( !mapping )
+         return false;
+
+      auto s = std::make_shared<read_view::state>();
+      s->mapping = std::move( mapping );
+      s->revision = _undo_sessions->revision;
+      s->indices.resize( _index_map.size() );
+      for( size_t i = 0; i < _index_map.size(); ++i )
+         if( _index_map[i] )
+            s->indices[i] = _index_map[i]->get();
+      std::atomic_store( &_read_view, std::shared_ptr<const read_view::state>( std::move( s ) ) );
+      return true;
+   }
+
+   database_stats database::stats()const
+   {
+      database_stats s;
+#ifdef CHAINBASE_COLLECT_STATS
+      s.operations_collected = true;
+      s.start_undo_session = _session_stats->snapshot();
+#endif
+      s.revision = revision();
+      s.undo_depth = _undo_sessions->revision - _undo_sessions->begin;
+      s.size = _db_file.get_segment_manager()->get_size();
+      s.free_memory = get_free_memory();
+      for( const auto* index : _index_list )
+         s.indices.push_back( index->stats() );
+      return s;
    }
 
    database::session database::start_undo_session( bool enabled )
    {
+      CHAINBASE_TIME_OPERATION( *_session_stats );
+      if( BOOST_UNLIKELY( _db_file.loading() ) )
+         _db_file.finish_loading( false );
+      grow_if_needed();
       if( enabled ) {
-         vector< std::unique_ptr<abstract_session> > _sub_sessions;
-         _sub_sessions.reserve( _index_list.size() );
-         for( auto& item : _index_list ) {
-            _sub_sessions.push_back( item->start_undo_session( enabled ) );
-         }
-         return session( std::move( _sub_sessions ) );
+         ++_open_sessions;
+         return session( *this, ++_undo_sessions->revision );
       } else {
          return session();
       }
@@ -0,0 +1,327 @@
+#include "direct_io.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace chainbase {
+
+constexpr size_t direct_io::alignment;
+constexpr size_t direct_io::request_size;
+constexpr unsigned direct_io::_queue_depth;
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+/**
+ * The submission and completion queues of an io_uring instance, set up and driven with the raw system calls
+ * so no library is needed. Only one thread uses a ring at a time.
+ */
+struct direct_io::ring {
+   ~ring() {
+      if(sqes != MAP_FAILED)
+         munmap(sqes, sqes_size);
+      if(cq_ring != MAP_FAILED && cq_ring != sq_ring)
+         munmap(cq_ring, cq_ring_size);
+      if(sq_ring != MAP_FAILED)
+         munmap(sq_ring, sq_ring_size);
+      if(fd >= 0)
+         close(fd);
+   }
+
+   /// nullptr if the kernel has no io_uring or does not let this process use it
+   static std::unique_ptr<ring> create(unsigned entries) {
+      std::unique_ptr<ring> r(new ring);
+      io_uring_params p = {};
+      r->fd = syscall(__NR_io_uring_setup, entries, &p);
+      if(r->fd < 0)
+         return nullptr;
+      r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      if(p.features & IORING_FEAT_SINGLE_MMAP)
+         r->sq_ring_size = r->cq_ring_size = std::max(r->sq_ring_size, r->cq_ring_size);
+      r->sq_ring = mmap(nullptr, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+      if(r->sq_ring == MAP_FAILED)
+         return nullptr;
+      r->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq_ring
+                 : mmap(nullptr, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+      if(r->cq_ring == MAP_FAILED)
+         return nullptr;
+      r->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+      r->sqes = mmap(nullptr, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+      if(r->sqes == MAP_FAILED)
+         return nullptr;
+
+      char* const sq = (char*)r->sq_ring;
+      char* const cq = (char*)r->cq_ring;
+      r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+      r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+      r->sq_array = (unsigned*)(sq + p.sq_off.array);
+      r->cq_head = (unsigned*)(cq + p.cq_off.head);
+      r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+      r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+      r->cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+      r->entries = p.sq_entries;
+      return r;
+   }
+
+   /// queues a vectored read or write of iov; it is only submitted by the next enter()
+   void queue(bool writing, int file, const iovec* iov, uint64_t offset, uint64_t user_data) {
+      const unsigned tail = *sq_tail;
+      io_uring_sqe* sqe = (io_uring_sqe*)sqes + (tail & sq_mask);
+      *sqe = io_uring_sqe();
+      sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = file;
+      sqe->addr = (uint64_t)iov;
+      sqe->len = 1;
+      sqe->off = offset;
+      sqe->user_data = user_data;
+      sq_array[tail & sq_mask] = tail & sq_mask;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      ++unsubmitted;
+   }
+
+   /// submits what was queued and waits for at least wait_for completions; false if the ring failed
+   bool enter(unsigned wait_for) {
+      for(;;) {
+         const int r = syscall(__NR_io_uring_enter, fd, unsubmitted, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+         if(r >= 0) {
+            unsubmitted -= std::min<unsigned>(r, unsubmitted);
+            if(!unsubmitted || wait_for)
+               return true;
+         }
+         else if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+      }
+   }
+
+   /// hands every completion to f(user_data, result)
+   template<typename F>
+   void reap(F&& f) {
+      unsigned head = *cq_head;
+      const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      for(; head != tail; ++head) {
+         const io_uring_cqe& cqe = cqes[head & cq_mask];
+         f(cqe.user_data, cqe.res);
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+   }
+
+   int           fd = -1;
+   void*         sq_ring = MAP_FAILED;
+   void*         cq_ring = MAP_FAILED;
+   void*         sqes = MAP_FAILED;
+   size_t        sq_ring_size = 0;
+   size_t        cq_ring_size = 0;
+   size_t        sqes_size = 0;
+   unsigned*     sq_tail = nullptr;
+   unsigned*     sq_array = nullptr;
+   unsigned      sq_mask = 0;
+   unsigned*     cq_head = nullptr;
+   unsigned*     cq_tail = nullptr;
+   unsigned      cq_mask = 0;
+   io_uring_cqe* cqes = nullptr;
+   unsigned      entries = 0;
+   unsigned      unsubmitted = 0;
+};
+#else
+struct direct_io::ring {};
+#endif
+
+std::unique_ptr<direct_io> direct_io::open(const bfs::path& path, bool writable, unsigned num_threads) {
+#if defined(__linux__) && defined(O_DIRECT)
+   const int fd = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+   if(fd < 0)
+      return nullptr;
+   if(num_threads == 0)
+      num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+   std::unique_ptr<ring> r;
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+   r = ring::create(_queue_depth);
+#endif
+   return std::unique_ptr<direct_io>(new direct_io(fd, std::move(r), num_threads));
+#else
+   return nullptr;
+#endif
+}
+
+direct_io::direct_io(int fd, std::unique_ptr<ring> r, unsigned num_threads) :
+   _fd(fd),
+   _ring(std::move(r)),
+   _num_threads(num_threads)
+{}
+
+direct_io::~direct_io() {
+   _ring.reset();
+#ifdef __linux__
+   close(_fd);
+#endif
+}
+
+bool direct_io::aligned(const void* data, uint64_t offset, size_t length) {
+   return (uintptr_t)data % alignment == 0 && offset % alignment == 0 && length % alignment == 0;
+}
+
+bool direct_io::read(const std::vector<request>& requests, const std::function<bool(size_t)>& keep_going) {
+   return transfer(false, requests, keep_going);
+}
+
+bool direct_io::write(const std::vector<request>& requests, const std::function<bool(size_t)>& keep_going) {
+   return transfer(true, requests, keep_going);
+}
+
+bool direct_io::transfer(bool writing, const std::vector<request>& requests, const std::function<bool(size_t)>& keep_going) {
+   std::vector<request> pieces;
+   for(const request& r : requests) {
+      if(!aligned(r.data, r.offset, r.length))
+         return false;
+      for(size_t done = 0; done < r.length; done += request_size)
+         pieces.push_back({r.offset + done, r.data + done, std::min(request_size, r.length - done)});
+   }
+   if(pieces.empty())
+      return true;
+   if(_ring)
+      return transfer_ring(writing, pieces, keep_going);
+   return transfer_threads(writing, pieces, keep_going);
+}
+
+// A piece that completes short is queued again for the rest, so each in flight piece owns one slot of the
+// queue and its iovec until it is done.
+bool direct_io::transfer_ring(bool writing, std::vector<request>& pieces, const std::function<bool(size_t)>& keep_going) {
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+   const unsigned depth = std::min(_queue_depth, _ring->entries);
+   std::vector<iovec> iov(depth);
+   std::vector<size_t> slot_piece(depth);
+   std::vector<unsigned> free_slots, retry;
+   for(unsigned s = depth; s-- > 0;)
+      free_slots.push_back(s);
+
+   size_t next = 0, done = 0;
+   unsigned in_flight = 0;
+   bool ok = true, go = true;
+   std::exception_ptr error;
+   auto queue_slot = [&](unsigned slot) {
+      const request& p = pieces[slot_piece[slot]];
+      iov[slot].iov_base = p.data;
+      iov[slot].iov_len = p.length;
+      _ring->queue(writing, _fd, &iov[slot], p.offset, slot);
+      ++in_flight;
+   };
+
+   while(in_flight || (ok && go && (next < pieces.size() || retry.size()))) {
+      while(ok && go && retry.size()) {
+         queue_slot(retry.back());
+         retry.pop_back();
+      }
+      while(ok && go && next < pieces.size() && free_slots.size()) {
+         const unsigned slot = free_slots.back();
+         free_slots.pop_back();
+         slot_piece[slot] = next++;
+         queue_slot(slot);
+      }
+      if(!_ring->enter(in_flight ? 1 : 0)) {
+         // nothing more can be reaped; dropping the ring makes the kernel cancel or finish what is in flight
+         _ring.reset();
+         return false;
+      }
+      _ring->reap([&](uint64_t slot, int result) {
+         --in_flight;
+         request& p = pieces[slot_piece[slot]];
+         if(result <= 0) {
+            ok = false;
+            free_slots.push_back(slot);
+         }
+         else if((size_t)result < p.length) {
+            p.offset += result;
+            p.data += result;
+            p.length -= result;
+            done += result;
+            retry.push_back(slot);
+         }
+         else {
+            done += result;
+            free_slots.push_back(slot);
+         }
+      });
+      if(go) {
+         try {
+            go = keep_going(done);
+         }
+         catch(...) {
+            error = std::current_exception();
+            go = false;
+         }
+      }
+   }
+   if(error)
+      std::rethrow_exception(error);
+   return ok && go && retry.empty() && next == pieces.size();
+#else
+   return false;
+#endif
+}
+
+bool direct_io::transfer_threads(bool writing, std::vector<request>& pieces, const std::function<bool(size_t)>& keep_going) {
+#ifdef __linux__
+   std::atomic<size_t> next{0}, done{0};
+   std::atomic<unsigned> running{0};
+   std::atomic<bool> stop{false}, failed{false};
+   auto work = [&]() {
+      size_t i;
+      while(!stop && (i = next++) < pieces.size()) {
+         request p = pieces[i];
+         while(p.length) {
+            const ssize_t r = writing ? pwrite(_fd, p.data, p.length, p.offset) : pread(_fd, p.data, p.length, p.offset);
+            if(r < 0 && errno == EINTR)
+               continue;
+            if(r <= 0) {
+               failed = stop = true;
+               break;
+            }
+            p.offset += r;
+            p.data += r;
+            p.length -= r;
+            done += r;
+         }
+      }
+      --running;
+   };
+
+   const unsigned num_threads = std::min<size_t>(_num_threads, pieces.size());
+   std::vector<std::thread> threads;
+   std::exception_ptr error;
+   try {
+      for(unsigned i = 0; i < num_threads; ++i) {
+         ++running;
+         threads.emplace_back(work);
+      }
+      while(running) {
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+         if(!keep_going(done))
+            stop = true;
+      }
+   }
+   catch(...) {
+      error = std::current_exception();
+      stop = true;
+   }
+   for(std::thread& t : threads)
+      t.join();
+   if(error)
+      std::rethrow_exception(error);
+   return !stop && !failed;
+#else
+   return false;
+#endif
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace chainbase {
+
+namespace bfs = boost::filesystem;
+
+/**
+ * Moves large ranges between a database file and memory with O_DIRECT, so loading and writing back a database
+ * neither goes through nor evicts the page cache. Requests are split into pieces of request_size bytes and
+ * kept in flight on an io_uring queue when the kernel provides one, or on a few threads calling pread() and
+ * pwrite() when it does not. Linux only; elsewhere, and on file systems without O_DIRECT, open() fails.
+ */
+class direct_io {
+   public:
+      /// a range of the file and the memory it is read into or written from
+      struct request {
+         uint64_t offset;
+         char*    data;
+         size_t   length;
+      };
+
+      /// offsets, lengths and addresses must be multiples of this
+      constexpr static size_t alignment = 4096;
+      constexpr static size_t request_size = 1024*1024;
+
+      /// opens path for direct reads, and writes if writable; returns nullptr if that is not possible
+      static std::unique_ptr<direct_io> open(const bfs::path& path, bool writable, unsigned num_threads);
+      ~direct_io();
+
+      direct_io(const direct_io&) = delete;
+      direct_io& operator=(const direct_io&) = delete;
+
+      static bool aligned(const void* data, uint64_t offset, size_t length);
+      /// "io_uring" or "pread"
+      const char* backend() const { return _ring ? "io_uring" : "pread"; }
+
+      /**
+       * Carries out every request and returns true once all of them completed in full. keep_going() is called on
+       * the calling thread as transfers complete, with the number of bytes done so far; once it returns false or
+       * throws, nothing more is started, and what is in flight is waited for before returning false or rethrowing.
+       */
+      bool read(const std::vector<request>& requests, const std::function<bool(size_t)>& keep_going);
+      bool write(const std::vector<request>& requests, const std::function<bool(size_t)>& keep_going);
+
+   private:
+      struct ring;
+
+      direct_io(int fd, std::unique_ptr<ring> r, unsigned num_threads);
+      bool transfer(bool writing, const std::vector<request>& requests, const std::function<bool(size_t)>& keep_going);
+      bool transfer_ring(bool writing, std::vector<request>& pieces, const std::function<bool(size_t)>& keep_going);
+      bool transfer_threads(bool writing, std::vector<request>& pieces, const std::function<bool(size_t)>& keep_going);
+
+      const int                    _fd;
+      std::unique_ptr<ring>        _ring;
+      const unsigned               _num_threads;
+
+      constexpr static unsigned    _queue_depth = 32;
+};
+
+}
@@ -0,0 +1,280 @@
+#include "journal.hpp"
+
+#include <chainbase/environment.hpp>
+
+#include <boost/throw_exception.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+namespace chainbase {
+
+/*
+ * A journal holds the ranges one checkpoint writes to the database file:
+ *
+ *    journal_header
+ *    range_header + data         (once per range; no data for a range of zeros)
+ *    journal_trailer             (carries the CRC-32 of everything before it)
+ *
+ * A journal cut short by a crash lacks a trailer that matches, which is what tells it apart from one that
+ * was completely written.
+ */
+namespace {
+
+constexpr uint64_t journal_magic = 0x4c4e524a42444843ULL; //"CHDBJRNL" little endian
+constexpr uint64_t range_kind    = 0x45474e4152424443ULL; //"CDBRANGE" little endian
+constexpr uint64_t trailer_kind  = 0x444e454a42444843ULL; //"CHDBJEND" little endian
+constexpr uint64_t max_range     = 64*1024*1024;
+
+struct journal_header {
+   uint64_t magic = journal_magic;
+   uint64_t epoch = 0;
+} __attribute__ ((packed));
+
+struct range_header {
+   uint64_t kind = range_kind;
+   uint64_t offset = 0;
+   uint64_t length = 0;
+   uint64_t zeros = 0;
+} __attribute__ ((packed));
+
+struct journal_trailer {
+   uint64_t kind = trailer_kind;
+   uint64_t count = 0;
+   uint64_t crc = 0;
+   uint64_t reserved = 0;
+} __attribute__ ((packed));
+
+static_assert(sizeof(range_header) == sizeof(journal_trailer), "records are told apart by their first field");
+
+#ifndef _WIN32
+bool read_all(int fd, void* data, size_t length, uint64_t offset) {
+   char* p = (char*)data;
+   while(length) {
+      const ssize_t r = pread(fd, p, length, offset);
+      if(r < 0 && errno == EINTR)
+         continue;
+      if(r <= 0)
+         return false;
+      p += r;
+      offset += r;
+      length -= r;
+   }
+   return true;
+}
+
+bool write_all_at(int fd, const void* data, size_t length, uint64_t offset) {
+   const char* p = (const char*)data;
+   while(length) {
+      const ssize_t r = pwrite(fd, p, length, offset);
+      if(r < 0 && errno == EINTR)
+         continue;
+      if(r <= 0)
+         return false;
+      p += r;
+      offset += r;
+      length -= r;
+   }
+   return true;
+}
+#endif
+
+}
+
+struct journal::scan_result {
+   bool     complete = false;
+   uint64_t epoch = 0;
+   uint64_t count = 0;
+};
+
+journal::journal(const bfs::path& path) : _path(path) {
+#ifndef _WIN32
+   _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+   if(_fd < 0)
+      BOOST_THROW_EXCEPTION(std::runtime_error("Could not open journal " + path.string() + ": " + std::string(strerror(errno))));
+   // the journal must still be found after a crash, so its directory entry is synced as well
+   const int dir = ::open(path.parent_path().c_str(), O_RDONLY | O_CLOEXEC);
+   if(dir >= 0) {
+      fsync(dir);
+      close(dir);
+   }
+#else
+   BOOST_THROW_EXCEPTION(std::runtime_error("Journaling is not supported on win32"));
+#endif
+}
+
+journal::~journal() {
+#ifndef _WIN32
+   if(_fd >= 0)
+      close(_fd);
+#endif
+}
+
+bool journal::begin(uint64_t epoch) {
+#ifndef _WIN32
+   if(ftruncate(_fd, 0))
+      return false;
+   _end = 0;
+   _count = 0;
+   _crc.reset();
+   journal_header header;
+   header.epoch = epoch;
+   return write_all(&header, sizeof(header));
+#else
+   return false;
+#endif
+}
+
+bool journal::append(uint64_t offset, const char* data, size_t length) {
+   range_header header;
+   header.offset = offset;
+   header.length = length;
+   header.zeros = data == nullptr;
+   ++_count;
+   return write_all(&header, sizeof(header)) && (!data || write_all(data, length));
+}
+
+bool journal::commit() {
+#ifndef _WIN32
+   journal_trailer trailer;
+   trailer.count = _count;
+   trailer.crc = _crc.checksum();
+   return write_all(&trailer, sizeof(trailer)) && fdatasync(_fd) == 0;
+#else
+   return false;
+#endif
+}
+
+bool journal::for_each(const std::function<void(uint64_t, const char*, size_t)>& f) const {
+   return scan(_fd, f).complete;
+}
+
+void journal::remove() {
+   boost::system::error_code ec;
+   bfs::remove(_path, ec);
+}
+
+bool journal::write_all(const void* data, size_t length) {
+#ifndef _WIN32
+   _crc.process_bytes(data, length);
+   if(!write_all_at(_fd, data, length, _end))
+      return false;
+   _end += length;
+   return true;
+#else
+   return false;
+#endif
+}
+
+// Without f this only checks the journal; with it, every range is handed to f as it is read, so f should
+// only be given once a journal is known to be complete.
+journal::scan_result journal::scan(int fd, const std::function<void(uint64_t, const char*, size_t)>& f) {
+   scan_result result;
+#ifndef _WIN32
+   boost::crc_32_type crc;
+   journal_header header;
+   uint64_t position = 0;
+   if(!read_all(fd, &header, sizeof(header), position) || header.magic != journal_magic)
+      return result;
+   crc.process_bytes(&header, sizeof(header));
+   position += sizeof(header);
+   result.epoch = header.epoch;
+
+   std::vector<char> data;
+   for(;;) {
+      char record[sizeof(range_header)];
+      uint64_t kind;
+      if(!read_all(fd, record, sizeof(record), position))
+         return result;
+      memcpy(&kind, record, sizeof(kind));
+      if(kind == trailer_kind) {
+         journal_trailer trailer;
+         memcpy(&trailer, record, sizeof(trailer));
+         result.complete = trailer.count == result.count && trailer.crc == crc.checksum();
+         return result;
+      }
+      range_header range;
+      memcpy(&range, record, sizeof(range));
+      if(kind != range_kind || range.length > max_range)
+         return result;
+      crc.process_bytes(&range, sizeof(range));
+      position += sizeof(range);
+      if(!range.zeros) {
+         data.resize(range.length);
+         if(!read_all(fd, data.data(), range.length, position))
+            return result;
+         crc.process_bytes(data.data(), range.length);
+         position += range.length;
+      }
+      ++result.count;
+      if(f)
+         f(range.offset, range.zeros ? nullptr : data.data(), range.length);
+   }
+#else
+   return result;
+#endif
+}
+
+void journal::recover(const bfs::path& path, const bfs::path& db_path, const std::string& database_name) {
+#ifndef _WIN32
+   const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if(fd < 0)
+      return;
+   const scan_result found = scan(fd, nullptr);
+
+   uint64_t file_epoch = 0;
+   const int db = ::open(db_path.c_str(), O_RDWR | O_CLOEXEC);
+   if(db < 0 || !read_all(db, &file_epoch, sizeof(file_epoch), header_epoch_offset)) {
+      close(fd);
+      if(db >= 0)
+         close(db);
+      BOOST_THROW_EXCEPTION(std::runtime_error("Could not read \"" + database_name + "\" database file to check it against its journal"));
+   }
+
+   bool applied = false;
+   if(!found.complete)
+      std::cerr << "CHAINBASE: Discarding incomplete journal of \"" << database_name << "\" database, its file is at checkpoint " << file_epoch << std::endl;
+   else if(found.epoch < file_epoch)
+      std::cerr << "CHAINBASE: Discarding journal of \"" << database_name << "\" database older than its file" << std::endl;
+   else {
+      std::vector<char> zeros;
+      bool ok = true;
+      scan(fd, [&](uint64_t offset, const char* data, size_t length) {
+         if(!data) {
+#ifdef __linux__
+            if(fallocate(db, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+               return;
+#endif
+            zeros.resize(length);
+            data = zeros.data();
+         }
+         ok = ok && write_all_at(db, data, length, offset);
+      });
+      applied = ok && fsync(db) == 0;
+      if(!applied) {
+         close(fd);
+         close(db);
+         BOOST_THROW_EXCEPTION(std::runtime_error("Could not apply journal of \"" + database_name + "\" database: " + std::string(strerror(errno))));
+      }
+      std::cerr << "CHAINBASE: Recovered \"" << database_name << "\" database to checkpoint " << found.epoch << " from its journal" << std::endl;
+   }
+   close(fd);
+   close(db);
+   boost::system::error_code ec;
+   bfs::remove(path, ec);
+#endif
+}
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace chainbase {
+
+namespace bfs = boost::filesystem;
+
+/**
+ * The redo journal of map_options::journal, kept next to the database file. A checkpoint first writes the
+ * new contents of every range of the file it is about to change here and syncs it; only then does it change
+ * the file. An open after a crash in the middle of changing the file replays the journal. A journal that was
+ * not completely written is ignored, since the file was not touched yet when it was cut short.
+ *
+ * Each checkpoint moves the file to the next epoch, recorded in the header of the database; a journal is
+ * only replayed over a file of an earlier or the same epoch, which replaying again leaves as it is.
+ */
+class journal {
+   public:
+      /// opens the journal at path for writing, creating it if needed
+      explicit journal(const bfs::path& path);
+      ~journal();
+
+      journal(const journal&) = delete;
+      journal& operator=(const journal&) = delete;
+
+      /// drops the previous journal and starts the one of the checkpoint moving the file to epoch
+      bool begin(uint64_t epoch);
+      /// records that length bytes at offset of the database file become data, or zeros if data is nullptr
+      bool append(uint64_t offset, const char* data, size_t length);
+      /// completes the journal and syncs it; once this returned true the checkpoint survives a crash
+      bool commit();
+      /// hands every range of the journal written since begin() to f, in order, with nullptr data for zeros
+      bool for_each(const std::function<void(uint64_t offset, const char* data, size_t length)>& f) const;
+      /// deletes the journal file; for a clean close, once the file holds everything
+      void remove();
+
+      /**
+       * Brings the database file at db_path up to date with the journal at path, if there is one that was
+       * completely written and not for an older epoch than the file's, then deletes the journal. Throws if
+       * the journal could not be applied.
+       */
+      static void recover(const bfs::path& path, const bfs::path& db_path, const std::string& database_name);
+
+   private:
+      struct scan_result;
+
+      bool write_all(const void* data, size_t length);
+      static scan_result scan(int fd, const std::function<void(uint64_t, const char*, size_t)>& f);
+
+      const bfs::path        _path;
+      int                    _fd = -1;
+      uint64_t               _end = 0;      ///< where the next record goes
+      uint64_t               _count = 0;    ///< ranges appended since begin()
+      boost::crc_32_type     _crc;          ///< of everything written since begin()
+};
+
+}
@@ -1,24 +1,625 @@
 #include <chainbase/pinnable_mapped_file.hpp>
 #include <chainbase/environment.hpp>
+#include "write_tracker.hpp"
+#include "working_set.hpp"
+#include "direct_io.hpp"
+#include "journal.hpp"
 #include <boost/interprocess/managed_external_buffer.hpp>
 #include <boost/interprocess/anonymous_shared_memory.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <set>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #ifdef __linux__
 #include <sys/vfs.h>
+#include <sys/syscall.h>
 #include <linux/magic.h>
+#include <linux/falloc.h>
+#include <linux/mempolicy.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
 #endif
 
 namespace chainbase {
 
+namespace {
+#ifdef __linux__
+   /// the size of a transparent huge page; 2MB if the kernel does not say
+   size_t transparent_huge_page_size() {
+      size_t size = 0;
+      std::ifstream in("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+      if(!(in >> size) || size == 0)
+         size = 2*1024*1024;
+      return size;
+   }
+
+   /// reserves size bytes of address space at a multiple of alignment, for a mapping to replace with MAP_FIXED
+   void* reserve_aligned(size_t size, size_t alignment) {
+      const size_t span = size + alignment;
+      void* p = mmap(nullptr, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if(p == MAP_FAILED)
+         BOOST_THROW_EXCEPTION(std::runtime_error("Could not reserve address space: " + std::string(strerror(errno))));
+      char* const begin = (char*)p;
+      char* const aligned = (char*)(((uintptr_t)begin + alignment - 1) & ~(uintptr_t)(alignment - 1));
+      if(aligned != begin)
+         munmap(begin, aligned - begin);
+      munmap(aligned + size, begin + span - (aligned + size));
+      return aligned;
+   }
+#endif
+
+   /// maps the first size bytes of mapping, at a multiple of alignment unless that is 0
+   template<typename Mapping>
+   bip::mapped_region map_aligned(const Mapping& mapping, bip::mode_t mode, size_t size, size_t alignment) {
+#ifdef __linux__
+      if(alignment) {
+         void* address = reserve_aligned(size, alignment);
+         try {
+            return bip::mapped_region(mapping, mode, 0, size, address, MAP_FIXED);
+         }
+         catch(...) {
+            munmap(address, size);
+            throw;
+         }
+      }
+#endif
+      return bip::mapped_region(mapping, mode, 0, size);
+   }
+
+   /**
+    * The data files this process has open writable. A writer keeps the dirty flag of its file set while it runs,
+    * so the flag alone cannot tell a live writer from one that crashed.
+    */
+   std::mutex               open_writers_mutex;
+   std::multiset<bfs::path> open_writers;
+
+   /// true if a writer in this or another process has the data file open
+   bool writer_is_open(const bfs::path& data_file) {
+      {
+         std::lock_guard<std::mutex> g(open_writers_mutex);
+         if(open_writers.count(data_file))
+            return true;
+      }
+#ifndef _WIN32
+      // no lock of this process is on the file, so closing fd cannot release one
+      const int fd = ::open(data_file.c_str(), O_RDONLY | O_CLOEXEC);
+      if(fd < 0)
+         return false;
+      struct flock lock = {};
+      lock.l_type = F_WRLCK;
+      lock.l_whence = SEEK_SET;
+      const bool locked = fcntl(fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK;
+      close(fd);
+      return locked;
+#else
+      return false;
+#endif
+   }
+}
+
+/**
+ * Copies the in-memory database of heap and locked mode back to its file, or in mapped mode with a journal,
+ * the private mapping of the file. flush() does so on the calling thread; begin() only arms the write
+ * tracker's snapshot barrier and leaves the copying to a background thread. In both cases the file's dirty
+ * flag is raised before the first chunk is written and cleared only after all of them have been synced.
+ * With a journal the chunks are written to the journal instead, which is synced and only then applied to the
+ * file, so the file is never dirty.
+ */
+class pinnable_mapped_file::checkpointer {
+   public:
+      checkpointer(char* src, size_t size, size_t capacity, write_tracker* tracker, const bip::file_mapping& file_mapping,
+                   std::unique_ptr<direct_io> direct, std::unique_ptr<journal> j, bool private_mapping,
+                   const std::string& database_name, std::chrono::seconds interval) :
+         _src(src),
+         _size(size),
+         _capacity(capacity),
+         _tracker(tracker),
+         _file_region(file_mapping, bip::read_write, 0, capacity),
+         _dst((char*)_file_region.get_address()),
+         _fd(dup(file_mapping.get_mapping_handle().handle)),
+         _direct(std::move(direct)),
+         _journal(std::move(j)),
+         _private(private_mapping),
+         _database_name(database_name),
+         _interval(interval),
+         _last_checkpoint(std::chrono::steady_clock::now())
+      {
+#ifndef _WIN32
+         // a chunk the fault handler cannot preserve must not be written straight to the file ahead of the journal
+         if(_journal && _tracker) {
+            void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(p == MAP_FAILED)
+               BOOST_THROW_EXCEPTION(std::runtime_error("Could not reserve address space: " + std::string(strerror(errno))));
+            _scratch = (char*)p;
+         }
+#endif
+         if(_interval.count())
+            _thread = std::thread([this]() { run(); });
+      }
+
+      ~checkpointer() {
+         {
+            std::lock_guard<std::mutex> g(_mutex);
+            _stop = true;
+         }
+         _cv.notify_all();
+         if(_thread.joinable())
+            _thread.join();
+         // the file holds everything the journal did
+         if(_journal && _applied)
+            _journal->remove();
+#ifndef _WIN32
+         if(_scratch)
+            munmap(_scratch, _capacity);
+#endif
+         if(_fd >= 0)
+            close(_fd);
+      }
+
+      void flush(bool verbose) {
+         std::unique_lock<std::mutex> g(_mutex);
+         _cv.wait(g, [this]() { return !_in_progress; });
+
+         if(verbose)
+            std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, this could take a moment..." << std::endl;
+         std::vector<size_t> chunks = start();
+         if(verbose && _tracker)
+            std::cerr << "           " << chunks.size() << " of " << _tracker->num_chunks() << " chunks modified" << std::endl;
+         write_chunks(chunks, verbose);
+         if(verbose)
+            std::cerr << "           Syncing buffers..." << std::endl;
+         finish(false);
+         _written = std::move(chunks);
+         _last_checkpoint = std::chrono::steady_clock::now();
+         if(verbose)
+            std::cerr << "           Complete" << std::endl;
+      }
+
+      /// waits out a checkpoint in progress, then covers new_size bytes; the file must already be that large
+      void extend(size_t new_size) {
+         std::unique_lock<std::mutex> g(_mutex);
+         _cv.wait(g, [this]() { return !_in_progress; });
+         _size = new_size;
+      }
+
+      bool due() const {
+         return _interval.count() && !_in_progress && std::chrono::steady_clock::now() - _last_checkpoint.load() >= _interval;
+      }
+
+      void begin() {
+         if(!_tracker || _tracker->overflowed()) {
+            // no barrier to rely on, the copy has to happen while the caller holds off writes
+            flush(false);
+            return;
+         }
+         std::unique_lock<std::mutex> g(_mutex);
+         if(_in_progress)
+            return;
+         _chunks = start();
+         _in_progress = true;
+         g.unlock();
+         _cv.notify_all();
+      }
+
+   private:
+      void run() {
+         std::unique_lock<std::mutex> g(_mutex);
+         for(;;) {
+            _cv.wait(g, [this]() { return _stop || _in_progress; });
+            if(!_in_progress)
+               return;
+            g.unlock();
+            write_chunks(_chunks, false);
+            finish(true);
+            g.lock();
+            _written = std::move(_chunks);
+            _chunks.clear();
+            _last_checkpoint = std::chrono::steady_clock::now();
+            _in_progress = false;
+            _cv.notify_all();
+         }
+      }
+
+      // Called with writes held off. With a journal, a checkpoint that changes anything moves the file to the next
+      // epoch; raising it in the header also makes sure the header's chunk is part of that checkpoint.
+      std::vector<size_t> start() {
+         drop_private_copies();
+         _journaling = _journal != nullptr;
+         if(_journaling) {
+            db_header* header = reinterpret_cast<db_header*>(_src);
+            if(!_tracker || _tracker->dirty_count())
+               header->epoch = header->epoch + 1;
+            if(!_journal->begin(header->epoch))
+               abandon_journal();
+         }
+         else
+            set_file_dirty(true);
+         if(_tracker)
+            return _tracker->begin_snapshot(_scratch ? _scratch : _dst);
+         return std::vector<size_t>(1, 0);
+      }
+
+      // In mapped mode the database is a private mapping of its file, so every chunk written since the open holds
+      // a private copy of its pages. Once a checkpoint has put a chunk in the file and it was not written again,
+      // mapping the file back over it gives that memory back. Only done while writes are held off.
+      void drop_private_copies() {
+#ifndef _WIN32
+         if(_private && _applied && _tracker && !_tracker->overflowed()) {
+            for(size_t chunk : _written) {
+               if(_tracker->is_dirty(chunk))
+                  continue;
+               const size_t offset = _tracker->chunk_offset(chunk);
+               // clean chunks are write protected, the fault handler makes them writable again when they are written
+               if(mmap(_src+offset, _tracker->chunk_length(chunk), PROT_READ, MAP_PRIVATE | MAP_FIXED, _fd, offset) == MAP_FAILED)
+                  BOOST_THROW_EXCEPTION(std::runtime_error("Could not map \"" + _database_name + "\" database file: " + std::string(strerror(errno))));
+            }
+         }
+#endif
+         _written.clear();
+      }
+
+      void write_chunks(const std::vector<size_t>& chunks, bool verbose) {
+         if(_direct) {
+            write_chunks_direct(chunks, verbose);
+            return;
+         }
+         const size_t chunk_size = _tracker ? _tracker->chunk_size() : _size;
+         const size_t total = chunks.size() * chunk_size;
+         const bool background = _thread.joinable() && std::this_thread::get_id() == _thread.get_id();
+         std::vector<char> buffer(background ? chunk_size : 0);
+
+         size_t written = 0;
+         time_t t = time(nullptr);
+         for(size_t chunk : chunks) {
+            const size_t offset = chunk * chunk_size;
+            const size_t length = std::min(chunk_size, _size - offset);
+            if(!_tracker) {
+               emit(offset, _src+offset, length);
+            }
+            else if(_tracker->claim(chunk)) {
+               // in the background, hold the chunk only as long as a memcpy takes; file I/O happens after release
+               if(background) {
+                  memcpy(buffer.data(), _src+offset, length);
+                  _tracker->release(chunk);
+                  emit(offset, buffer.data(), length);
+               }
+               else {
+                  emit(offset, _src+offset, length);
+                  _tracker->release(chunk);
+               }
+            }
+            else if(char* preserved = _tracker->take_preserved(chunk)) {
+               emit(offset, preserved, length);
+               _tracker->free_preserved(chunk, preserved);
+            }
+            else if(_scratch) {
+               emit(offset, _scratch+offset, length);
+#ifndef _WIN32
+               madvise(_scratch+offset, length, MADV_DONTNEED);
+#endif
+            }
+            written += length;
+
+            if(verbose && time(nullptr) != t) {
+               t = time(nullptr);
+               std::cerr << "              " << written/(total/100) << "% complete..." << std::endl;
+            }
+         }
+      }
+
+      // Direct writes go out a batch at a time: chunks are gathered up to _direct_batch bytes, written as one queue
+      // of requests, and only then released. In the background they are staged first, as in write_chunks(), so a
+      // writer reaching one does not wait on the disk.
+      void write_chunks_direct(const std::vector<size_t>& chunks, bool verbose) {
+         struct pending {
+            size_t      offset;
+            const char* data;
+            size_t      length;
+            size_t      chunk;
+            bool        claimed;    ///< to release once written
+            char*       preserved;  ///< to free once written
+         };
+         const size_t chunk_size = _tracker ? _tracker->chunk_size() : _size;
+         const size_t total = chunks.size() * chunk_size;
+         const bool background = _thread.joinable() && std::this_thread::get_id() == _thread.get_id();
+         const size_t batch_limit = std::max<size_t>(_direct_batch, chunk_size);
+         std::unique_ptr<char, decltype(&free)> staging(nullptr, &free);
+         if(background) {
+            void* p = nullptr;
+            if(posix_memalign(&p, direct_io::alignment, batch_limit))
+               throw std::bad_alloc();
+            staging.reset((char*)p);
+         }
+
+         std::vector<pending> batch;
+         size_t batch_bytes = 0;
+         size_t written = 0;
+         time_t t = time(nullptr);
+         auto write_batch = [&]() {
+            std::vector<direct_io::request> requests;
+            for(const pending& p : batch) {
+               for(size_t o = 0; o < p.length; o += _db_size_multiple_requirement) {
+                  const char* data = p.data + o;
+                  const uint64_t offset = p.offset + o;
+                  if(all_zeros(data, _db_size_multiple_requirement) && punch_hole(offset, _db_size_multiple_requirement))
+                     continue;
+                  if(requests.size() && requests.back().offset + requests.back().length == offset &&
+                     requests.back().data + requests.back().length == data)
+                     requests.back().length += _db_size_multiple_requirement;
+                  else
+                     requests.push_back({offset, const_cast<char*>(data), _db_size_multiple_requirement});
+               }
+            }
+            if(_direct && !_direct->write(requests, [](size_t) { return true; })) {
+               std::cerr << "CHAINBASE: Direct writes to \"" << _database_name << "\" database file failed, writing through the page cache instead" << std::endl;
+               _direct.reset();
+            }
+            for(const pending& p : batch) {
+               if(!_direct)
+                  write_out(p.offset, p.data, p.length);
+               if(p.claimed)
+                  _tracker->release(p.chunk);
+               if(p.preserved)
+                  _tracker->free_preserved(p.chunk, p.preserved);
+               written += p.length;
+            }
+            batch.clear();
+            batch_bytes = 0;
+            if(verbose && time(nullptr) != t) {
+               t = time(nullptr);
+               std::cerr << "              " << written/(total/100) << "% complete..." << std::endl;
+            }
+         };
+
+         for(size_t chunk : chunks) {
+            const size_t offset = chunk * chunk_size;
+            const size_t length = std::min(chunk_size, _size - offset);
+            if(batch_bytes + length > batch_limit)
+               write_batch();
+            if(!_tracker) {
+               batch.push_back({offset, _src+offset, length, chunk, false, nullptr});
+            }
+            else if(_tracker->claim(chunk)) {
+               if(background) {
+                  memcpy(staging.get()+batch_bytes, _src+offset, length);
+                  _tracker->release(chunk);
+                  batch.push_back({offset, staging.get()+batch_bytes, length, chunk, false, nullptr});
+               }
+               else
+                  batch.push_back({offset, _src+offset, length, chunk, true, nullptr});
+            }
+            else if(char* preserved = _tracker->take_preserved(chunk)) {
+               batch.push_back({offset, preserved, length, chunk, false, preserved});
+            }
+            else
+               continue;
+            batch_bytes += length;
+         }
+         write_batch();
+      }
+
+      // Hands a chunk to the journal, in pieces with all-zero ones left as such, or without one to the file
+      void emit(size_t offset, const char* data, size_t length) {
+         if(_journaling) {
+            for(size_t o = 0; o < length; o += _db_size_multiple_requirement) {
+               const char* piece = all_zeros(data+o, _db_size_multiple_requirement) ? nullptr : data+o;
+               if(!_journal->append(offset+o, piece, _db_size_multiple_requirement)) {
+                  abandon_journal();
+                  break;
+               }
+            }
+            if(_journaling)
+               return;
+         }
+         write_out(offset, data, length);
+      }
+
+      // A journal that cannot be written, on a full disk say, does not hold up the checkpoint. What made it into
+      // the journal goes to the file right away and the rest follows directly, with the file marked dirty until
+      // it is synced, as without a journal.
+      void abandon_journal() {
+         std::cerr << "CHAINBASE: Could not write journal of \"" << _database_name << "\" database, writing its file directly" << std::endl;
+         _journaling = false;
+         set_file_dirty(true);
+         _journal->for_each([this](uint64_t offset, const char* data, size_t length) { apply(offset, data, length); });
+      }
+
+      void apply(uint64_t offset, const char* data, size_t length) {
+         if(data)
+            write_out(offset, data, length);
+         else if(!punch_hole(offset, length))
+            memset(_dst+offset, 0, length);
+      }
+
+      // All-zero pieces are not copied. Instead they are punched out of the file, which both clears whatever
+      // the piece held at the previous checkpoint and keeps the file sparse.
+      void write_out(size_t offset, const char* data, size_t length) {
+         for(size_t o = 0; o < length; o += _db_size_multiple_requirement) {
+            if(!all_zeros(data+o, _db_size_multiple_requirement))
+               memcpy(_dst+offset+o, data+o, _db_size_multiple_requirement);
+            else if(!punch_hole(offset+o, _db_size_multiple_requirement) && !all_zeros(_dst+offset+o, _db_size_multiple_requirement))
+               memset(_dst+offset+o, 0, _db_size_multiple_requirement);
+         }
+         // the header in memory need not carry the flag, and a file marked dirty has to stay so until it is synced
+         if(offset == 0 && _marked_dirty)
+            *(_dst+header_dirty_bit_offset) = true;
+      }
+
+      bool punch_hole(size_t offset, size_t length) {
+#ifdef __linux__
+         if(_can_punch_holes && _fd >= 0) {
+            if(fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+               return true;
+            if(errno == EOPNOTSUPP || errno == ENOSYS)
+               _can_punch_holes = false;
+         }
+#endif
+         return false;
+      }
+
+      void finish(bool background) {
+         _applied = false;
+         if(_journaling) {
+            // chunks written while tracking was lost were not preserved, so what was journaled is no snapshot
+            if(background && _tracker && _tracker->overflowed()) {
+               std::cerr << "CHAINBASE: Database \"" << _database_name << "\" lost write tracking during a checkpoint; checkpoint discarded" << std::endl;
+               return;
+            }
+            if(_journal->commit())
+               _journal->for_each([this](uint64_t offset, const char* data, size_t length) { apply(offset, data, length); });
+            else
+               abandon_journal();
+         }
+         if(_file_region.flush(0, 0, false) == false || (_fd >= 0 && fsync(_fd))) {
+            std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
+            return;
+         }
+         if(!_marked_dirty) {
+            _applied = true;
+            return;
+         }
+         if(_tracker && _tracker->overflowed()) {
+            std::cerr << "CHAINBASE: Database \"" << _database_name << "\" lost write tracking during a checkpoint; file left marked dirty" << std::endl;
+            return;
+         }
+         set_file_dirty(false);
+         _applied = true;
+      }
+
+      void set_file_dirty(bool dirty) {
+         _marked_dirty = dirty;
+         *(_dst+header_dirty_bit_offset) = dirty;
+         if(_file_region.flush(0, header_size, false) == false)
+            std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
+      }
+
+      char* const                                   _src;
+      size_t                                        _size;
+      const size_t                                  _capacity;
+      write_tracker* const                          _tracker;
+      bip::mapped_region                            _file_region;
+      char* const                                   _dst;
+      const int                                     _fd;
+      std::unique_ptr<direct_io>                    _direct;  ///< see map_options::direct_file_io
+      const std::unique_ptr<journal>                _journal; ///< see map_options::journal
+      const bool                                    _private; ///< _src is a private mapping of the file
+      char*                                         _scratch = nullptr; ///< the tracker's fallback target with a journal
+      bool                                          _journaling = false; ///< the checkpoint in progress goes through the journal
+      bool                                          _marked_dirty = false;
+      bool                                          _applied = false; ///< the last checkpoint reached the file in full
+      std::vector<size_t>                           _written; ///< chunks of the last checkpoint
+      bool                                          _can_punch_holes = true;
+      const std::string                             _database_name;
+      const std::chrono::seconds                    _interval;
+
+      std::thread                                   _thread;
+      std::mutex                                    _mutex;
+      std::condition_variable                       _cv;
+      std::vector<size_t>                           _chunks;
+      std::atomic<bool>                             _in_progress{false};
+      bool                                          _stop = false;
+      std::atomic<std::chrono::steady_clock::time_point> _last_checkpoint;
+
+      constexpr static size_t                       _direct_batch = 64*1024*1024;
+};
+
+constexpr size_t pinnable_mapped_file::checkpointer::_direct_batch;
+
+/**
+ * Copies the file of a database opened with map_options::load_in_background into memory on a thread of its
+ * own while the database is used from the file mapping. It only copies; finish_loading() switches over.
+ */
+class pinnable_mapped_file::background_loader {
+   public:
+      background_loader(const char* src, char* dst, size_t size, std::vector<char> has_data, std::unique_ptr<direct_io> direct,
+                        const map_options& options, const std::string& database_name) :
+         options(options),
+         _direct(std::move(direct)),
+         _start(std::chrono::steady_clock::now())
+      {
+         _thread = std::thread([this, src, dst, size, has_data = std::move(has_data), database_name]() {
+            try {
+               copy_database_file(src, dst, size, has_data, this->options.preload_threads, _direct.get(), false,
+                                  [this]() { return !_stop; });
+               _complete = !_stop;
+            }
+            catch(const std::exception& e) {
+               std::cerr << "CHAINBASE: Background load of \"" << database_name << "\" database failed: " << e.what() << std::endl;
+            }
+            if(_complete) {
+               const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _start);
+               std::cerr << "CHAINBASE: Database \"" << database_name << "\" loaded in the background in " << elapsed.count() << "ms" << std::endl;
+            }
+            _done = true;
+         });
+      }
+
+      ~background_loader() {
+         _stop = true;
+         join();
+      }
+
+      bool done() const { return _done; }
+      /// false if the copy stopped early; everything then has to be copied at the switch
+      bool complete() const { return _complete; }
+      void join() {
+         if(_thread.joinable())
+            _thread.join();
+      }
+
+      const map_options                             options;  ///< what the rest of the open applies at the switch
+
+   private:
+      const std::unique_ptr<direct_io>              _direct;
+      const std::chrono::steady_clock::time_point   _start;
+      std::atomic<bool>                             _stop{false};
+      std::atomic<bool>                             _complete{false};
+      std::atomic<bool>                             _done{false};
+      std::thread                                   _thread;
+};
+
+// chunks that cover whole huge pages keep the tracker's protection changes from splitting them
+size_t pinnable_mapped_file::tracking_chunk_size() const {
+   return write_tracker::choose_chunk_size(_capacity, _db_size_multiple_requirement, std::max(_region_page_size, _huge_page_alignment));
+}
+
+void pinnable_mapped_file::start_write_tracking(bip::mapped_region& region, bool track_dirty_chunks) {
+#ifndef _WIN32
+   _write_tracker.reset(new write_tracker((char*)region.get_address(), _size, _capacity, tracking_chunk_size()));
+   if(track_dirty_chunks ? !_write_tracker->arm() : !_write_tracker->attach()) {
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" could not enable write tracking; "
+                << (track_dirty_chunks ? "the whole database will be written on exit" : "read views are unavailable") << std::endl;
+      _write_tracker.reset();
+   }
+#endif
+}
+
 pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty,
-                                          map_mode mode, std::vector<std::string> hugepage_paths) :
+                                          map_mode mode, std::vector<std::string> hugepage_paths,
+                                          const map_options& options) :
    _data_file_path(bfs::absolute(dir/"shared_memory.bin")),
    _database_name(dir.filename().string()),
-   _writable(writable)
+   _writable(writable),
+   _mode(mode)
 {
-   if(shared_file_size % _db_size_multiple_requirement)
+   if(shared_file_size % _db_size_multiple_requirement || options.max_size % _db_size_multiple_requirement)
       BOOST_THROW_EXCEPTION(std::runtime_error("Database must be mulitple of " + std::to_string(_db_size_multiple_requirement) + " bytes"));
 #ifndef __linux__
    if(hugepage_paths.size())
@@ -26,6 +627,51 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
 #endif
    if(hugepage_paths.size() && mode != locked)
       BOOST_THROW_EXCEPTION(std::runtime_error("Locked mode is required for hugepage usage"));
+   _shared_name = options.shared_name;
+   if(_shared_name.size()) {
+#ifndef __linux__
+      BOOST_THROW_EXCEPTION(std::runtime_error("Sharing the memory of a database is a linux only feature"));
+#endif
+      if(_shared_name.find('/') != std::string::npos)
+         BOOST_THROW_EXCEPTION(std::runtime_error("Shared name \"" + _shared_name + "\" must not contain '/'"));
+   }
+   if(options.numa != numa_policy::none && !options.numa_nodes)
+      BOOST_THROW_EXCEPTION(std::runtime_error("A NUMA policy needs at least one node"));
+   // views are copied out of memory by the same fault handler, which is only ever installed when asked for
+   if(_writable && options.read_views && !options.track_dirty_chunks)
+      BOOST_THROW_EXCEPTION(std::runtime_error("Read views need track_dirty_chunks"));
+   // a read only database has no call boundaries to switch over at, so it keeps loading up front
+   _background_load = options.load_in_background && _writable && mode != mapped;
+   if(_background_load) {
+#ifndef __linux__
+      BOOST_THROW_EXCEPTION(std::runtime_error("Loading a database in the background is a linux only feature"));
+#endif
+      if(options.read_views || _shared_name.size() || options.journal)
+         BOOST_THROW_EXCEPTION(std::runtime_error("Loading a database in the background cannot be combined with read views, a shared name or a journal"));
+   }
+   if(options.journal) {
+#ifdef _WIN32
+      BOOST_THROW_EXCEPTION(std::runtime_error("Journaling is not supported on win32"));
+#endif
+      if(mode == mapped && options.read_views)
+         BOOST_THROW_EXCEPTION(std::runtime_error("A journal cannot be combined with read views in mapped mode"));
+   }
+   // with a journal, mapped mode keeps its changes out of the file until a checkpoint writes them
+   const bool private_mapping = _writable && mode == mapped && options.journal;
+   const bip::mode_t file_access = private_mapping ? bip::copy_on_write : bip::read_write;
+#ifdef __linux__
+   if(options.transparent_huge_pages && mode != locked)
+      _huge_page_alignment = transparent_huge_page_size();
+#endif
+   // The database is used straight from the file mapping in mapped mode, and while loading in the background;
+   // in the latter case memory is later mapped at the same address, which hugetlbfs wants aligned to its pages.
+   size_t file_alignment = 0;
+   if(mode == mapped)
+      file_alignment = _huge_page_alignment;
+   else if(_background_load)
+      file_alignment = hugepage_paths.size() ? size_t(1) << 30 : _huge_page_alignment;
+   // a reader of a writer's shared memory does not load the file, so its state does not matter
+   const bool attach = !_writable && mode != mapped && _shared_name.size();
 #ifdef _WIN32
    if(mode == locked)
       BOOST_THROW_EXCEPTION(std::runtime_error("Locked mode not supported on win32"));
@@ -35,6 +681,18 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       BOOST_THROW_EXCEPTION(std::runtime_error("database file not found at " + _data_file_path.string()));
    bfs::create_directories(dir);
 
+   // a checkpoint cut short by a crash is finished before anything looks at the file
+   if(bfs::exists(journal_path()) && bfs::exists(_data_file_path)) {
+      if(_writable) {
+         bip::file_lock lock(_data_file_path.generic_string().c_str());
+         if(!lock.try_lock())
+            BOOST_THROW_EXCEPTION(std::runtime_error("could not gain write access to the shared memory file"));
+         journal::recover(journal_path(), _data_file_path, _database_name);
+      }
+      else
+         std::cerr << "CHAINBASE: \"" << _database_name << "\" database has a journal that was not applied, it is recovered when opened writable" << std::endl;
+   }
+
    if(bfs::exists(_data_file_path)) {
       char header[header_size];
       std::ifstream hs(_data_file_path.generic_string(), std::ifstream::binary);
@@ -45,7 +703,8 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       db_header* dbheader = reinterpret_cast<db_header*>(header);
       if(dbheader->id != header_id)
          BOOST_THROW_EXCEPTION(std::runtime_error("\"" + _database_name + "\" database format not compatible with this version of chainbase."));
-      if(!allow_dirty && dbheader->dirty)
+      // a reader opening the file next to its running writer finds the flag the writer set
+      if(!allow_dirty && dbheader->dirty && !attach && (_writable || !writer_is_open(_data_file_path)))
          throw std::runtime_error("\"" + _database_name + "\" database dirty flag set");
       if(dbheader->dbenviron != environment()) {
          std::cerr << "CHAINBASE: \"" << _database_name << "\" database was created with a chainbase from a different environment" << std::endl;
@@ -58,34 +717,46 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
    }
 
    segment_manager* file_mapped_segment_manager = nullptr;
-   if(!bfs::exists(_data_file_path)) {
+   const bool created = !bfs::exists(_data_file_path);
+   if(created) {
+      // a journal without its file is left from a database that was removed
+      boost::system::error_code ec;
+      bfs::remove(journal_path(), ec);
       std::ofstream ofs(_data_file_path.generic_string(), std::ofstream::trunc);
       //win32 impl of bfs::resize_file() doesn't like the file being open
       ofs.close();
       bfs::resize_file(_data_file_path, shared_file_size);
+      _size = shared_file_size;
+      _capacity = std::max<uint64_t>(_size, options.max_size);
       _file_mapping = bip::file_mapping(_data_file_path.generic_string().c_str(), bip::read_write);
-      _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write);
+      // in mapped mode the mapping spans the whole reserved range; the part past the end of the file stays untouched until grow()
+      _file_mapped_region = map_database_file(file_access, mode == mapped || _background_load ? _capacity : _size, file_alignment);
       file_mapped_segment_manager = new ((char*)_file_mapped_region.get_address()+header_size) segment_manager(shared_file_size-header_size);
       new (_file_mapped_region.get_address()) db_header;
    }
    else if(_writable) {
          auto existing_file_size = bfs::file_size(_data_file_path);
-         size_t grow = 0;
-         if(shared_file_size > existing_file_size) {
-            grow = shared_file_size - existing_file_size;
+         if(shared_file_size > existing_file_size)
             bfs::resize_file(_data_file_path, shared_file_size);
-         }
+         _size = std::max<uint64_t>(existing_file_size, shared_file_size);
+         _capacity = std::max<uint64_t>(_size, options.max_size);
          _file_mapping = bip::file_mapping(_data_file_path.generic_string().c_str(), bip::read_write);
-         _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write);
+         _file_mapped_region = map_database_file(file_access, mode == mapped || _background_load ? _capacity : _size, file_alignment);
          file_mapped_segment_manager = reinterpret_cast<segment_manager*>((char*)_file_mapped_region.get_address()+header_size);
-         if(grow)
-            file_mapped_segment_manager->grow(grow);
+         // also picks up a file that was extended by a grow() in heap or locked mode but never checkpointed since
+         const size_t segment_size = _size - header_size;
+         if(segment_size > file_mapped_segment_manager->get_size())
+            file_mapped_segment_manager->grow(segment_size - file_mapped_segment_manager->get_size());
    }
    else {
+         _size = _capacity = bfs::file_size(_data_file_path);
          _file_mapping = bip::file_mapping(_data_file_path.generic_string().c_str(), bip::read_only);
-         _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_only);
+         _file_mapped_region = map_database_file(bip::read_only, _size, file_alignment);
          file_mapped_segment_manager = reinterpret_cast<segment_manager*>((char*)_file_mapped_region.get_address()+header_size);
    }
+   if(_capacity > _size)
+      _grow_threshold = options.grow_threshold;
+   _grow_increment = options.grow_increment;
 
    if(_writable) {
       //remove meta file created in earlier versions
@@ -96,11 +767,38 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       if(!_mapped_file_lock.try_lock())
          BOOST_THROW_EXCEPTION(std::runtime_error("could not gain write access to the shared memory file"));
 
-      set_mapped_file_db_dirty(true);
+      if(!options.journal)
+         set_mapped_file_db_dirty(true);
    }
 
    if(mode == mapped) {
       _segment_manager = file_mapped_segment_manager;
+      _region_page_size = bip::mapped_region::get_page_size();
+      place_memory(_file_mapped_region, options);
+      if(options.warm_up) {
+         _record_working_set = _writable;
+         _warm_up = working_set::warm_up((char*)_file_mapped_region.get_address(), _size, working_set_path(),
+                                         options.preload_threads, _database_name);
+      }
+      if(_writable && options.read_views)
+         start_write_tracking(_file_mapped_region, false);
+      if(private_mapping) {
+         if(options.track_dirty_chunks)
+            start_write_tracking(_file_mapped_region, true);
+         _checkpointer.reset(new checkpointer((char*)_file_mapped_region.get_address(), _size, _capacity, _write_tracker.get(),
+                                              _file_mapping, nullptr, open_journal(options), true, _database_name,
+                                              options.checkpoint_interval));
+         // the new database only exists in memory so far
+         if(created)
+            _checkpointer->flush(false);
+      }
+   }
+   else if(attach) {
+      _region_page_size = bip::mapped_region::get_page_size();
+      _mapped_region = attach_shared_region(hugepage_paths);
+      _size = _capacity = _mapped_region.get_size();
+      _file_mapped_region = bip::mapped_region();
+      _segment_manager = reinterpret_cast<segment_manager*>((char*)_mapped_region.get_address()+header_size);
    }
    else {
       boost::asio::io_service sig_ios;
@@ -113,36 +811,139 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       });
 
       try {
-         if(mode == heap)
-            _mapped_region = bip::mapped_region(bip::anonymous_shared_memory(shared_file_size));
+         if(mode == heap) {
+            _region_page_size = bip::mapped_region::get_page_size();
+            // a memory file can be mapped over the file mapping once a background load is done
+            _mapped_region = _capacity > _size || _shared_name.size() || _huge_page_alignment || _background_load
+                                ? get_growable_region() : bip::mapped_region(bip::anonymous_shared_memory(_size));
+         }
          else
             _mapped_region = get_huge_region(hugepage_paths);
+         place_memory(_mapped_region, options);
 
-         load_database_file(sig_ios);
-
-         if(mode == locked) {
-#ifndef _WIN32
-            if(mlock(_mapped_region.get_address(), _mapped_region.get_size()))
-               BOOST_THROW_EXCEPTION(std::runtime_error("Failed to mlock database \"" + _database_name + "\""));
-            std::cerr << "CHAINBASE: Database \"" << _database_name << "\" has been successfully locked in memory" << std::endl;
-#endif
+         if(_background_load) {
+            std::cerr << "CHAINBASE: Loading \"" << _database_name << "\" database file in the background, using the file until then" << std::endl;
+            // a chunk written from here on may already have been copied, finish_loading() copies it again;
+            // without tracking it copies everything
+            if(options.track_dirty_chunks) {
+               _write_tracker.reset(new write_tracker((char*)_file_mapped_region.get_address(), _size, _capacity, tracking_chunk_size()));
+               if(!_write_tracker->arm())
+                  _write_tracker.reset();
+            }
+            _loader.reset(new background_loader((const char*)_file_mapped_region.get_address(), (char*)_mapped_region.get_address(),
+                                                _size, find_data_pieces(), open_direct_io(options, false), options, _database_name));
+         }
+         else {
+            load_database_file(sig_ios, options);
+            use_memory(options);
+            // with periodic checkpoints the untouched file is the first checkpoint; a crash can fall back to it
+            if(_writable && options.checkpoint_interval.count())
+               set_mapped_file_db_dirty(false);
+            _file_mapped_region = bip::mapped_region();
          }
-
-         _file_mapped_region = bip::mapped_region();
       }
       catch(...) {
+         _loader.reset();
+         _write_tracker.reset();
          if(_writable)
             set_mapped_file_db_dirty(false);
          throw;
       }
 
-      _segment_manager = reinterpret_cast<segment_manager*>((char*)_mapped_region.get_address()+header_size);
+      _segment_manager = reinterpret_cast<segment_manager*>((char*)(_loader ? _file_mapped_region : _mapped_region).get_address()+header_size);
+   }
+
+   if(_writable) {
+      std::lock_guard<std::mutex> g(open_writers_mutex);
+      open_writers.insert(_data_file_path);
+   }
+}
+
+// What opening in heap or locked mode does once memory holds the database
+void pinnable_mapped_file::use_memory(const map_options& options) {
+   if(_mode == locked) {
+#ifndef _WIN32
+      if(mlock(_mapped_region.get_address(), _size))
+         BOOST_THROW_EXCEPTION(std::runtime_error("Failed to mlock database \"" + _database_name + "\""));
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" has been successfully locked in memory" << std::endl;
+#endif
    }
+
+   if(_writable) {
+      if(options.track_dirty_chunks)
+         start_write_tracking(_mapped_region, true);
+      // journaled checkpoints go through the page cache, the journal being read back to apply it
+      _checkpointer.reset(new checkpointer((char*)_mapped_region.get_address(), _size, _capacity, _write_tracker.get(),
+                                           _file_mapping, options.journal ? nullptr : open_direct_io(options, true),
+                                           open_journal(options), false, _database_name, options.checkpoint_interval));
+   }
+}
+
+std::unique_ptr<journal> pinnable_mapped_file::open_journal(const map_options& options) const {
+   if(!options.journal)
+      return nullptr;
+   return std::unique_ptr<journal>(new journal(journal_path()));
+}
+
+std::unique_ptr<direct_io> pinnable_mapped_file::open_direct_io(const map_options& options, bool writable) const {
+   if(!options.direct_file_io)
+      return nullptr;
+   std::unique_ptr<direct_io> direct = direct_io::open(_data_file_path, writable, options.preload_threads);
+   if(direct)
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" " << (writable ? "writes" : "reads") << " its file directly using "
+                << direct->backend() << std::endl;
+   else
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" cannot bypass the page cache: " << strerror(errno) << std::endl;
+   return direct;
+}
+
+// The memory file is mapped over the file mapping, so every address into the database stays valid. Writes
+// went to the file until now, so the file matches memory and the write tracker starts out with no dirty chunk.
+void pinnable_mapped_file::finish_loading(bool wait) {
+   if(!_loader || (!wait && !_loader->done()))
+      return;
+#ifdef __linux__
+   _loader->join();
+   const map_options options = _loader->options;
+   char* const live = (char*)_file_mapped_region.get_address();
+   char* const loaded = (char*)_mapped_region.get_address();
+
+   size_t recopied = 0;
+   if(_write_tracker && !_write_tracker->overflowed() && _loader->complete()) {
+      for(size_t chunk = 0; chunk < _write_tracker->num_chunks(); ++chunk) {
+         if(_write_tracker->is_dirty(chunk)) {
+            const size_t offset = _write_tracker->chunk_offset(chunk);
+            memcpy(loaded+offset, live+offset, _write_tracker->chunk_length(chunk));
+            ++recopied;
+         }
+      }
+   }
+   else {
+      memcpy(loaded, live, _size);
+      recopied = _size / _db_size_multiple_requirement;
+   }
+   _write_tracker.reset();
+   _loader.reset();
+
+   if(_file_mapped_region.flush(0, 0, false) == false)
+      std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
+   if(options.checkpoint_interval.count())
+      set_mapped_file_db_dirty(false);
+
+   if(mmap(live, _capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | (_capacity > _size ? MAP_NORESERVE : 0), _memory_fd, 0) == MAP_FAILED)
+      BOOST_THROW_EXCEPTION(std::runtime_error("Could not switch database \"" + _database_name + "\" over to memory: " + std::string(strerror(errno))));
+   // the file mapping's region now describes the memory at that address; the loader's mapping of it goes away
+   _mapped_region = std::move(_file_mapped_region);
+   place_memory(_mapped_region, options);
+   use_memory(options);
+   std::cerr << "CHAINBASE: Database \"" << _database_name << "\" switched over to memory, " << recopied
+             << " chunks written while loading were copied again" << std::endl;
+#endif
 }
 
 bip::mapped_region pinnable_mapped_file::get_huge_region(const std::vector<std::string>& huge_paths) {
    std::map<unsigned, std::string> page_size_to_paths;
-   const auto mapped_file_size = _file_mapped_region.get_size();
+   const uint64_t mapped_file_size = _size;
 
 #ifdef __linux__
    for(const std::string& p : huge_paths) {
@@ -154,8 +955,11 @@ bip::mapped_region pinnable_mapped_file::get_huge_region(const std::vector<std::
       page_size_to_paths[fs.f_bsize] = p;
    }
    for(auto it = page_size_to_paths.rbegin(); it != page_size_to_paths.rend(); ++it) {
-      if(mapped_file_size % it->first == 0) {
-         bfs::path hugepath = bfs::unique_path(bfs::path(it->second + "/%%%%%%%%%%%%%%%%%%%%%%%%%%"));
+      if(mapped_file_size % it->first == 0 && _capacity % it->first == 0) {
+         bfs::path hugepath = _shared_name.empty() ? bfs::unique_path(bfs::path(it->second + "/%%%%%%%%%%%%%%%%%%%%%%%%%%"))
+                                                   : bfs::path(it->second) / _shared_name;
+         if(_shared_name.size())
+            bfs::remove(hugepath); // left behind by a writer that did not close
          int fd = creat(hugepath.string().c_str(), _db_permissions.get_permissions());
          if(fd < 0)
             BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Could not open hugepage file in ") + it->second + ": " + std::string(strerror(errno))));
@@ -163,39 +967,233 @@ bip::mapped_region pinnable_mapped_file::get_huge_region(const std::vector<std::
             BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Failed to grow hugepage file to specified size")));
          close(fd);
          bip::file_mapping filemap(hugepath.generic_string().c_str(), _writable ? bip::read_write : bip::read_only);
-         bfs::remove(hugepath);
+         if(_shared_name.empty())
+            bfs::remove(hugepath);
+         else
+            _shared_object = hugepath.string();
          std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using " << it->first << " byte pages" << std::endl;
-         return bip::mapped_region(filemap, _writable ? bip::read_write : bip::read_only);
+         _region_page_size = it->first;
+         if(_capacity == mapped_file_size && !_background_load)
+            return bip::mapped_region(filemap, _writable ? bip::read_write : bip::read_only);
+         // Without MAP_NORESERVE the kernel would set aside huge pages for the whole reserved range right away.
+         // Pages are taken as the database grows instead, and mlock() reports when there are none left.
+         _memory_fd = dup(filemap.get_mapping_handle().handle);
+         if(_memory_fd < 0)
+            BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Could not keep hugepage file open: ") + std::string(strerror(errno))));
+         return bip::mapped_region(filemap, bip::read_write, 0, _capacity, nullptr, _capacity > mapped_file_size ? MAP_NORESERVE : 0);
       }
    }
 #endif
 
    std::cerr << "CHAINBASE: Database \"" << _database_name << "\" not using huge pages" << std::endl;
+   _region_page_size = bip::mapped_region::get_page_size();
+   if(_capacity > mapped_file_size || _shared_name.size() || _background_load)
+      return get_growable_region();
    return bip::mapped_region(bip::anonymous_shared_memory(mapped_file_size));
 }
 
-void pinnable_mapped_file::load_database_file(boost::asio::io_service& sig_ios) {
+namespace {
+   /// lets bip::mapped_region map an already open descriptor
+   struct descriptor_mapping {
+      int fd;
+      bip::mapping_handle_t get_mapping_handle() const { return bip::ipcdetail::mapping_handle_from_file_handle(fd); }
+   };
+}
+
+// Anonymous shared memory cannot be extended in place, a memory file can: it is mapped over the whole reserved
+// range up front and grow() only has to extend the file.
+bip::mapped_region pinnable_mapped_file::get_growable_region() {
+#ifdef __linux__
+   _memory_fd = create_memory_file();
+   if(_memory_fd < 0 || ftruncate(_memory_fd, _size))
+      BOOST_THROW_EXCEPTION(std::runtime_error("Could not create memory file for database \"" + _database_name + "\": " + std::string(strerror(errno))));
+   return map_aligned(descriptor_mapping{_memory_fd}, bip::read_write, _capacity, _huge_page_alignment);
+#else
+   BOOST_THROW_EXCEPTION(std::runtime_error("Growing a database in heap or locked mode is a linux only feature"));
+#endif
+}
+
+bip::mapped_region pinnable_mapped_file::map_database_file(bip::mode_t access, uint64_t size, size_t alignment) {
+   return map_aligned(_file_mapping, access, size, alignment);
+}
+
+// Applies the transparent huge page and NUMA options to the memory holding the database before it is filled.
+// Neither is essential, so failures are reported and otherwise ignored.
+void pinnable_mapped_file::place_memory(bip::mapped_region& region, const map_options& options) {
+#ifdef __linux__
+   if(_huge_page_alignment && madvise(region.get_address(), region.get_size(), MADV_HUGEPAGE))
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" could not request transparent huge pages: " << strerror(errno) << std::endl;
+   if(options.numa != numa_policy::none && _mode != mapped) {
+      const int policies[] = { MPOL_DEFAULT, MPOL_BIND, MPOL_INTERLEAVE, MPOL_PREFERRED };
+      unsigned long nodes = options.numa_nodes;
+      if(syscall(SYS_mbind, region.get_address(), region.get_size(), policies[size_t(options.numa)], &nodes, sizeof(nodes)*8 + 1, 0))
+         std::cerr << "CHAINBASE: Database \"" << _database_name << "\" could not apply its NUMA policy: " << strerror(errno) << std::endl;
+   }
+#endif
+}
+
+// A private memory file, or a named shared memory object when other processes are to attach to the database
+int pinnable_mapped_file::create_memory_file() {
+#ifdef __linux__
+   if(_shared_name.empty())
+      return memfd_create(_database_name.c_str(), MFD_CLOEXEC);
+   const std::string name = "/" + _shared_name;
+   shm_unlink(name.c_str()); // left behind by a writer that did not close
+   const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, _db_permissions.get_permissions());
+   if(fd >= 0) {
+      _shared_object = name;
+      _shared_object_is_shm = true;
+   }
+   return fd;
+#else
+   return -1;
+#endif
+}
+
+// Maps what a writer shares under map_options::shared_name read only, as large as it is at this point
+bip::mapped_region pinnable_mapped_file::attach_shared_region(const std::vector<std::string>& hugepage_paths) {
+#ifdef __linux__
+   int fd = -1;
+   for(const std::string& p : hugepage_paths)
+      if((fd = open((bfs::path(p) / _shared_name).c_str(), O_RDONLY | O_CLOEXEC)) >= 0)
+         break;
+   if(fd < 0)
+      fd = shm_open(("/" + _shared_name).c_str(), O_RDONLY | O_CLOEXEC, 0);
+   if(fd < 0)
+      BOOST_THROW_EXCEPTION(std::runtime_error("No writer of database \"" + _database_name + "\" shares its memory as \"" + _shared_name + "\""));
+
+   struct stat st;
+   bip::mapped_region region;
+   try {
+      if(fstat(fd, &st) || st.st_size < (off_t)header_size)
+         BOOST_THROW_EXCEPTION(std::runtime_error("Shared memory \"" + _shared_name + "\" does not hold a database"));
+      region = bip::mapped_region(descriptor_mapping{fd}, bip::read_only, 0, st.st_size);
+   }
+   catch(...) {
+      close(fd);
+      throw;
+   }
+   close(fd);
+   std::cerr << "CHAINBASE: Database \"" << _database_name << "\" attached to the memory of its writer" << std::endl;
+   return region;
+#else
+   BOOST_THROW_EXCEPTION(std::runtime_error("Sharing the memory of a database is a linux only feature"));
+#endif
+}
+
+void pinnable_mapped_file::load_database_file(boost::asio::io_service& sig_ios, const map_options& options) {
    std::cerr << "CHAINBASE: Preloading \"" << _database_name << "\" database file, this could take a moment..." << std::endl;
-   char* const src = (char*)_file_mapped_region.get_address();
-   char* const dst = (char*)_mapped_region.get_address();
-   size_t offset = 0;
-   time_t t = time(nullptr);
-   while(offset != _file_mapped_region.get_size()) {
-      memcpy(dst+offset, src+offset, _db_size_multiple_requirement);
-      offset += _db_size_multiple_requirement;
+   std::unique_ptr<direct_io> direct = open_direct_io(options, false);
+   if(!direct)
+      _file_mapped_region.advise(bip::mapped_region::advice_sequential);
 
-      if(time(nullptr) != t) {
-         t = time(nullptr);
-         std::cerr << "              " << offset/(_mapped_region.get_size()/100) << "% complete..." << std::endl;
+   // Holes in a sparse file read back as zeros, which the freshly mapped region already is; skip them
+   const std::vector<char> has_data = find_data_pieces();
+   std::cerr << "           " << std::count(has_data.begin(), has_data.end(), true)*(_db_size_multiple_requirement/1024/1024)
+             << "MB of " << _size/1024/1024 << "MB allocated in file" << std::endl;
+
+   copy_database_file((const char*)_file_mapped_region.get_address(), (char*)_mapped_region.get_address(), _size, has_data,
+                      options.preload_threads, direct.get(), true, [&]() { sig_ios.poll(); return true; });
+   std::cerr << "           Complete" << std::endl;
+}
+
+// The calling thread only coordinates: it checks keep_going() every 10ms and stops the workers once that returns
+// false or throws, and with report set it prints the progress once a second. With direct set the pieces holding
+// data are read from the file straight into dst; should that fail, they are copied from src after all.
+void pinnable_mapped_file::copy_database_file(const char* src, char* dst, size_t size, const std::vector<char>& has_data,
+                                              unsigned num_threads, direct_io* direct, bool report,
+                                              const std::function<bool()>& keep_going) {
+   if(direct) {
+      std::vector<direct_io::request> requests;
+      for(size_t piece = 0; piece < has_data.size(); ++piece) {
+         if(!has_data[piece])
+            continue;
+         const uint64_t offset = piece * _db_size_multiple_requirement;
+         if(requests.size() && requests.back().offset + requests.back().length == offset)
+            requests.back().length += _db_size_multiple_requirement;
+         else
+            requests.push_back({offset, dst + offset, _db_size_multiple_requirement});
       }
-      sig_ios.poll();
+      const size_t total = std::count(has_data.begin(), has_data.end(), true) * _db_size_multiple_requirement;
+      bool stopped = false;
+      time_t t = time(nullptr);
+      const bool read = direct->read(requests, [&](size_t done) {
+         if(report && time(nullptr) != t) {
+            t = time(nullptr);
+            // a file with no data at all leaves nothing to read
+            std::cerr << "              " << (total ? done*100/total : 100) << "% complete..." << std::endl;
+         }
+         stopped = !keep_going();
+         return !stopped;
+      });
+      if(read || stopped)
+         return;
+      std::cerr << "CHAINBASE: Direct reads of database file failed, copying it through the page cache instead" << std::endl;
    }
-   std::cerr << "           Complete" << std::endl;
+
+   const size_t num_batches = (size + _preload_batch_size - 1) / _preload_batch_size;
+
+   if(num_threads == 0)
+      num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+   num_threads = std::min<size_t>(num_threads, num_batches);
+
+   // Workers claim batches in file order so the combined access pattern stays close to sequential; each
+   // batch is announced to the kernel before it is copied so readahead runs ahead of the memcpy.
+   std::atomic<size_t> next_batch{0};
+   std::atomic<size_t> copied{0};
+   std::atomic<bool>   abort{false};
+   std::vector<std::thread> workers;
+   auto copy_batches = [&]() {
+      size_t batch;
+      while(!abort && (batch = next_batch++) < num_batches) {
+         size_t offset = batch * _preload_batch_size;
+         const size_t end = std::min(offset + _preload_batch_size, size);
+         const auto first_piece = has_data.begin() + offset/_db_size_multiple_requirement;
+         const auto last_piece = has_data.begin() + end/_db_size_multiple_requirement;
+#ifndef _WIN32
+         if(std::find(first_piece, last_piece, true) != last_piece)
+            madvise(const_cast<char*>(src)+offset, end-offset, MADV_WILLNEED);
+#endif
+         for(; offset != end && !abort; offset += _db_size_multiple_requirement) {
+            if(has_data[offset/_db_size_multiple_requirement])
+               memcpy(dst+offset, src+offset, _db_size_multiple_requirement);
+            copied += _db_size_multiple_requirement;
+         }
+      }
+   };
+
+   try {
+      for(unsigned i = 0; i < num_threads; ++i)
+         workers.emplace_back(copy_batches);
+
+      time_t t = time(nullptr);
+      while(copied != size) {
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+         if(report && time(nullptr) != t) {
+            t = time(nullptr);
+            std::cerr << "              " << copied/(size/100) << "% complete..." << std::endl;
+         }
+         if(!keep_going()) {
+            abort = true;
+            break;
+         }
+      }
+   }
+   catch(...) {
+      abort = true;
+      for(std::thread& w : workers)
+         w.join();
+      throw;
+   }
+   for(std::thread& w : workers)
+      w.join();
 }
 
-bool pinnable_mapped_file::all_zeros(char* data, size_t sz) {
-   uint64_t* p = (uint64_t*)data;
-   uint64_t* end = p+sz/sizeof(uint64_t);
+namespace {
+
+bool all_zeros_scalar(const char* data, size_t sz) {
+   const uint64_t* p = (const uint64_t*)data;
+   const uint64_t* end = p+sz/sizeof(uint64_t);
    while(p != end) {
       if(*p++ != 0)
          return false;
@@ -203,63 +1201,252 @@ bool pinnable_mapped_file::all_zeros(char* data, size_t sz) {
    return true;
 }
 
-void pinnable_mapped_file::save_database_file() {
-   std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, this could take a moment..." << std::endl;
-   char* src = (char*)_mapped_region.get_address();
-   char* dst = (char*)_file_mapped_region.get_address();
-   size_t offset = 0;
-   time_t t = time(nullptr);
-   while(offset != _file_mapped_region.get_size()) {
-      if(!all_zeros(src+offset, _db_size_multiple_requirement))
-         memcpy(dst+offset, src+offset, _db_size_multiple_requirement);
-      offset += _db_size_multiple_requirement;
+// The vector versions OR together 128 bytes at a time before testing, so a non-zero chunk is rejected
+// within the first few cache lines while a zero chunk runs at memory bandwidth.
+constexpr size_t zero_scan_block = 128;
 
-      if(time(nullptr) != t) {
-         t = time(nullptr);
-         std::cerr << "              " << offset/(_file_mapped_region.get_size()/100) << "% complete..." << std::endl;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+bool all_zeros_avx2(const char* data, size_t sz) {
+   const char* const end = data + sz/zero_scan_block*zero_scan_block;
+   for(; data != end; data += zero_scan_block) {
+      __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)data),    _mm256_loadu_si256((const __m256i*)(data+32)));
+      __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(data+64)), _mm256_loadu_si256((const __m256i*)(data+96)));
+      __m256i v = _mm256_or_si256(a, b);
+      if(!_mm256_testz_si256(v, v))
+         return false;
+   }
+   return all_zeros_scalar(data, sz%zero_scan_block);
+}
+
+__attribute__((target("sse2")))
+bool all_zeros_sse2(const char* data, size_t sz) {
+   const char* const end = data + sz/zero_scan_block*zero_scan_block;
+   const __m128i zero = _mm_setzero_si128();
+   for(; data != end; data += zero_scan_block) {
+      __m128i v = _mm_loadu_si128((const __m128i*)data);
+      for(size_t i = 16; i < zero_scan_block; i += 16)
+         v = _mm_or_si128(v, _mm_loadu_si128((const __m128i*)(data+i)));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+         return false;
+   }
+   return all_zeros_scalar(data, sz%zero_scan_block);
+}
+#elif defined(__aarch64__)
+bool all_zeros_neon(const char* data, size_t sz) {
+   const char* const end = data + sz/zero_scan_block*zero_scan_block;
+   for(; data != end; data += zero_scan_block) {
+      uint64x2_t v = vld1q_u64((const uint64_t*)data);
+      for(size_t i = 16; i < zero_scan_block; i += 16)
+         v = vorrq_u64(v, vld1q_u64((const uint64_t*)(data+i)));
+      if(vmaxvq_u32(vreinterpretq_u32_u64(v)))
+         return false;
+   }
+   return all_zeros_scalar(data, sz%zero_scan_block);
+}
+#endif
+
+using all_zeros_fn = bool(*)(const char*, size_t);
+
+all_zeros_fn select_all_zeros() {
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2"))
+      return all_zeros_avx2;
+   if(__builtin_cpu_supports("sse2"))
+      return all_zeros_sse2;
+#elif defined(__aarch64__)
+   return all_zeros_neon;
+#endif
+   return all_zeros_scalar;
+}
+
+}
+
+std::vector<char> pinnable_mapped_file::find_data_pieces() const {
+   const size_t size = _size;
+   std::vector<char> has_data(size/_db_size_multiple_requirement, true);
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+   const int fd = _file_mapping.get_mapping_handle().handle;
+   std::vector<char> found(has_data.size(), false);
+   off_t pos = 0;
+   while((size_t)pos < size) {
+      off_t data = lseek(fd, pos, SEEK_DATA);
+      if(data < 0) {
+         if(errno == ENXIO) // nothing but a hole from here to the end
+            break;
+         return has_data;
       }
+      off_t hole = lseek(fd, data, SEEK_HOLE);
+      if(hole < 0)
+         return has_data;
+      hole = std::min<off_t>(hole, size);
+      for(size_t piece = data/_db_size_multiple_requirement; piece*_db_size_multiple_requirement < (size_t)hole; ++piece)
+         found[piece] = true;
+      pos = hole;
    }
-   std::cerr << "           Syncing buffers..." << std::endl;
-   if(_file_mapped_region.flush(0, 0, false) == false)
+   has_data.swap(found);
+#endif
+   return has_data;
+}
+
+bool pinnable_mapped_file::all_zeros(const char* data, size_t sz) {
+   static const all_zeros_fn impl = select_all_zeros();
+   return impl(data, sz);
+}
+
+void pinnable_mapped_file::flush() {
+   if(!_writable)
+      return;
+   if(_checkpointer)
+      _checkpointer->flush(false);
+   else if(_file_mapped_region.flush(0, 0, false) == false)
       std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
-   std::cerr << "           Complete" << std::endl;
+}
+
+bool pinnable_mapped_file::checkpoint_due() const {
+   return _checkpointer && _checkpointer->due();
+}
+
+void pinnable_mapped_file::begin_checkpoint() {
+   if(_checkpointer)
+      _checkpointer->begin();
+}
+
+std::shared_ptr<const pinnable_mapped_file::view> pinnable_mapped_file::publish_view() {
+   if(!_write_tracker)
+      return nullptr;
+   return _write_tracker->add_view();
+}
+
+void pinnable_mapped_file::grow(uint64_t new_size) {
+   if(!_writable)
+      BOOST_THROW_EXCEPTION(std::logic_error("cannot grow read only database \"" + _database_name + "\""));
+   if(new_size <= _size)
+      return;
+   finish_loading(true);
+   if(new_size % _db_size_multiple_requirement || new_size % _region_page_size)
+      BOOST_THROW_EXCEPTION(std::runtime_error("Database must be mulitple of " + std::to_string(std::max<size_t>(_db_size_multiple_requirement, _region_page_size)) + " bytes"));
+   if(new_size > _capacity)
+      BOOST_THROW_EXCEPTION(std::runtime_error("Database \"" + _database_name + "\" cannot grow beyond its maximum size of " + std::to_string(_capacity) + " bytes"));
+
+   // Everything that can fail comes first and leaves the database as it was; the memory added to the backing
+   // files is simply not used yet.
+   char* const base = (char*)_segment_manager - header_size;
+   if(_memory_fd >= 0) {
+      struct stat st;
+      // a hugepage file already spans the whole mapping
+      if(fstat(_memory_fd, &st) || ((uint64_t)st.st_size < new_size && ftruncate(_memory_fd, new_size)))
+         BOOST_THROW_EXCEPTION(std::runtime_error("Failed to grow memory of database \"" + _database_name + "\": " + std::string(strerror(errno))));
+   }
+#ifndef _WIN32
+   if(_mode == locked && mlock(base + _size, new_size - _size))
+      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to mlock grown part of database \"" + _database_name + "\""));
+#endif
+   bfs::resize_file(_data_file_path, new_size);
+
+   if(_checkpointer)
+      _checkpointer->extend(new_size);
+   if(_write_tracker)
+      _write_tracker->extend(new_size);
+   _segment_manager->grow(new_size - _size);
+   _size = new_size;
+}
+
+void pinnable_mapped_file::grow_if_needed() {
+   if(!_grow_threshold || _segment_manager->get_free_memory() >= _grow_threshold)
+      return;
+   const uint64_t alignment = std::max<uint64_t>(_db_size_multiple_requirement, _region_page_size);
+   const uint64_t increment = (_grow_increment ? _grow_increment : _size) + alignment - 1;
+   const uint64_t new_size = std::min(_capacity, _size + increment / alignment * alignment);
+   try {
+      grow(new_size);
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" grew to " << _size/1024/1024 << "MB" << std::endl;
+   }
+   catch(const std::exception& e) {
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" could not grow: " << e.what() << std::endl;
+      _grow_threshold = 0;
+      return;
+   }
+   if(_size == _capacity) {
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" has reached its maximum size" << std::endl;
+      _grow_threshold = 0;
+   }
 }
 
 pinnable_mapped_file::pinnable_mapped_file(pinnable_mapped_file&& o) :
    _mapped_file_lock(std::move(o._mapped_file_lock)),
    _data_file_path(std::move(o._data_file_path)),
    _database_name(std::move(o._database_name)),
+   _file_mapping(std::move(o._file_mapping)),
    _file_mapped_region(std::move(o._file_mapped_region)),
-   _mapped_region(std::move(o._mapped_region))
+   _mapped_region(std::move(o._mapped_region)),
+   _write_tracker(std::move(o._write_tracker)),
+   _checkpointer(std::move(o._checkpointer)),
+   _warm_up(std::move(o._warm_up)),
+   _loader(std::move(o._loader))
 {
+   _db_permissions = o._db_permissions;
    _segment_manager = o._segment_manager;
+   _mode = o._mode;
+   _region_page_size = o._region_page_size;
+   _huge_page_alignment = o._huge_page_alignment;
+   _size = o._size;
+   _capacity = o._capacity;
+   _grow_threshold = o._grow_threshold;
+   _grow_increment = o._grow_increment;
+   _memory_fd = o._memory_fd;
+   o._memory_fd = -1;
+   _record_working_set = o._record_working_set;
+   _background_load = o._background_load;
+   _shared_name = std::move(o._shared_name);
+   std::swap(_shared_object, o._shared_object);
+   _shared_object_is_shm = o._shared_object_is_shm;
    _writable = o._writable;
    o._writable = false; //prevent dtor from doing anything interesting
 }
 
+// Closing first runs everything the destructor does for the database this one held: its checkpointer and
+// write tracker go in the right order, its file is left clean and its registrations are dropped.
 pinnable_mapped_file& pinnable_mapped_file::operator=(pinnable_mapped_file&& o) {
-   _mapped_file_lock = std::move(o._mapped_file_lock);
-   _data_file_path = std::move(o._data_file_path);
-   _database_name = std::move(o._database_name);
-   _file_mapped_region = std::move(o._file_mapped_region);
-   _mapped_region = std::move(o._mapped_region);
-   _segment_manager = o._segment_manager;
-   _writable = o._writable;
-   o._writable = false; //prevent dtor from doing anything interesting
+   if(this != &o) {
+      this->~pinnable_mapped_file();
+      new (this) pinnable_mapped_file(std::move(o));
+   }
    return *this;
 }
 
 pinnable_mapped_file::~pinnable_mapped_file() {
+   _warm_up.reset();
+   // a database that has not switched over to memory yet closes like one in mapped mode
+   _loader.reset();
    if(_writable) {
-      if(_mapped_region.get_address()) { //in heap or locked mode
-         _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write);
-         save_database_file();
+      if(_record_working_set && !working_set::record((const char*)_file_mapped_region.get_address(), _size, working_set_path()))
+         std::cerr << "CHAINBASE: Could not record which parts of \"" << _database_name << "\" database are in memory" << std::endl;
+      if(_checkpointer) { //in heap or locked mode, or mapped mode with a journal
+         _checkpointer->flush(true);
+         _checkpointer.reset();
+         _write_tracker.reset();
       }
-      else
+      else {
          if(_file_mapped_region.flush(0, 0, false) == false)
             std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
-      set_mapped_file_db_dirty(false);
+         set_mapped_file_db_dirty(false);
+      }
+      std::lock_guard<std::mutex> g(open_writers_mutex);
+      open_writers.erase(open_writers.find(_data_file_path));
    }
+   if(_memory_fd >= 0)
+      close(_memory_fd);
+#ifndef _WIN32
+   // readers that attached keep their mapping; new ones can no longer find it
+   if(_shared_object.size()) {
+      if(_shared_object_is_shm)
+         shm_unlink(_shared_object.c_str());
+      else
+         unlink(_shared_object.c_str());
+   }
+#endif
 }
 
 void pinnable_mapped_file::set_mapped_file_db_dirty(bool dirty) {
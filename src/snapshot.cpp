@@ -0,0 +1,360 @@
+#include <chainbase/pinnable_mapped_file.hpp>
+#include <chainbase/environment.hpp>
+
+#include <boost/crc.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#ifdef CHAINBASE_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CHAINBASE_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace chainbase {
+
+/*
+ * A snapshot is the database file image with its all-zero 1MB pieces left out and every remaining piece
+ * compressed on its own, so pieces can be compressed and decompressed in parallel:
+ *
+ *    snapshot_header
+ *    block_header + payload      (once per stored piece, in increasing offset order)
+ *    snapshot_trailer
+ *
+ * Every block carries the CRC-32 of its uncompressed contents. The header and trailer carry their own.
+ */
+namespace {
+
+constexpr uint64_t snapshot_magic         = 0x31504e5342444843ULL; //"CHDBSNP1" little endian
+constexpr uint64_t snapshot_trailer_magic = 0x444e455042444843ULL; //"CHDBPEND" little endian
+constexpr uint32_t snapshot_version       = 1;
+
+enum snapshot_codec : uint32_t {
+   codec_none = 0,
+   codec_zlib = 1,
+   codec_zstd = 2
+};
+
+struct snapshot_header {
+   uint64_t    magic = snapshot_magic;
+   uint32_t    version = snapshot_version;
+   uint32_t    codec = codec_none;
+   uint64_t    image_size = 0;
+   uint64_t    block_size = 0;
+   environment dbenviron;
+   uint32_t    crc = 0;
+} __attribute__ ((packed));
+
+struct block_header {
+   uint64_t offset = 0;
+   uint32_t raw_size = 0;
+   uint32_t stored_size = 0;
+   uint32_t codec = codec_none;
+   uint32_t crc = 0;
+} __attribute__ ((packed));
+
+struct snapshot_trailer {
+   uint64_t magic = snapshot_trailer_magic;
+   uint64_t block_count = 0;
+   uint32_t crc = 0;   ///< CRC-32 over the CRCs of all blocks, in order
+} __attribute__ ((packed));
+
+template<typename T>
+uint32_t crc_of(const T& t, size_t len = offsetof(T, crc)) {
+   boost::crc_32_type crc;
+   crc.process_bytes(&t, len);
+   return crc.checksum();
+}
+
+uint32_t crc_of_bytes(const char* data, size_t len) {
+   boost::crc_32_type crc;
+   crc.process_bytes(data, len);
+   return crc.checksum();
+}
+
+snapshot_codec preferred_codec() {
+#if defined(CHAINBASE_WITH_ZSTD)
+   return codec_zstd;
+#elif defined(CHAINBASE_WITH_ZLIB)
+   return codec_zlib;
+#else
+   return codec_none;
+#endif
+}
+
+/// compresses into out, falling back to storing the block as is when that is not smaller
+snapshot_codec compress_block(snapshot_codec codec, const char* in, size_t len, std::vector<char>& out) {
+   switch(codec) {
+#ifdef CHAINBASE_WITH_ZSTD
+      case codec_zstd: {
+         out.resize(ZSTD_compressBound(len));
+         size_t r = ZSTD_compress(out.data(), out.size(), in, len, 1);
+         if(!ZSTD_isError(r) && r < len) {
+            out.resize(r);
+            return codec_zstd;
+         }
+         break;
+      }
+#endif
+#ifdef CHAINBASE_WITH_ZLIB
+      case codec_zlib: {
+         uLongf dest_len = compressBound(len);
+         out.resize(dest_len);
+         if(compress2((Bytef*)out.data(), &dest_len, (const Bytef*)in, len, Z_BEST_SPEED) == Z_OK && dest_len < len) {
+            out.resize(dest_len);
+            return codec_zlib;
+         }
+         break;
+      }
+#endif
+      default:
+         break;
+   }
+   out.assign(in, in+len);
+   return codec_none;
+}
+
+bool decompress_block(uint32_t codec, const char* in, size_t stored, char* out, size_t raw) {
+   switch(codec) {
+      case codec_none:
+         if(stored != raw)
+            return false;
+         memcpy(out, in, raw);
+         return true;
+#ifdef CHAINBASE_WITH_ZSTD
+      case codec_zstd:
+         return ZSTD_decompress(out, raw, in, stored) == raw;
+#endif
+#ifdef CHAINBASE_WITH_ZLIB
+      case codec_zlib: {
+         uLongf dest_len = raw;
+         return uncompress((Bytef*)out, &dest_len, (const Bytef*)in, stored) == Z_OK && dest_len == raw;
+      }
+#endif
+      default:
+         return false;
+   }
+}
+
+/// runs f(i) for every i in [0, n) spread over num_threads threads
+template<typename F>
+void parallel_for(size_t n, unsigned num_threads, F&& f) {
+   std::atomic<size_t> next{0};
+   auto work = [&]() {
+      size_t i;
+      while((i = next++) < n)
+         f(i);
+   };
+   std::vector<std::thread> threads;
+   for(unsigned t = 1; t < std::min<size_t>(num_threads, n); ++t)
+      threads.emplace_back(work);
+   work();
+   for(std::thread& t : threads)
+      t.join();
+}
+
+/// deletes a partially written file unless it was completed
+struct remove_unless_completed {
+   explicit remove_unless_completed(const bfs::path& p) : path(p) {}
+   ~remove_unless_completed() {
+      boost::system::error_code ec;
+      if(!completed)
+         bfs::remove(path, ec);
+   }
+   bfs::path path;
+   bool      completed = false;
+};
+
+unsigned resolve_threads(unsigned num_threads) {
+   return num_threads ? num_threads : std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+}
+
+void pinnable_mapped_file::write_snapshot(const bfs::path& path, unsigned num_threads) const {
+   const char* const image = (const char*)_segment_manager - header_size;
+   const size_t image_size = _segment_manager->get_size() + header_size;
+   const size_t block_size = _db_size_multiple_requirement;
+   const size_t num_blocks = image_size / block_size;
+   num_threads = resolve_threads(num_threads);
+
+   std::cerr << "CHAINBASE: Writing snapshot of \"" << _database_name << "\" to " << path << std::endl;
+   const bfs::path temp_path = path.string() + ".tmp";
+   remove_unless_completed temp_guard(temp_path);
+   std::ofstream out(temp_path.generic_string(), std::ofstream::binary | std::ofstream::trunc);
+   if(!out)
+      BOOST_THROW_EXCEPTION(std::runtime_error("Could not create snapshot file " + temp_path.string()));
+
+   snapshot_header header;
+   header.codec = preferred_codec();
+   header.image_size = image_size;
+   header.block_size = block_size;
+   header.crc = crc_of(header);
+   out.write((const char*)&header, sizeof(header));
+
+   struct pending_block {
+      bool              stored = false;
+      block_header      header;
+      std::vector<char> payload;
+   };
+   const size_t round_size = num_threads * 16;
+   std::vector<pending_block> round(round_size);
+   snapshot_trailer trailer;
+   boost::crc_32_type crc_of_crcs;
+   size_t stored_bytes = 0;
+   time_t t = time(nullptr);
+
+   for(size_t first = 0; first < num_blocks; first += round_size) {
+      const size_t count = std::min(round_size, num_blocks - first);
+      parallel_for(count, num_threads, [&](size_t i) {
+         pending_block& b = round[i];
+         const size_t offset = (first + i) * block_size;
+         const char* data = image + offset;
+         b.stored = !all_zeros(data, block_size);
+         if(!b.stored)
+            return;
+         std::vector<char> patched;
+         if(offset == 0) {
+            // the live header says dirty while the database is open; the snapshot is a clean image
+            patched.assign(data, data + block_size);
+            patched[header_dirty_bit_offset] = false;
+            data = patched.data();
+         }
+         b.header.offset = offset;
+         b.header.raw_size = block_size;
+         b.header.crc = crc_of_bytes(data, block_size);
+         b.header.codec = compress_block((snapshot_codec)header.codec, data, block_size, b.payload);
+         b.header.stored_size = b.payload.size();
+      });
+      for(size_t i = 0; i < count; ++i) {
+         const pending_block& b = round[i];
+         if(!b.stored)
+            continue;
+         out.write((const char*)&b.header, sizeof(b.header));
+         out.write(b.payload.data(), b.payload.size());
+         crc_of_crcs.process_bytes(&b.header.crc, sizeof(b.header.crc));
+         stored_bytes += b.payload.size();
+         ++trailer.block_count;
+      }
+      if(time(nullptr) != t) {
+         t = time(nullptr);
+         std::cerr << "              " << (first+count)*100/num_blocks << "% complete..." << std::endl;
+      }
+   }
+
+   trailer.crc = crc_of_crcs.checksum();
+   out.write((const char*)&trailer, sizeof(trailer));
+   out.close();
+   if(out.fail())
+      BOOST_THROW_EXCEPTION(std::runtime_error("Failed writing snapshot file " + temp_path.string()));
+   bfs::rename(temp_path, path);
+   temp_guard.completed = true;
+   std::cerr << "           Complete: " << trailer.block_count << " of " << num_blocks << " blocks stored, "
+             << stored_bytes/1024/1024 << "MB" << std::endl;
+}
+
+void pinnable_mapped_file::restore_snapshot(const bfs::path& snapshot_path, const bfs::path& dir, unsigned num_threads) {
+   const bfs::path data_file_path = bfs::absolute(dir/"shared_memory.bin");
+   if(bfs::exists(data_file_path))
+      BOOST_THROW_EXCEPTION(std::runtime_error("refusing to restore snapshot over existing database file " + data_file_path.string()));
+   num_threads = resolve_threads(num_threads);
+
+   std::ifstream in(snapshot_path.generic_string(), std::ifstream::binary);
+   if(!in)
+      BOOST_THROW_EXCEPTION(std::runtime_error("Could not open snapshot file " + snapshot_path.string()));
+   snapshot_header header;
+   in.read((char*)&header, sizeof(header));
+   if(in.fail() || header.magic != snapshot_magic || header.crc != crc_of(header))
+      BOOST_THROW_EXCEPTION(std::runtime_error(snapshot_path.string() + " is not a chainbase snapshot"));
+   if(header.version != snapshot_version)
+      BOOST_THROW_EXCEPTION(std::runtime_error("snapshot format version " + std::to_string(header.version) + " not supported"));
+   if(header.dbenviron != environment()) {
+      std::cerr << "CHAINBASE: snapshot " << snapshot_path << " was created with a chainbase from a different environment" << std::endl;
+      std::cerr << "Current compiler environment:" << std::endl;
+      std::cerr << environment();
+      std::cerr << "Snapshot created with compiler environment:" << std::endl;
+      std::cerr << header.dbenviron;
+      BOOST_THROW_EXCEPTION(std::runtime_error("All environment parameters must match"));
+   }
+   if(header.image_size % _db_size_multiple_requirement || header.block_size == 0)
+      BOOST_THROW_EXCEPTION(std::runtime_error("snapshot " + snapshot_path.string() + " has an invalid layout"));
+
+   std::cerr << "CHAINBASE: Restoring snapshot " << snapshot_path << " into " << dir << std::endl;
+   bfs::create_directories(dir);
+   // a journal left next to a removed database must not be replayed over the restored one
+   boost::system::error_code ec;
+   bfs::remove(dir/"shared_memory.journal", ec);
+   const bfs::path temp_path = data_file_path.string() + ".restore";
+   remove_unless_completed temp_guard(temp_path);
+   {
+      std::ofstream ofs(temp_path.generic_string(), std::ofstream::trunc);
+   }
+   bfs::resize_file(temp_path, header.image_size);
+   bip::file_mapping file_mapping(temp_path.generic_string().c_str(), bip::read_write);
+   bip::mapped_region region(file_mapping, bip::read_write);
+   char* const image = (char*)region.get_address();
+
+   struct pending_block {
+      block_header      header;
+      std::vector<char> payload;
+   };
+   const size_t round_size = num_threads * 16;
+   std::vector<pending_block> round(round_size);
+   boost::crc_32_type crc_of_crcs;
+   uint64_t block_count = 0;
+   std::atomic<bool> corrupt{false};
+   bool at_trailer = false;
+
+   while(!at_trailer) {
+      size_t count = 0;
+      while(count < round_size) {
+         pending_block& b = round[count];
+         // a block's leading offset can never equal the trailer's magic, which tells the two apart
+         in.read((char*)&b.header.offset, sizeof(b.header.offset));
+         if(!in.fail() && b.header.offset == snapshot_trailer_magic) {
+            at_trailer = true;
+            break;
+         }
+         in.read((char*)&b.header + sizeof(b.header.offset), sizeof(b.header) - sizeof(b.header.offset));
+         if(in.fail())
+            BOOST_THROW_EXCEPTION(std::runtime_error("snapshot " + snapshot_path.string() + " is truncated"));
+         if(b.header.raw_size > header.block_size || b.header.offset + b.header.raw_size > header.image_size ||
+            b.header.stored_size > 2*header.block_size + 4096)
+            BOOST_THROW_EXCEPTION(std::runtime_error("snapshot " + snapshot_path.string() + " is corrupt"));
+         b.payload.resize(b.header.stored_size);
+         in.read(b.payload.data(), b.payload.size());
+         crc_of_crcs.process_bytes(&b.header.crc, sizeof(b.header.crc));
+         ++count;
+      }
+
+      parallel_for(count, num_threads, [&](size_t i) {
+         const pending_block& b = round[i];
+         char* dst = image + b.header.offset;
+         if(!decompress_block(b.header.codec, b.payload.data(), b.payload.size(), dst, b.header.raw_size) ||
+            crc_of_bytes(dst, b.header.raw_size) != b.header.crc)
+            corrupt = true;
+      });
+      if(corrupt)
+         BOOST_THROW_EXCEPTION(std::runtime_error("snapshot " + snapshot_path.string() + " failed checksum verification"));
+      block_count += count;
+   }
+
+   snapshot_trailer trailer;
+   in.read((char*)&trailer + sizeof(trailer.magic), sizeof(trailer) - sizeof(trailer.magic));
+   if(in.fail() || trailer.block_count != block_count || trailer.crc != crc_of_crcs.checksum())
+      BOOST_THROW_EXCEPTION(std::runtime_error("snapshot " + snapshot_path.string() + " is incomplete"));
+
+   if(!region.flush(0, 0, false))
+      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to sync restored database file"));
+   bfs::rename(temp_path, data_file_path);
+   temp_guard.completed = true;
+   std::cerr << "           Complete: " << block_count << " blocks restored" << std::endl;
+}
+
+}
@@ -0,0 +1,105 @@
+#include <chainbase/stats.hpp>
+
+#include <ostream>
+
+namespace chainbase {
+
+const char* to_string( index_operation op ) {
+   switch( op ) {
+      case index_operation::emplace: return "emplace";
+      case index_operation::modify:  return "modify";
+      case index_operation::remove:  return "remove";
+      case index_operation::find:    return "find";
+      case index_operation::undo:    return "undo";
+      case index_operation::squash:  return "squash";
+      case index_operation::commit:  return "commit";
+   }
+   return "unknown";
+}
+
+namespace {
+
+std::string escape_label( const std::string& value ) {
+   std::string escaped;
+   escaped.reserve( value.size() );
+   for( char c : value ) {
+      if( c == '\\' || c == '"' )
+         escaped += '\\';
+      if( c == '\n' )
+         escaped += "\\n";
+      else
+         escaped += c;
+   }
+   return escaped;
+}
+
+void write_header( std::ostream& out, const std::string& name, const char* type, const char* help ) {
+   out << "# HELP " << name << ' ' << help << '\n';
+   out << "# TYPE " << name << ' ' << type << '\n';
+}
+
+/// labels is either empty or a comma separated list of label="value" pairs
+void write_histogram( std::ostream& out, const std::string& name, const std::string& labels, const latency_histogram& h ) {
+   const std::string separator = labels.empty() ? "" : ",";
+   uint64_t cumulative = 0;
+   for( size_t i = 0; i + 1 < latency_histogram::num_buckets; ++i ) {
+      cumulative += h.buckets[i];
+      out << name << "_bucket{" << labels << separator << "le=\"" << latency_histogram::upper_bound_ns( i ) / 1e9 << "\"} "
+          << cumulative << '\n';
+   }
+   out << name << "_bucket{" << labels << separator << "le=\"+Inf\"} " << h.count << '\n';
+   const std::string braced = labels.empty() ? "" : "{" + labels + "}";
+   out << name << "_sum" << braced << ' ' << h.total_ns / 1e9 << '\n';
+   out << name << "_count" << braced << ' ' << h.count << '\n';
+}
+
+}
+
+void write_prometheus( std::ostream& out, const database_stats& stats, const std::string& prefix ) {
+   const std::streamsize precision = out.precision( 9 );
+
+   write_header( out, prefix + "_revision", "gauge", "Head revision of the database" );
+   out << prefix << "_revision " << stats.revision << '\n';
+   write_header( out, prefix + "_undo_depth", "gauge", "Undo sessions that can still be undone" );
+   out << prefix << "_undo_depth " << stats.undo_depth << '\n';
+   write_header( out, prefix + "_size_bytes", "gauge", "Size of the database segment" );
+   out << prefix << "_size_bytes " << stats.size << '\n';
+   write_header( out, prefix + "_free_bytes", "gauge", "Free memory in the database segment" );
+   out << prefix << "_free_bytes " << stats.free_memory << '\n';
+
+   struct gauge { const char* suffix; const char* help; uint64_t index_stats::* member; };
+   const gauge gauges[] = {
+      { "_index_rows",                "Rows in the index",                                       &index_stats::row_count },
+      { "_index_node_bytes",          "Estimated bytes of the container nodes of the index",     &index_stats::node_bytes },
+      { "_index_pool_bytes",          "Bytes reserved by the node pool of the index",            &index_stats::pool_bytes },
+      { "_index_pool_free_nodes",     "Unused nodes in the node pool of the index",              &index_stats::pool_free_nodes },
+      { "_index_undo_sessions",       "Undo sessions the index holds state for",                 &index_stats::undo_sessions },
+      { "_index_undo_values",         "Values held by the undo log of the index",                &index_stats::undo_values },
+      { "_index_undo_retired_values", "Committed undo values of the index not yet reclaimed",    &index_stats::undo_retired },
+      { "_index_undo_bytes",          "Bytes taken by the undo log entries of the index",        &index_stats::undo_bytes },
+      { "_index_id_table_bytes",      "Bytes taken by the id table of the index",                &index_stats::id_table_bytes }
+   };
+   for( const gauge& g : gauges ) {
+      write_header( out, prefix + g.suffix, "gauge", g.help );
+      for( const index_stats& index : stats.indices )
+         out << prefix << g.suffix << "{index=\"" << escape_label( index.type_name ) << "\"} " << index.*g.member << '\n';
+   }
+
+   if( stats.operations_collected ) {
+      write_header( out, prefix + "_undo_session_start_seconds", "histogram", "Time taken to start an undo session" );
+      write_histogram( out, prefix + "_undo_session_start_seconds", "", stats.start_undo_session );
+
+      const std::string name = prefix + "_index_operation_seconds";
+      write_header( out, name, "histogram", "Time taken by operations on an index" );
+      for( const index_stats& index : stats.indices ) {
+         for( size_t op = 0; op < num_index_operations; ++op ) {
+            const std::string labels = "index=\"" + escape_label( index.type_name ) + "\",operation=\"" + to_string( index_operation( op ) ) + "\"";
+            write_histogram( out, name, labels, index.operations[op] );
+         }
+      }
+   }
+
+   out.precision( precision );
+}
+
+}
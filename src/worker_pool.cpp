@@ -0,0 +1,73 @@
+#include "worker_pool.hpp"
+
+namespace chainbase {
+
+worker_pool::worker_pool(unsigned threads) {
+   for(unsigned i = 0; i < threads; ++i)
+      _threads.emplace_back([this]() { work(); });
+}
+
+worker_pool::~worker_pool() {
+   {
+      std::lock_guard<std::mutex> g(_mutex);
+      _stop = true;
+   }
+   _wake.notify_all();
+   for(std::thread& t : _threads)
+      t.join();
+}
+
+void worker_pool::run(size_t count, const std::function<void(size_t)>& task) {
+   if(count == 0)
+      return;
+   auto j = std::make_shared<job>(count, task);
+   if(count > 1) {
+      {
+         std::lock_guard<std::mutex> g(_mutex);
+         _job = j;
+      }
+      _wake.notify_all();
+   }
+   drain(*j);
+   {
+      std::unique_lock<std::mutex> g(_mutex);
+      _done.wait(g, [&]() { return j->finished == j->count; });
+      _job.reset();
+   }
+   for(const std::exception_ptr& e : j->errors)
+      if(e)
+         std::rethrow_exception(e);
+}
+
+void worker_pool::work() {
+   std::shared_ptr<job> last;
+   for(;;) {
+      std::shared_ptr<job> j;
+      {
+         std::unique_lock<std::mutex> g(_mutex);
+         _wake.wait(g, [&]() { return _stop || (_job && _job != last); });
+         if(_stop)
+            return;
+         j = last = _job;
+      }
+      drain(*j);
+   }
+}
+
+void worker_pool::drain(job& j) {
+   size_t i;
+   while((i = j.next++) < j.count) {
+      try {
+         j.task(i);
+      }
+      catch(...) {
+         j.errors[i] = std::current_exception();
+      }
+      if(++j.finished == j.count) {
+         std::lock_guard<std::mutex> g(_mutex);
+         _done.notify_all();
+      }
+   }
+}
+
+}
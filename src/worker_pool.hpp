@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace chainbase {
+
+/**
+ * A fixed set of threads that run the items of one job at a time alongside the thread submitting it. Items
+ * are claimed in order from a shared counter, so a job of n items never occupies more than n threads, and
+ * the threads sleep between jobs instead of being started for each one.
+ */
+class worker_pool {
+   public:
+      /// starts threads workers in addition to the thread that will call run()
+      explicit worker_pool(unsigned threads);
+      ~worker_pool();
+
+      worker_pool(const worker_pool&) = delete;
+      worker_pool& operator=(const worker_pool&) = delete;
+
+      /**
+       * Calls task(i) for every i below count, spread over the workers and the calling thread, and returns
+       * once all calls have. If any of them threw, rethrows the exception of the lowest such i.
+       */
+      void run(size_t count, const std::function<void(size_t)>& task);
+
+   private:
+      struct job {
+         job(size_t c, const std::function<void(size_t)>& t) : count(c), task(t), errors(c) {}
+
+         const size_t                          count;
+         const std::function<void(size_t)>&    task;
+         std::atomic<size_t>                   next{0};
+         std::atomic<size_t>                   finished{0};
+         std::vector<std::exception_ptr>       errors;
+      };
+
+      void work();
+      void drain(job& j);
+
+      std::vector<std::thread>   _threads;
+      std::mutex                 _mutex;
+      std::condition_variable    _wake;
+      std::condition_variable    _done;
+      std::shared_ptr<job>       _job;
+      bool                       _stop = false;
+};
+
+}
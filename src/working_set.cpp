@@ -0,0 +1,138 @@
+#include "working_set.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace chainbase {
+
+namespace {
+   struct file_header {
+      uint64_t magic = 0x5445535f4b524f57ULL; // "WORK_SET"
+      uint64_t granule_size = working_set::granule_size;
+      uint64_t size = 0;                       ///< bytes of the database the set covers
+   };
+
+   constexpr size_t mincore_slice = size_t(1) << 30; // bounds the residency vector to a quarter million pages
+}
+
+constexpr size_t working_set::granule_size;
+constexpr size_t working_set::_max_range;
+
+bool working_set::record(const char* base, size_t size, const bfs::path& path) {
+#ifndef _WIN32
+   const size_t page_size = sysconf(_SC_PAGESIZE);
+   const size_t granules = (size + granule_size - 1) / granule_size;
+   std::vector<uint8_t> bits((granules + 7) / 8);
+   std::vector<unsigned char> resident;
+   for(size_t offset = 0; offset < size; offset += mincore_slice) {
+      const size_t length = std::min(mincore_slice, size - offset);
+      resident.resize((length + page_size - 1) / page_size);
+      if(mincore(const_cast<char*>(base + offset), length, resident.data()))
+         return false;
+      for(size_t p = 0; p < resident.size(); ++p) {
+         if(resident[p] & 1) {
+            const size_t g = (offset + p * page_size) / granule_size;
+            bits[g / 8] |= uint8_t(1) << (g % 8);
+         }
+      }
+   }
+
+   file_header header;
+   header.size = size;
+   const bfs::path temp = path.string() + ".tmp";
+   {
+      std::ofstream out(temp.string(), std::ofstream::binary | std::ofstream::trunc);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(bits.data()), bits.size());
+      if(!out.good())
+         return false;
+   }
+   boost::system::error_code ec;
+   bfs::rename(temp, path, ec);
+   return !ec;
+#else
+   return false;
+#endif
+}
+
+std::unique_ptr<working_set> working_set::warm_up(char* base, size_t size, const bfs::path& path, unsigned num_threads,
+                                                  const std::string& database_name) {
+#ifndef _WIN32
+   std::ifstream in(path.string(), std::ifstream::binary);
+   file_header header, expected;
+   if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != expected.magic ||
+      header.granule_size != expected.granule_size)
+      return nullptr;
+   // the database may have grown or been replaced since; only what is still there is read
+   const size_t limit = std::min<uint64_t>(header.size, size);
+   std::vector<uint8_t> bits(((limit + granule_size - 1) / granule_size + 7) / 8);
+   in.read(reinterpret_cast<char*>(bits.data()), bits.size());
+   bits.resize(in.gcount());
+
+   std::vector<std::pair<size_t, size_t>> ranges;
+   size_t total = 0;
+   for(size_t g = 0; g < bits.size() * 8; ++g) {
+      if(!(bits[g / 8] & (uint8_t(1) << (g % 8))))
+         continue;
+      const size_t offset = g * granule_size;
+      if(offset >= limit)
+         break;
+      const size_t length = std::min(granule_size, limit - offset);
+      if(ranges.size() && ranges.back().first + ranges.back().second == offset && ranges.back().second < _max_range)
+         ranges.back().second += length;
+      else
+         ranges.emplace_back(offset, length);
+      total += length;
+   }
+   if(ranges.empty())
+      return nullptr;
+
+   if(num_threads == 0)
+      num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+   num_threads = std::min<size_t>(num_threads, ranges.size());
+   std::cerr << "CHAINBASE: Warming up " << total/1024/1024 << "MB of \"" << database_name << "\" database in the background" << std::endl;
+   return std::unique_ptr<working_set>(new working_set(base, std::move(ranges), num_threads, database_name));
+#else
+   return nullptr;
+#endif
+}
+
+working_set::working_set(char* base, std::vector<std::pair<size_t, size_t>> ranges, unsigned num_threads,
+                         const std::string& database_name) :
+   _base(base),
+   _ranges(std::move(ranges)),
+   _database_name(database_name),
+   _running(num_threads),
+   _start(std::chrono::steady_clock::now())
+{
+   for(unsigned i = 0; i < num_threads; ++i)
+      _threads.emplace_back([this]() { run(); });
+}
+
+working_set::~working_set() {
+   _stop = true;
+   for(std::thread& t : _threads)
+      t.join();
+}
+
+// Threads claim ranges in file order, so the reads the kernel sees stay close to sequential
+void working_set::run() {
+#ifndef _WIN32
+   size_t r;
+   while(!_stop && (r = _next++) < _ranges.size())
+      madvise(_base + _ranges[r].first, _ranges[r].second, MADV_WILLNEED);
+#endif
+   if(--_running == 0 && !_stop) {
+      const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _start);
+      std::cerr << "CHAINBASE: Warm up of \"" << _database_name << "\" database requested in " << elapsed.count() << "ms" << std::endl;
+   }
+}
+
+}
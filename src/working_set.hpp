@@ -0,0 +1,60 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace chainbase {
+
+namespace bfs = boost::filesystem;
+
+/**
+ * The parts of a mapped database file that were in memory when it was last closed, kept in a small file next to
+ * it. Reading those parts back right after the next open, in the background and in file order, replaces the
+ * random major faults the first operations would otherwise take one at a time with a few large sequential reads.
+ */
+class working_set {
+   public:
+      /// granularity of the recorded set; a granule is recorded if any of its pages is resident
+      constexpr static size_t granule_size = 64*1024;
+
+      /// records which granules of the size bytes at base are resident to path; returns false if that failed
+      static bool record(const char* base, size_t size, const bfs::path& path);
+
+      /**
+       * Starts reading in what path recorded, on num_threads threads (0 uses one per core), and returns the
+       * handle that stops it again. Returns nullptr if path holds nothing usable.
+       */
+      static std::unique_ptr<working_set> warm_up(char* base, size_t size, const bfs::path& path, unsigned num_threads,
+                                                  const std::string& database_name);
+
+      /// stops reading in and waits for the threads
+      ~working_set();
+
+      working_set(const working_set&) = delete;
+      working_set& operator=(const working_set&) = delete;
+
+   private:
+      working_set(char* base, std::vector<std::pair<size_t, size_t>> ranges, unsigned num_threads, const std::string& database_name);
+      void run();
+
+      char* const                                    _base;
+      const std::vector<std::pair<size_t, size_t>>   _ranges;  ///< (offset, length), in file order
+      const std::string                              _database_name;
+      std::atomic<size_t>                            _next{0};
+      std::atomic<unsigned>                          _running{0};
+      std::atomic<bool>                              _stop{false};
+      const std::chrono::steady_clock::time_point    _start;
+      std::vector<std::thread>                       _threads;
+
+      constexpr static size_t                        _max_range = 16*1024*1024;
+};
+
+}
@@ -0,0 +1,479 @@
+#include "write_tracker.hpp"
+
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+#include <errno.h>
+
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace chainbase {
+
+/**
+ * Process wide table of armed trackers consulted by the fault handler. The handler may run on any thread
+ * at any time, so it only ever reads the slots; registration and removal happen under a mutex.
+ */
+struct write_tracker_registry {
+   constexpr static unsigned max_trackers = 64;
+
+   static write_tracker_registry& instance() {
+      static write_tracker_registry r;
+      return r;
+   }
+
+   bool add(write_tracker* t) {
+      std::lock_guard<std::mutex> g(mutex);
+      install_handler();
+      for(std::atomic<write_tracker*>& slot : slots) {
+         if(slot.load() == nullptr) {
+            slot.store(t);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   void reinstall_handler() {
+      std::lock_guard<std::mutex> g(mutex);
+      install_handler();
+   }
+
+   void remove(write_tracker* t) {
+      std::lock_guard<std::mutex> g(mutex);
+      for(std::atomic<write_tracker*>& slot : slots)
+         if(slot.load() == t)
+            slot.store(nullptr);
+   }
+
+   static void handler(int sig, siginfo_t* info, void* ctx) {
+      char* addr = (char*)info->si_addr;
+      if(info->si_code > 0) {
+         for(std::atomic<write_tracker*>& slot : instance().slots) {
+            write_tracker* t = slot.load(std::memory_order_acquire);
+            if(t && t->contains(addr)) {
+               t->on_write_fault(addr);
+               return;
+            }
+         }
+      }
+      chain(sig, info, ctx);
+   }
+
+   static void chain(int sig, siginfo_t* info, void* ctx) {
+      // a handler installed after ours may itself chain back here; don't bounce between the two forever
+      static __thread int chain_depth __attribute__((tls_model("initial-exec")));
+      const struct sigaction& prev = sig == SIGSEGV ? instance().prev_segv : instance().prev_bus;
+      if(chain_depth == 0 && (prev.sa_flags & SA_SIGINFO)) {
+         ++chain_depth;
+         prev.sa_sigaction(sig, info, ctx);
+         --chain_depth;
+         return;
+      }
+      if(chain_depth == 0 && prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+         ++chain_depth;
+         prev.sa_handler(sig);
+         --chain_depth;
+         return;
+      }
+      // restore the default disposition; a genuine fault re-executes and takes it, a sent signal is re-raised
+      signal(sig, SIG_DFL);
+      if(info->si_code <= 0)
+         raise(sig);
+   }
+
+   // Also re-run whenever tracking is (re)armed: code that saves and later restores signal dispositions
+   // (test harnesses, crash reporters) may have dropped the handler since it was first installed.
+   void install_handler() {
+      struct sigaction current = {};
+      if(sigaction(SIGSEGV, nullptr, &current) == 0 && (current.sa_flags & SA_SIGINFO) &&
+         current.sa_sigaction == &write_tracker_registry::handler)
+         return;
+      struct sigaction sa = {};
+      sa.sa_sigaction = &write_tracker_registry::handler;
+      sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      if(sigaction(SIGSEGV, &sa, &prev_segv))
+         BOOST_THROW_EXCEPTION(std::runtime_error("Failed to install write tracking signal handler"));
+#ifdef __APPLE__
+      if(sigaction(SIGBUS, &sa, &prev_bus))
+         BOOST_THROW_EXCEPTION(std::runtime_error("Failed to install write tracking signal handler"));
+#endif
+   }
+
+   std::atomic<write_tracker*> slots[max_trackers] = {};
+   std::mutex                  mutex;
+   struct sigaction            prev_segv = {};
+   struct sigaction            prev_bus = {};
+};
+
+namespace {
+   /// stands in for a preserved buffer once the fault handler has written the chunk to the fallback target
+   char* const preserved_in_place = reinterpret_cast<char*>(1);
+
+   bool pwrite_all(int fd, const char* data, size_t length, off_t offset) {
+      while(length) {
+         ssize_t r = pwrite(fd, data, length, offset);
+         if(r < 0 && errno == EINTR)
+            continue;
+         if(r <= 0)
+            return false;
+         data += r;
+         length -= r;
+         offset += r;
+      }
+      return true;
+   }
+}
+
+/**
+ * The views of one tracker. A view's slot is taken by add_view() on the writing thread and handed back by
+ * the view's destructor on whichever thread drops it last, while the fault handler walks the slots. The
+ * handler cannot wait on another thread, so nothing here is locked: the handler counts itself in as a user
+ * of a slot before looking at it, and a view being released waits for the users to leave before unmapping.
+ */
+struct write_tracker::view_table {
+   enum slot_state : uint8_t {
+      empty,       ///< no view
+      claimed,     ///< add_view() is filling it in
+      live,        ///< the fault handler copies chunks into the view
+      releasing    ///< the view is going away; the handler leaves it alone
+   };
+
+   struct slot {
+      std::atomic<uint8_t>   state{empty};
+      std::atomic<unsigned>  users{0};       ///< fault handlers looking at the slot
+      char*                  base = nullptr;
+      size_t                 size = 0;       ///< bytes of the region the view covers
+      int                    fd = -1;        ///< memfd holding the view's private copies, at their region offsets
+      std::vector<char>      diverged;       ///< per chunk, whether the view already has its own copy
+      std::atomic<bool>      lost{false};
+   };
+
+   slot slots[_max_views];
+};
+
+class write_tracker::tracked_view : public pinnable_mapped_file::view {
+   public:
+      tracked_view(std::shared_ptr<view_table> table, unsigned slot, char* base, const char* live_base, size_t size) :
+         view(base, live_base), _table(std::move(table)), _slot(slot), _base(base), _size(size) {}
+
+      ~tracked_view() {
+         view_table::slot& s = _table->slots[_slot];
+         // the handler checks the state after counting itself in, so once users drops to 0 none is left in here
+         s.state.store(view_table::releasing);
+         while(s.users.load())
+            sched_yield();
+         munmap(_base, _size);
+         close(s.fd);
+         s.base = nullptr;
+         s.size = 0;
+         s.fd = -1;
+         s.state.store(view_table::empty, std::memory_order_release);
+      }
+
+      bool consistent() const override {
+         return !_table->slots[_slot].lost.load(std::memory_order_acquire);
+      }
+
+   private:
+      const std::shared_ptr<view_table> _table;
+      const unsigned                    _slot;
+      char* const                       _base;
+      const size_t                      _size;
+};
+
+write_tracker::write_tracker(char* base, size_t size, size_t capacity, size_t chunk_size) :
+   _base(base),
+   _size(size),
+   _chunk_size(chunk_size),
+   _max_num_chunks((std::max(size, capacity) + chunk_size - 1) / chunk_size),
+   _state(new std::atomic<uint8_t>[_max_num_chunks]),
+   _preserved(new std::atomic<char*>[_max_num_chunks]),
+   _view_protected(new std::atomic<uint8_t>[_max_num_chunks]),
+   _views(std::make_shared<view_table>())
+{
+   for(size_t i = 0; i < _max_num_chunks; ++i) {
+      _state[i] = dirty;
+      _preserved[i] = nullptr;
+      _view_protected[i] = unprotected;
+   }
+}
+
+write_tracker::~write_tracker() {
+   if(_registered) {
+      write_tracker_registry::instance().remove(this);
+      mprotect(_base, size(), PROT_READ | PROT_WRITE);
+   }
+   // views outliving the tracker keep their mappings, but nothing keeps later writes out of them anymore
+   for(view_table::slot& s : _views->slots)
+      s.lost = true;
+}
+
+bool write_tracker::attach() {
+   if(_registered)
+      return true;
+   if(!write_tracker_registry::instance().add(this)) {
+      _overflowed = true;
+      return false;
+   }
+   _registered = true;
+   return true;
+}
+
+bool write_tracker::arm() {
+   if(_registered)
+      write_tracker_registry::instance().reinstall_handler();
+   else if(!attach())
+      return false;
+   for(size_t i = 0; i < num_chunks(); ++i)
+      _state[i] = clean;
+   if(mprotect(_base, size(), PROT_READ)) {
+      give_up();
+      return false;
+   }
+   _overflowed = false;
+   _armed = true;
+   return true;
+}
+
+void write_tracker::extend(size_t new_size) {
+   const size_t old_size = size();
+   if(new_size <= old_size)
+      return;
+   if(new_size > _max_num_chunks * _chunk_size)
+      BOOST_THROW_EXCEPTION(std::logic_error("write tracker extended beyond its capacity"));
+   // A chunk only partly inside the old size keeps its state; if it was writable, the first write to its new
+   // part faults once more and finds it dirty. Chunks entirely beyond the old size match the zeros underneath.
+   for(size_t i = (old_size + _chunk_size - 1) / _chunk_size; i * _chunk_size < new_size; ++i) {
+      _state[i] = _armed ? clean : dirty;
+      _preserved[i] = nullptr;
+      _view_protected[i] = unprotected;
+   }
+   if(_armed && !_overflowed && mprotect(_base + old_size, new_size - old_size, PROT_READ))
+      give_up();
+   _size.store(new_size, std::memory_order_release);
+}
+
+bool write_tracker::give_up() {
+   _overflowed = true;
+   for(view_table::slot& s : _views->slots)
+      s.lost.store(true, std::memory_order_release);
+   return mprotect(_base, size(), PROT_READ | PROT_WRITE) == 0;
+}
+
+size_t write_tracker::chunk_length(size_t chunk) const {
+   return std::min(_chunk_size, size() - chunk_offset(chunk));
+}
+
+size_t write_tracker::dirty_count() const {
+   size_t count = 0;
+   for(size_t i = 0; i < num_chunks(); ++i)
+      count += is_dirty(i);
+   return count;
+}
+
+size_t write_tracker::choose_chunk_size(size_t region_size, size_t min_chunk_size, size_t page_size) {
+   size_t chunk_size = std::max(min_chunk_size, page_size);
+   if(chunk_size % min_chunk_size || chunk_size % page_size)
+      chunk_size = min_chunk_size * page_size;
+   while(region_size / chunk_size > _max_chunks)
+      chunk_size *= 2;
+   return chunk_size;
+}
+
+std::vector<size_t> write_tracker::begin_snapshot(char* fallback_target) {
+   std::vector<size_t> chunks;
+   write_tracker_registry::instance().reinstall_handler();
+   _fallback_target = fallback_target;
+   const size_t num_chunks = this->num_chunks();
+   for(size_t i = 0; i < num_chunks; ++i) {
+      if(_overflowed || _state[i] != dirty)
+         continue;
+      if(mprotect(_base + chunk_offset(i), chunk_length(i), PROT_READ))
+         give_up();
+      else
+         _state[i] = pending;
+      chunks.push_back(i);
+   }
+   if(_overflowed) {
+      // protections are unreliable from here on; report every chunk and let the caller copy synchronously
+      chunks.resize(num_chunks);
+      for(size_t i = 0; i < num_chunks; ++i) {
+         chunks[i] = i;
+         _state[i] = dirty;
+      }
+   }
+   return chunks;
+}
+
+bool write_tracker::claim(size_t chunk) {
+   uint8_t expected = pending;
+   return _state[chunk].compare_exchange_strong(expected, copying);
+}
+
+void write_tracker::release(size_t chunk) {
+   _state[chunk].store(clean, std::memory_order_release);
+}
+
+char* write_tracker::take_preserved(size_t chunk) {
+   char* buffer;
+   while((buffer = _preserved[chunk].load(std::memory_order_acquire)) == nullptr)
+      sched_yield();
+   _preserved[chunk] = nullptr;
+   return buffer == preserved_in_place ? nullptr : buffer;
+}
+
+void write_tracker::free_preserved(size_t chunk, char* buffer) {
+   if(buffer)
+      munmap(buffer, chunk_length(chunk));
+}
+
+std::shared_ptr<pinnable_mapped_file::view> write_tracker::add_view() {
+#ifdef __linux__
+   if(!_registered || _overflowed)
+      return nullptr;
+   write_tracker_registry::instance().reinstall_handler();
+
+   const size_t size = this->size();
+   const size_t num_chunks = this->num_chunks();
+   const int fd = memfd_create("chainbase-view", MFD_CLOEXEC);
+   if(fd < 0)
+      return nullptr;
+   // with an old size of 0 mremap() maps the same pages a second time instead of moving them
+   void* mapping = ftruncate(fd, size) ? MAP_FAILED : mremap(_base, 0, size, MREMAP_MAYMOVE);
+   if(mapping == MAP_FAILED || mprotect(mapping, size, PROT_READ)) {
+      if(mapping != MAP_FAILED)
+         munmap(mapping, size);
+      close(fd);
+      return nullptr;
+   }
+   char* const base = (char*)mapping;
+
+   unsigned slot = _max_views;
+   for(unsigned i = 0; i < _max_views && slot == _max_views; ++i) {
+      view_table::slot& s = _views->slots[i];
+      uint8_t expected = view_table::empty;
+      if(!s.state.compare_exchange_strong(expected, view_table::claimed, std::memory_order_acquire))
+         continue;
+      s.base = base;
+      s.size = size;
+      s.fd = fd;
+      s.diverged.assign(_max_num_chunks, false);
+      s.lost = false;
+      s.state.store(view_table::live, std::memory_order_release);
+      slot = i;
+   }
+   if(slot == _max_views) {
+      munmap(base, size);
+      close(fd);
+      return nullptr;
+   }
+   auto view = std::make_shared<tracked_view>(_views, slot, base, _base, size);
+
+   for(size_t i = 0; i < num_chunks; ++i)
+      _view_protected[i].store(for_views, std::memory_order_relaxed);
+   if(mprotect(_base, size, PROT_READ)) {
+      give_up();
+      for(size_t i = 0; i < num_chunks; ++i)
+         _state[i] = dirty;
+   }
+   return view;
+#else
+   return nullptr;
+#endif
+}
+
+// Runs in signal context. A thread faulting on a chunk another one is preserving waits for it to finish,
+// since its write must not reach the chunk before the views have their copy.
+void write_tracker::preserve_for_views(size_t chunk) {
+#ifdef __linux__
+   uint8_t expected = for_views;
+   if(!_view_protected[chunk].compare_exchange_strong(expected, preserving, std::memory_order_acquire)) {
+      while(_view_protected[chunk].load(std::memory_order_acquire) != unprotected)
+         sched_yield();
+      return;
+   }
+   const size_t offset = chunk_offset(chunk);
+   const size_t len = chunk_length(chunk);
+   for(view_table::slot& s : _views->slots) {
+      s.users.fetch_add(1);
+      // views published before the region grew end short of, or within, the chunk
+      if(s.state.load() == view_table::live && !s.diverged[chunk] && offset < s.size) {
+         const size_t view_len = std::min(len, s.size - offset);
+         // mapping the memfd at the chunk's own offset lets neighbouring copies merge into a single mapping
+         if(pwrite_all(s.fd, _base + offset, view_len, offset) &&
+            mmap(s.base + offset, view_len, PROT_READ, MAP_SHARED | MAP_FIXED, s.fd, offset) != MAP_FAILED)
+            s.diverged[chunk] = true;
+         else
+            s.lost.store(true, std::memory_order_release);
+      }
+      s.users.fetch_sub(1, std::memory_order_release);
+   }
+   _view_protected[chunk].store(unprotected, std::memory_order_release);
+#endif
+}
+
+void write_tracker::make_writable(size_t chunk) {
+   if(mprotect(_base + chunk_offset(chunk), chunk_length(chunk), PROT_READ | PROT_WRITE) == 0)
+      return;
+
+   if(!give_up()) {
+      static const char msg[] = "CHAINBASE: unable to unprotect database memory after a write fault\n";
+      ssize_t r = write(STDERR_FILENO, msg, sizeof(msg)-1);
+      (void)r;
+      abort();
+   }
+}
+
+// Runs in signal context: only lock free atomics and plain system calls below.
+void write_tracker::on_write_fault(char* addr) {
+   const size_t chunk = (addr - _base) / _chunk_size;
+   if(!_overflowed && _view_protected[chunk].load(std::memory_order_acquire) != unprotected)
+      preserve_for_views(chunk);
+   for(;;) {
+      if(_overflowed)
+         return;
+      uint8_t state = _state[chunk].load(std::memory_order_acquire);
+      switch(state) {
+         case dirty:
+            // protected only for views, or another thread resolved the same fault concurrently
+            make_writable(chunk);
+            return;
+         case copying:
+            sched_yield();
+            continue;
+         case clean:
+            if(!_state[chunk].compare_exchange_weak(state, dirty))
+               continue;
+            make_writable(chunk);
+            return;
+         case pending: {
+            if(!_state[chunk].compare_exchange_weak(state, copying))
+               continue;
+            const char* src = _base + chunk_offset(chunk);
+            const size_t len = chunk_length(chunk);
+            void* buffer = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(buffer != MAP_FAILED) {
+               memcpy(buffer, src, len);
+               _preserved[chunk].store((char*)buffer, std::memory_order_release);
+            }
+            else {
+               memcpy(_fallback_target.load() + chunk_offset(chunk), src, len);
+               _preserved[chunk].store(preserved_in_place, std::memory_order_release);
+            }
+            _state[chunk].store(dirty, std::memory_order_release);
+            make_writable(chunk);
+            return;
+         }
+      }
+   }
+}
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chainbase/pinnable_mapped_file.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace chainbase {
+
+/**
+ * Records which chunks of a memory region have been written to, without any cooperation from the code
+ * doing the writing. Clean chunks are kept read-only; the first store into one raises a protection fault
+ * that the tracker's signal handler resolves by marking the chunk dirty and making it writable again.
+ *
+ * The same mechanism provides a copy-on-write barrier for snapshots: begin_snapshot() write protects every
+ * dirty chunk again and marks it pending. A consumer then claim()s pending chunks and copies them out at
+ * its own pace; if a writer reaches a pending chunk first, the fault handler preserves the chunk's
+ * contents before letting the write through, and the consumer picks up the preserved copy instead.
+ *
+ * Read views use the barrier as well: add_view() maps a second, read-only alias of the region and write
+ * protects every chunk. The first write to a chunk afterwards copies the chunk into each view still sharing
+ * it, and maps that copy over the view's alias, before the write goes through.
+ *
+ * If the kernel refuses to change protections (for example because the process ran out of mappings), the
+ * tracker gives up: the whole region is made writable, every chunk reports as dirty from then on and every
+ * live view is marked inconsistent.
+ */
+class write_tracker {
+   public:
+      /// tracks the first size bytes at base; the region may later be extended up to capacity bytes
+      write_tracker(char* base, size_t size, size_t capacity, size_t chunk_size);
+      ~write_tracker();
+
+      write_tracker(const write_tracker&) = delete;
+      write_tracker& operator=(const write_tracker&) = delete;
+
+      /// write protects the region and marks every chunk clean; returns false if tracking could not be set up
+      bool arm();
+      /// installs the fault handler for views only; nothing is write protected and every chunk stays dirty
+      bool attach();
+
+      /**
+       * Must be called while nothing writes to the region and no snapshot is being copied out. Starts tracking
+       * the region up to new_size, which must not exceed the capacity. When armed, the added chunks start out clean.
+       */
+      void extend(size_t new_size);
+
+      size_t chunk_size() const { return _chunk_size; }
+      size_t num_chunks() const { return (size() + _chunk_size - 1) / _chunk_size; }
+      size_t chunk_offset(size_t chunk) const { return chunk * _chunk_size; }
+      size_t chunk_length(size_t chunk) const;
+
+      bool is_dirty(size_t chunk) const { return _overflowed || _state[chunk].load(std::memory_order_acquire) == dirty; }
+      size_t dirty_count() const;
+      /// true once tracking had to be abandoned, after which every chunk reports dirty
+      bool overflowed() const { return _overflowed; }
+
+      /**
+       * Must be called while nothing writes to the region. Moves every dirty chunk to pending and returns
+       * their indices. If preserving a chunk in the fault handler fails, its contents are copied straight to
+       * the matching offset of fallback_target instead.
+       */
+      std::vector<size_t> begin_snapshot(char* fallback_target);
+      /// takes a pending chunk for copying; returns false if a writer got there first (see take_preserved)
+      bool claim(size_t chunk);
+      /// marks a claimed chunk as copied; it stays write protected and clean
+      void release(size_t chunk);
+      /**
+       * For a chunk that could not be claimed, waits for the fault handler to finish preserving it and
+       * returns the copy, or nullptr if the handler already wrote it to the fallback target. The returned
+       * buffer must be handed back to free_preserved().
+       */
+      char* take_preserved(size_t chunk);
+      void free_preserved(size_t chunk, char* buffer);
+
+      /**
+       * Must be called while nothing writes to the region. Maps a view of the region's current contents and
+       * write protects every chunk so the first write to each preserves it for the view. Returns nullptr if
+       * the view could not be mapped or too many views are alive.
+       */
+      std::shared_ptr<pinnable_mapped_file::view> add_view();
+
+      /// picks a chunk size that is a multiple of both min_chunk_size and page_size and keeps the number of chunks bounded
+      static size_t choose_chunk_size(size_t region_size, size_t min_chunk_size, size_t page_size);
+
+   private:
+      friend struct write_tracker_registry;
+      struct view_table;
+      class tracked_view;
+
+      enum chunk_state : uint8_t {
+         clean,    ///< write protected, matches the last snapshot
+         dirty,    ///< writable, modified since the last snapshot
+         pending,  ///< write protected, belongs to a snapshot that has not copied it out yet
+         copying   ///< a snapshot consumer or the fault handler is copying it out
+      };
+
+      enum view_protection : uint8_t {
+         unprotected,   ///< every view already has its own copy, or none shares the chunk
+         for_views,     ///< write protected until the live views have a copy
+         preserving     ///< the fault handler is copying it into the views
+      };
+
+      size_t size() const { return _size.load(std::memory_order_acquire); }
+      bool contains(const char* addr) const { return addr >= _base && addr < _base + size(); }
+      void on_write_fault(char* addr);
+      void make_writable(size_t chunk);
+      void preserve_for_views(size_t chunk);
+      /// abandons tracking and makes the whole region writable again; false if even that failed
+      bool give_up();
+
+      char* const                              _base;
+      std::atomic<size_t>                      _size;
+      const size_t                             _chunk_size;
+      const size_t                             _max_num_chunks;
+      std::unique_ptr<std::atomic<uint8_t>[]>  _state;
+      std::unique_ptr<std::atomic<char*>[]>    _preserved;
+      std::atomic<char*>                       _fallback_target{nullptr};
+      std::atomic<bool>                        _overflowed{false};
+      bool                                     _registered = false;
+      bool                                     _armed = false;
+      std::unique_ptr<std::atomic<uint8_t>[]>  _view_protected;
+      std::shared_ptr<view_table>              _views;
+
+      constexpr static size_t                  _max_chunks = 16384;
+      constexpr static unsigned                _max_views = 16;
+};
+
+}
@@ -2,12 +2,22 @@
 
 #include <boost/test/unit_test.hpp>
 #include <chainbase/chainbase.hpp>
+#include <chainbase/environment.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/member.hpp>
 
+#include <atomic>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <thread>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace chainbase;
 using namespace boost::multi_index;
@@ -38,97 +48,1407 @@ typedef multi_index_container<
 
 CHAINBASE_SET_INDEX_TYPE( book, book_index )
 
+struct pooled_book : public chainbase::object<1, pooled_book> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( pooled_book )
 
-BOOST_AUTO_TEST_CASE( open_and_create ) {
-   boost::filesystem::path temp = boost::filesystem::unique_path();
-   try {
-      std::cerr << temp << " \n";
+   id_type id;
+   int a = 0;
+};
 
-      chainbase::database db(temp, database::read_write, 1024*1024*8);
-      chainbase::database db2(temp); /// open an already created db
-      BOOST_CHECK_THROW( db2.add_index< book_index >(), std::runtime_error ); /// index does not exist in read only database
+typedef chainbase::shared_multi_index_container<
+  pooled_book,
+  indexed_by<
+     ordered_unique< member<pooled_book,pooled_book::id_type,&pooled_book::id> >,
+     ordered_non_unique< BOOST_MULTI_INDEX_MEMBER(pooled_book,int,a) >
+  >
+> pooled_book_index;
+
+CHAINBASE_SET_INDEX_TYPE( pooled_book, pooled_book_index )
+
+namespace chainbase {
+   template<> struct object_digest<pooled_book> {
+      static void write( const pooled_book& b, object_hasher& h ) { h( b.id )( b.a ); }
+   };
+}
+
+/// what the state hash of pooled_book_index should be, recomputed from its contents
+chainbase::state_digest pooled_book_digest( const chainbase::database& db ) {
+   chainbase::state_digest d;
+   for( const auto& b : db.get_index<pooled_book_index>().indices() )
+      d += chainbase::digest_object( b );
+   return d;
+}
+
+struct dense_book : public chainbase::object<2, dense_book> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( dense_book )
+
+   id_type id;
+   int a = 0;
+};
+
+typedef chainbase::shared_multi_index_container<
+  dense_book,
+  indexed_by<
+     ordered_unique< member<dense_book,dense_book::id_type,&dense_book::id> >,
+     ordered_non_unique< BOOST_MULTI_INDEX_MEMBER(dense_book,int,a) >
+  >
+> dense_book_index;
+
+CHAINBASE_SET_INDEX_TYPE( dense_book, dense_book_index )
+CHAINBASE_SET_DENSE_ID_LOOKUP( dense_book )
+
+/// a large object of which only the counter changes within undo sessions
+struct blob_book : public chainbase::object<3, blob_book> {
+   template<typename Constructor, typename Allocator>
+   blob_book( Constructor&& c, Allocator&& a ) : payload( chainbase::allocator<char>( a.get_segment_manager() ) ) {
+      c(*this);
+   }
+
+   id_type                  id;
+   int64_t                  counter = 0;
+   chainbase::shared_string payload;
+};
+
+typedef chainbase::shared_multi_index_container<
+  blob_book,
+  indexed_by<
+     ordered_unique< member<blob_book,blob_book::id_type,&blob_book::id> >,
+     ordered_non_unique< BOOST_MULTI_INDEX_MEMBER(blob_book,int64_t,counter) >
+  >
+> blob_book_index;
+
+CHAINBASE_SET_INDEX_TYPE( blob_book, blob_book_index )
+
+namespace chainbase {
+   template<> struct undo_delta<blob_book> {
+      struct type { int64_t counter; };
+      static type capture( const blob_book& b ) { return { b.counter }; }
+      static void restore( blob_book& b, type& d ) { b.counter = d.counter; }
+   };
+}
+
+/// gives a test a database directory, removed when the test ends however it ends
+struct temp_directory {
+   ~temp_directory() {
+      for( const bfs::path& dir : dirs )
+         bfs::remove_all( dir );
+   }
+
+   /// another directory, removed along with temp
+   bfs::path new_directory() {
+      dirs.push_back( bfs::unique_path() );
+      return dirs.back();
+   }
+
+   std::vector<bfs::path> dirs{ bfs::unique_path() };
+   const bfs::path        temp = dirs.front();
+};
+
+BOOST_FIXTURE_TEST_CASE( open_and_create, temp_directory ) {
+   std::cerr << temp << " \n";
+
+   chainbase::database db(temp, database::read_write, 1024*1024*8);
+   chainbase::database db2(temp); /// open an already created db
+   BOOST_CHECK_THROW( db2.add_index< book_index >(), std::runtime_error ); /// index does not exist in read only database
+
+   db.add_index< book_index >();
+   BOOST_CHECK_THROW( db.add_index<book_index>(), std::logic_error ); /// cannot add same index twice
+
+
+   db2.add_index< book_index >(); /// index should exist now
 
+
+   BOOST_TEST_MESSAGE( "Creating book" );
+   const auto& new_book = db.create<book>( []( book& b ) {
+       b.a = 3;
+       b.b = 4;
+   } );
+   const auto& copy_new_book = db2.get( book::id_type(0) );
+   BOOST_REQUIRE( &new_book != &copy_new_book ); ///< these are mapped to different address ranges
+
+   BOOST_REQUIRE_EQUAL( new_book.a, copy_new_book.a );
+   BOOST_REQUIRE_EQUAL( new_book.b, copy_new_book.b );
+
+   db.modify( new_book, [&]( book& b ) {
+       b.a = 5;
+       b.b = 6;
+   });
+   BOOST_REQUIRE_EQUAL( new_book.a, 5 );
+   BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+
+   BOOST_REQUIRE_EQUAL( new_book.a, copy_new_book.a );
+   BOOST_REQUIRE_EQUAL( new_book.b, copy_new_book.b );
+
+   {
+       auto session = db.start_undo_session(true);
+       db.modify( new_book, [&]( book& b ) {
+           b.a = 7;
+           b.b = 8;
+       });
+
+      BOOST_REQUIRE_EQUAL( new_book.a, 7 );
+      BOOST_REQUIRE_EQUAL( new_book.b, 8 );
+   }
+   BOOST_REQUIRE_EQUAL( new_book.a, 5 );
+   BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+
+   {
+       auto session = db.start_undo_session(true);
+       const auto& book2 = db.create<book>( [&]( book& b ) {
+           b.a = 9;
+           b.b = 10;
+       });
+
+      BOOST_REQUIRE_EQUAL( new_book.a, 5 );
+      BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+      BOOST_REQUIRE_EQUAL( book2.a, 9 );
+      BOOST_REQUIRE_EQUAL( book2.b, 10 );
+   }
+   BOOST_CHECK_THROW( db2.get( book::id_type(1) ), std::out_of_range );
+   BOOST_REQUIRE_EQUAL( new_book.a, 5 );
+   BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+
+
+   {
+       auto session = db.start_undo_session(true);
+       db.modify( new_book, [&]( book& b ) {
+           b.a = 7;
+           b.b = 8;
+       });
+
+      BOOST_REQUIRE_EQUAL( new_book.a, 7 );
+      BOOST_REQUIRE_EQUAL( new_book.b, 8 );
+      session.push();
+   }
+   BOOST_REQUIRE_EQUAL( new_book.a, 7 );
+   BOOST_REQUIRE_EQUAL( new_book.b, 8 );
+   db.undo();
+   BOOST_REQUIRE_EQUAL( new_book.a, 5 );
+   BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+
+   BOOST_REQUIRE_EQUAL( new_book.a, copy_new_book.a );
+   BOOST_REQUIRE_EQUAL( new_book.b, copy_new_book.b );
+}
+
+BOOST_FIXTURE_TEST_CASE( heap_mode_preload, temp_directory ) {
+   const uint64_t db_size = 1024*1024*256;
+   {
+      chainbase::database db(temp, database::read_write, db_size);
       db.add_index< book_index >();
-      BOOST_CHECK_THROW( db.add_index<book_index>(), std::logic_error ); /// cannot add same index twice
+      for( int i = 0; i < 1000; ++i ) {
+         db.create<book>( [&]( book& b ) {
+             b.a = i;
+             b.b = i*2;
+         } );
+      }
+   }
 
+   chainbase::map_options options;
+   options.preload_threads = 3;
+   options.track_dirty_chunks = true;
+   {
+      chainbase::database db(temp, database::read_write, db_size, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 1000u );
+      for( int i = 0; i < 1000; ++i ) {
+         const auto& b = db.get( book::id_type(i) );
+         BOOST_REQUIRE_EQUAL( b.a, i );
+         BOOST_REQUIRE_EQUAL( b.b, i*2 );
+      }
+      db.modify( db.get( book::id_type(500) ), [&]( book& b ) {
+          b.a = -1;
+      });
+      for( int i = 1000; i < 100000; ++i ) {
+         db.create<book>( [&]( book& b ) {
+             b.a = i;
+             b.b = i*2;
+         } );
+      }
+   }
+
+   {
+      chainbase::database db(temp, database::read_write, db_size);
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 100000u );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(500) ).a, -1 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(999) ).b, 999*2 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(99999) ).b, 99999*2 );
+   }
 
-      db2.add_index< book_index >(); /// index should exist now
+   struct stat st;
+   BOOST_REQUIRE_EQUAL( stat( (temp / "shared_memory.bin").c_str(), &st ), 0 );
+   BOOST_REQUIRE_LT( uint64_t(st.st_blocks) * 512, db_size / 4 ); /// untouched parts of the file stay sparse
+}
 
+BOOST_FIXTURE_TEST_CASE( heap_mode_checkpoint, temp_directory ) {
+   const uint64_t db_size = 1024*1024*64;
+   chainbase::map_options options;
+   options.track_dirty_chunks = true;
+   options.checkpoint_interval = std::chrono::seconds(1);
 
-      BOOST_TEST_MESSAGE( "Creating book" );
-      const auto& new_book = db.create<book>( []( book& b ) {
-          b.a = 3;
-          b.b = 4;
+   chainbase::database db(temp, database::read_write, db_size, false, pinnable_mapped_file::map_mode::heap, {}, options);
+   db.add_index< book_index >();
+   for( int i = 0; i < 50000; ++i ) {
+      db.create<book>( [&]( book& b ) {
+          b.a = i;
       } );
-      const auto& copy_new_book = db2.get( book::id_type(0) );
-      BOOST_REQUIRE( &new_book != &copy_new_book ); ///< these are mapped to different address ranges
+   }
+   db.flush();
 
-      BOOST_REQUIRE_EQUAL( new_book.a, copy_new_book.a );
-      BOOST_REQUIRE_EQUAL( new_book.b, copy_new_book.b );
+   {
+      chainbase::database reader(temp); /// file must be clean and complete right after flush()
+      reader.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( reader.get_index<book_index>().indices().size(), 50000u );
+      BOOST_REQUIRE_EQUAL( reader.get( book::id_type(49999) ).a, 49999 );
+   }
 
-      db.modify( new_book, [&]( book& b ) {
-          b.a = 5;
-          b.b = 6;
+   std::this_thread::sleep_for( std::chrono::milliseconds(1100) );
+   for( int i = 0; i < 50000; i += 100 ) {
+      db.modify( db.get( book::id_type(i) ), [&]( book& b ) {
+          b.b = 1000;
       });
-      BOOST_REQUIRE_EQUAL( new_book.a, 5 );
-      BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+   }
+   db.commit( db.revision() ); /// starts a background checkpoint of the state as of this call
+   for( int i = 0; i < 50000; i += 50 ) {
+      db.modify( db.get( book::id_type(i) ), [&]( book& b ) {
+          b.b = 2000;
+      });
+   }
+   db.create<book>( []( book& ) {} );
 
-      BOOST_REQUIRE_EQUAL( new_book.a, copy_new_book.a );
-      BOOST_REQUIRE_EQUAL( new_book.b, copy_new_book.b );
+   std::unique_ptr<chainbase::database> reader;
+   for( int attempt = 0; !reader && attempt < 500; ++attempt ) {
+      try {
+         reader.reset( new chainbase::database(temp) );
+      } catch( const std::runtime_error& ) {
+         std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+      }
+   }
+   BOOST_REQUIRE( reader );
+   reader->add_index< book_index >();
+   BOOST_REQUIRE_EQUAL( reader->get_index<book_index>().indices().size(), 50000u );
+   for( int i = 0; i < 50000; i += 50 )
+      BOOST_REQUIRE_EQUAL( reader->get( book::id_type(i) ).b, i % 100 ? 1 : 1000 );
+   reader.reset();
 
-      {
-          auto session = db.start_undo_session(true);
-          db.modify( new_book, [&]( book& b ) {
-              b.a = 7;
-              b.b = 8;
-          });
+   BOOST_REQUIRE_EQUAL( db.get( book::id_type(50) ).b, 2000 );
+}
 
-         BOOST_REQUIRE_EQUAL( new_book.a, 7 );
-         BOOST_REQUIRE_EQUAL( new_book.b, 8 );
+BOOST_FIXTURE_TEST_CASE( move_assigned_file_closes_the_old_one, temp_directory ) {
+   chainbase::map_options options;
+   options.track_dirty_chunks = true;
+   options.checkpoint_interval = std::chrono::seconds(1);
+   {
+      pinnable_mapped_file first(temp / "first", true, 1024*1024*8, false, pinnable_mapped_file::map_mode::mapped, {});
+      pinnable_mapped_file second(temp / "second", true, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      first = std::move( second );
+      /// the first database was closed cleanly, so it opens again without allow_dirty
+      BOOST_CHECK_NO_THROW( pinnable_mapped_file( temp / "first", true, 0, false, pinnable_mapped_file::map_mode::mapped, {} ) );
+   }
+   BOOST_CHECK_NO_THROW( pinnable_mapped_file( temp / "second", true, 0, false, pinnable_mapped_file::map_mode::mapped, {} ) );
+}
+
+BOOST_FIXTURE_TEST_CASE( snapshot_round_trip, temp_directory ) {
+   const bfs::path source = temp / "source";
+   const bfs::path restored = temp / "restored";
+   const bfs::path snapshot = temp / "db.snapshot";
+   {
+      chainbase::database db(source, database::read_write, 1024*1024*32);
+      db.add_index< book_index >();
+      for( int i = 0; i < 20000; ++i ) {
+         db.create<book>( [&]( book& b ) {
+             b.a = i;
+             b.b = i * 3;
+         } );
       }
-      BOOST_REQUIRE_EQUAL( new_book.a, 5 );
-      BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+      db.write_snapshot( snapshot, 2 );
+   }
+   BOOST_REQUIRE_LT( bfs::file_size(snapshot), bfs::file_size(source / "shared_memory.bin") / 4 );
+
+   chainbase::database::restore_snapshot( snapshot, restored, 2 );
+   BOOST_CHECK_THROW( chainbase::database::restore_snapshot( snapshot, restored ), std::runtime_error );
+   {
+      chainbase::database db(restored, database::read_write);
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 20000u );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(12345) ).b, 12345 * 3 );
+      db.create<book>( []( book& ) {} );
+   }
+
+   {
+      // flip a byte early in the first stored block, which holds the segment manager's bookkeeping
+      std::fstream f(snapshot.generic_string(), std::ios::in | std::ios::out | std::ios::binary);
+      char c = 0;
+      f.seekg( 1024 );
+      f.read( &c, 1 );
+      c ^= 0x5a;
+      f.seekp( 1024 );
+      f.write( &c, 1 );
+   }
+   BOOST_CHECK_THROW( chainbase::database::restore_snapshot( snapshot, temp / "corrupt" ), std::runtime_error );
+   BOOST_REQUIRE( !bfs::exists( temp / "corrupt" / "shared_memory.bin" ) );
+   BOOST_REQUIRE( !bfs::exists( temp / "corrupt" / "shared_memory.bin.restore" ) );
+
+}
+
+BOOST_FIXTURE_TEST_CASE( node_allocator_reuses_nodes, temp_directory ) {
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< pooled_book_index >();
+      for( int i = 0; i < 1000; ++i )
+         db.create<pooled_book>( [&]( pooled_book& b ) { b.a = i; } );
 
       {
-          auto session = db.start_undo_session(true);
-          const auto& book2 = db.create<book>( [&]( book& b ) {
-              b.a = 9;
-              b.b = 10;
-          });
-
-         BOOST_REQUIRE_EQUAL( new_book.a, 5 );
-         BOOST_REQUIRE_EQUAL( new_book.b, 6 );
-         BOOST_REQUIRE_EQUAL( book2.a, 9 );
-         BOOST_REQUIRE_EQUAL( book2.b, 10 );
-      }
-      BOOST_CHECK_THROW( db2.get( book::id_type(1) ), std::out_of_range );
-      BOOST_REQUIRE_EQUAL( new_book.a, 5 );
-      BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+         auto session = db.start_undo_session( true );
+         for( int i = 0; i < 1000; i += 2 )
+            db.remove( db.get( pooled_book::id_type(i) ) );
+         for( int i = 1; i < 1000; i += 2 )
+            db.modify( db.get( pooled_book::id_type(i) ), [&]( pooled_book& b ) { b.a = -i; } );
+      }
+      BOOST_REQUIRE_EQUAL( db.get_index<pooled_book_index>().indices().size(), 1000u );
+      BOOST_REQUIRE_EQUAL( db.get( pooled_book::id_type(3) ).a, 3 );
 
+      const size_t free_memory = db.get_free_memory();
+      for( int i = 0; i < 1000; i += 2 )
+         db.remove( db.get( pooled_book::id_type(i) ) );
+      for( int i = 0; i < 500; ++i )
+         db.create<pooled_book>( [&]( pooled_book& b ) { b.a = i; } );
+      BOOST_REQUIRE_EQUAL( db.get_free_memory(), free_memory ); /// freed nodes are recycled by the pool
+   }
+   {
+      chainbase::database db(temp, database::read_only);
+      db.add_index< pooled_book_index >();
+      BOOST_REQUIRE_EQUAL( db.get_index<pooled_book_index>().indices().size(), 1000u );
+      BOOST_REQUIRE_EQUAL( db.get( pooled_book::id_type(1499) ).a, 499 );
+   }
+}
 
+BOOST_FIXTURE_TEST_CASE( undo_random_operations, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*32);
+   db.add_index< book_index >();
+   db.add_index< pooled_book_index >();
+
+   /// (table, id) -> (a, b); table 0 holds books, table 1 pooled_books which only have a
+   typedef std::map< std::pair<int,int64_t>, std::pair<int,int> > model_type;
+   model_type model;
+   struct saved_model {
+      int64_t                  revision;
+      model_type               state;
+      std::array<int64_t, 2>   next_id;
+   };
+   std::vector< saved_model > model_stack; /// what each revision returns to on undo
+   std::array<int64_t, 2> next_id = {{ 0, 0 }};
+   int64_t revision = db.revision();
+
+   auto check = [&]() {
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size() + db.get_index<pooled_book_index>().indices().size(), model.size() );
+      for( const auto& item : model ) {
+         if( item.first.first == 0 ) {
+            const book& b = db.get( book::id_type(item.first.second) );
+            BOOST_REQUIRE_EQUAL( b.a, item.second.first );
+            BOOST_REQUIRE_EQUAL( b.b, item.second.second );
+         } else {
+            BOOST_REQUIRE_EQUAL( db.get( pooled_book::id_type(item.first.second) ).a, item.second.first );
+         }
+      }
+      BOOST_REQUIRE_EQUAL( db.revision(), revision );
+      BOOST_REQUIRE_EQUAL( db.undo_stack_revision_range().first, model_stack.empty() ? revision : model_stack.front().revision - 1 );
+      BOOST_REQUIRE( *db.get_index<pooled_book_index>().state_hash() == pooled_book_digest( db ) );
+   };
+   auto random_existing = [&]() {
+      auto itr = model.begin();
+      std::advance( itr, rand() % model.size() );
+      return itr->first;
+   };
+   auto create = [&]( int table ) {
+      const int a = rand() % 1000;
+      if( table == 0 )
+         db.create<book>( [&]( book& b ) { b.a = a; } );
+      else
+         db.create<pooled_book>( [&]( pooled_book& b ) { b.a = a; } );
+      model[{ table, next_id[table] }] = { a, 1 };
+      return std::make_pair( table, next_id[table]++ );
+   };
+   auto modify = [&]( const std::pair<int,int64_t>& key ) {
+      const int value = rand();
+      if( key.first == 0 ) {
+         db.modify( db.get( book::id_type(key.second) ), [&]( book& o ) { o.b = value; } );
+         model[key].second = value;
+      } else {
+         db.modify( db.get( pooled_book::id_type(key.second) ), [&]( pooled_book& o ) { o.a = value; } );
+         model[key].first = value;
+      }
+   };
+   auto remove = [&]( const std::pair<int,int64_t>& key ) {
+      if( key.first == 0 )
+         db.remove( db.get( book::id_type(key.second) ) );
+      else
+         db.remove( db.get( pooled_book::id_type(key.second) ) );
+      model.erase( key );
+   };
+   auto push = [&]() {
+      auto session = db.start_undo_session( true );
+      BOOST_REQUIRE_EQUAL( session.revision(), ++revision );
+      model_stack.push_back( { revision, model, next_id } );
+      session.push();
+   };
+   auto undo = [&]() {
+      db.undo();
+      model = model_stack.back().state;
+      next_id = model_stack.back().next_id;
+      model_stack.pop_back();
+      --revision;
+   };
+   auto squash = [&]() {
+      db.squash();
+      model_stack.pop_back();
+      --revision;
+   };
+
+   srand( 42 );
+   for( int step = 0; step < 4000; ++step ) {
+      const int op = rand() % 100;
+      if( op < 30 ) {
+         create( rand() % 2 );
+      } else if( op < 55 && !model.empty() ) {
+         modify( random_existing() );
+      } else if( op < 70 && !model.empty() ) {
+         remove( random_existing() );
+      } else if( op < 80 ) {
+         push();
+      } else if( op < 88 && !model_stack.empty() ) {
+         undo();
+      } else if( op < 95 && !model_stack.empty() ) {
+         squash();
+      } else if( !model_stack.empty() ) {
+         const int64_t commit_revision = model_stack[ rand() % model_stack.size() ].revision;
+         db.commit( commit_revision );
+         while( !model_stack.empty() && model_stack.front().revision <= commit_revision )
+            model_stack.erase( model_stack.begin() );
+      }
+      check();
+   }
+   while( !model_stack.empty() ) {
+      undo();
+      check();
+   }
+
+   /// objects created in a session and then modified or removed in a nested one that is squashed into it
+   for( int round = 0; round < 200; ++round ) {
+      push();
+      std::vector< std::pair<int,int64_t> > created;
+      for( int i = rand() % 4; i >= 0; --i )
+         created.push_back( create( rand() % 2 ) );
+      push();
+      for( const auto& key : created ) {
+         const int op = rand() % 3;
+         if( op == 0 )
+            modify( key );
+         else if( op == 1 )
+            remove( key );
+      }
+      if( !model.empty() )
+         modify( random_existing() );
+      if( rand() % 2 )
+         create( rand() % 2 );
+      squash();
+      check();
+      undo();
+      check();
+   }
+
+   {
+      auto session = db.start_undo_session( true );
+      db.create<book>( []( book& ) {} );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().undo_history().sessions(), 1u );
+      BOOST_REQUIRE( db.get_index<pooled_book_index>().undo_history().empty() ); /// untouched in this session
+   }
+   BOOST_REQUIRE( db.get_index<book_index>().undo_history().empty() );
+}
+
+BOOST_FIXTURE_TEST_CASE( squash_into_creating_session, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*8);
+   db.add_index< book_index >();
+   db.create<book>( []( book& b ) { b.a = 100; } );
+
+   /// a nested session that changes an object its parent created, squashed into the parent
+   for( bool remove : { false, true } ) {
+      auto outer = db.start_undo_session( true );
+      db.modify( db.get( book::id_type(0) ), []( book& b ) { b.a = 101; } );
+      const book& created = db.create<book>( []( book& b ) { b.a = 1; } );
+      const book::id_type id = created.id;
       {
-          auto session = db.start_undo_session(true);
-          db.modify( new_book, [&]( book& b ) {
-              b.a = 7;
-              b.b = 8;
-          });
-
-         BOOST_REQUIRE_EQUAL( new_book.a, 7 );
-         BOOST_REQUIRE_EQUAL( new_book.b, 8 );
+         auto inner = db.start_undo_session( true );
+         if( remove )
+            db.remove( created );
+         else
+            db.modify( created, []( book& b ) { b.a = 2; } );
+         db.modify( db.get( book::id_type(0) ), []( book& b ) { b.a = 102; } );
+         inner.squash();
+      }
+      BOOST_REQUIRE_EQUAL( db.find( id ) != nullptr, !remove );
+      outer.undo();
+      BOOST_REQUIRE( db.find( id ) == nullptr );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 1u );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(0) ).a, 100 );
+      BOOST_REQUIRE( db.get_index<book_index>().undo_history().empty() );
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE( older_file_format_refused, temp_directory ) {
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+   }
+   /// files from before the undo log carry the previous header id
+   const uint64_t previous_id = 0x3342444f49534f45ULL; //"EOSIODB3" little endian
+   {
+      std::fstream f( (temp / "shared_memory.bin").string(), std::ios::in | std::ios::out | std::ios::binary );
+      f.write( (const char*)&previous_id, sizeof(previous_id) );
+   }
+   BOOST_CHECK_THROW( chainbase::database( temp, database::read_write, 1024*1024*8 ), std::runtime_error );
+}
+
+BOOST_FIXTURE_TEST_CASE( read_only_open_next_to_writer, temp_directory ) {
+   /// a writer that crashed leaves its dirty flag behind, but not its lock
+   std::cout.flush();
+   const pid_t crashed = fork();
+   if( crashed == 0 ) {
+      try {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         db.create<book>( []( book& b ) { b.a = 1; } );
+         _exit( 0 );
+      } catch( ... ) {
+         _exit( 1 );
+      }
+   }
+   int status = 0;
+   BOOST_REQUIRE_EQUAL( waitpid( crashed, &status, 0 ), crashed );
+   BOOST_REQUIRE( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+   BOOST_CHECK_THROW( chainbase::database( temp, database::read_only ), std::runtime_error );
+   BOOST_CHECK_NO_THROW( chainbase::database( temp, database::read_only, 0, true ) );
+
+   /// a writer in another process that is still running
+   int ready[2], done[2];
+   BOOST_REQUIRE_EQUAL( pipe( ready ), 0 );
+   BOOST_REQUIRE_EQUAL( pipe( done ), 0 );
+   const pid_t writer = fork();
+   if( writer == 0 ) {
+      try {
+         chainbase::database db(temp, database::read_write, 0, true);
+         char c = 0;
+         if( write( ready[1], &c, 1 ) != 1 || read( done[0], &c, 1 ) != 1 )
+            _exit( 1 );
+         _exit( 0 );
+      } catch( ... ) {
+         _exit( 1 );
+      }
+   }
+   close( ready[1] );
+   char c = 0;
+   const bool started = read( ready[0], &c, 1 ) == 1;
+   int a = 0;
+   if( started ) {
+      chainbase::database reader( temp );
+      reader.add_index< book_index >();
+      a = reader.get( book::id_type(0) ).a;
+   }
+   BOOST_REQUIRE_EQUAL( write( done[1], &c, 1 ), 1 );
+   close( ready[0] );
+   close( done[0] );
+   close( done[1] );
+   BOOST_REQUIRE_EQUAL( waitpid( writer, &status, 0 ), writer );
+   BOOST_REQUIRE( started );
+   BOOST_REQUIRE_EQUAL( a, 1 );
+}
+
+BOOST_FIXTURE_TEST_CASE( deferred_commit_reclamation, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*8);
+   db.add_index< book_index >();
+   for( int i = 0; i < 1000; ++i )
+      db.create<book>( []( book& ) {} );
+   const auto& history = db.get_index<book_index>().undo_history();
+
+   db.set_commit_reclaim_limit( 0 );
+   for( int s = 0; s < 2; ++s ) {
+      auto session = db.start_undo_session( true );
+      for( int i = 0; i < 1000; ++i )
+         db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = s; } );
+      session.push();
+   }
+   db.commit( db.revision() - 1 );
+   BOOST_REQUIRE_EQUAL( history.retired(), 1000u );
+   BOOST_REQUIRE_EQUAL( history.size(), 2000u );
+
+   {
+      auto session = db.start_undo_session( true );
+      for( int i = 0; i < 100; ++i )
+         db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = 100; } );
+      BOOST_REQUIRE_EQUAL( history.retired(), 800u ); /// writes reclaim a little as they go
+   }
+   BOOST_REQUIRE_EQUAL( db.get( book::id_type(5) ).b, 1 );
+
+   BOOST_REQUIRE_EQUAL( db.reclaim_undo_history( 300 ), 300u );
+   BOOST_REQUIRE_EQUAL( db.reclaim_undo_history(), 500u );
+   BOOST_REQUIRE_EQUAL( history.size(), 1000u );
+
+   db.undo();
+   BOOST_REQUIRE_EQUAL( db.get( book::id_type(5) ).b, 0 );
+}
+
+BOOST_FIXTURE_TEST_CASE( parallel_undo, temp_directory ) {
+   for( bool track : { false, true } ) {
+      chainbase::map_options options;
+      options.track_dirty_chunks = track; /// tracked writes keep undo on the calling thread
+      const auto mode = track ? pinnable_mapped_file::map_mode::heap : pinnable_mapped_file::map_mode::mapped;
+      chainbase::database db(temp / std::to_string( track ), database::read_write, 1024*1024*32, false, mode, {}, options);
+      db.add_index< book_index >();
+      db.add_index< pooled_book_index >();
+      db.add_index< dense_book_index >();
+      db.set_undo_threads( 4 );
+      for( int i = 0; i < 1000; ++i ) {
+         db.create<book>( [&]( book& b ) { b.a = i; } );
+         db.create<pooled_book>( [&]( pooled_book& b ) { b.a = i; } );
+         db.create<dense_book>( [&]( dense_book& b ) { b.a = i; } );
+      }
+
+      for( int s = 1; s <= 3; ++s ) {
+         auto session = db.start_undo_session( true );
+         for( int i = 0; i < 1000; i += s ) {
+            db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = s; } );
+            db.modify( db.get( pooled_book::id_type(i) ), [&]( pooled_book& b ) { b.a = -s; } );
+            if( const auto* d = db.find( dense_book::id_type(i) ) )
+               db.remove( *d );
+         }
+         for( int i = 0; i < 100; ++i )
+            db.create<dense_book>( [&]( dense_book& b ) { b.a = s; } );
          session.push();
       }
-      BOOST_REQUIRE_EQUAL( new_book.a, 7 );
-      BOOST_REQUIRE_EQUAL( new_book.b, 8 );
+
       db.undo();
-      BOOST_REQUIRE_EQUAL( new_book.a, 5 );
-      BOOST_REQUIRE_EQUAL( new_book.b, 6 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(2) ).b, 2 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(3) ).b, 1 );
+      BOOST_REQUIRE_EQUAL( db.get( pooled_book::id_type(3) ).a, -1 );
+      BOOST_REQUIRE_EQUAL( db.get_index<dense_book_index>().indices().size(), 200u );
+
+      db.commit( db.revision() - 1 );
+      BOOST_REQUIRE( db.get_index<book_index>().undo_history().retired() == 0 );
+      BOOST_REQUIRE( db.get_index<pooled_book_index>().undo_history().retired() == 0 );
+
+      db.undo_all(); /// back to where the committed first session left things
+      for( int i = 0; i < 1000; ++i ) {
+         BOOST_REQUIRE_EQUAL( db.get( book::id_type(i) ).b, 1 );
+         BOOST_REQUIRE_EQUAL( db.get( pooled_book::id_type(i) ).a, -1 );
+      }
+      BOOST_REQUIRE_EQUAL( db.get_index<dense_book_index>().indices().size(), 100u );
+      BOOST_REQUIRE( !db.find( dense_book::id_type(999) ) && db.find( dense_book::id_type(1000) ) );
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE( delta_undo, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*32);
+   db.add_index< blob_book_index >();
+   const auto& history = db.get_index<blob_book_index>().undo_history();
+   BOOST_REQUIRE( chainbase::undo_log<blob_book>::uses_deltas );
+   BOOST_REQUIRE( !chainbase::undo_log<book>::uses_deltas );
+
+   const std::string payload( 4096, 'x' );
+   for( int i = 0; i < 100; ++i )
+      db.create<blob_book>( [&]( blob_book& b ) { b.counter = i; b.payload.assign( payload.c_str(), payload.size() ); } );
+
+   const size_t free_before = db.get_free_memory();
+   for( int s = 1; s <= 3; ++s ) {
+      auto session = db.start_undo_session( true );
+      for( int i = 0; i < 100; ++i ) {
+         if( const auto* obj = db.find( blob_book::id_type(i) ) ) {
+            db.modify( *obj, [&]( blob_book& b ) { b.counter += 1000; } );
+            db.modify( *obj, [&]( blob_book& b ) { b.counter += 1000; } );
+         }
+      }
+      if( s == 2 )
+         db.remove( db.get( blob_book::id_type(7) ) );
+      session.push();
+   }
+   BOOST_REQUIRE_EQUAL( history.size(), 100u + 101u + 99u );
+   BOOST_REQUIRE_LT( free_before - db.get_free_memory(), 64u * 1024u ); /// no copies of the payloads, apart from the removed object
+
+   db.squash(); /// sessions 2 and 3 become one
+   BOOST_REQUIRE( !db.find( blob_book::id_type(7) ) );
+   BOOST_REQUIRE_EQUAL( db.get( blob_book::id_type(5) ).counter, 5 + 6000 );
+   db.undo();
+   BOOST_REQUIRE_EQUAL( db.get( blob_book::id_type(5) ).counter, 5 + 2000 );
+   BOOST_REQUIRE_EQUAL( db.get( blob_book::id_type(7) ).counter, 7 + 2000 );
+   BOOST_REQUIRE( db.get( blob_book::id_type(7) ).payload == payload.c_str() );
+   BOOST_REQUIRE_EQUAL( db.get_index<blob_book_index>().indices().get<1>().begin()->counter, 2000 );
+   db.undo();
+   BOOST_REQUIRE_EQUAL( db.get( blob_book::id_type(99) ).counter, 99 );
+   BOOST_REQUIRE( history.empty() );
+   BOOST_REQUIRE_EQUAL( history.size(), 0u );
+}
+
+BOOST_FIXTURE_TEST_CASE( state_hash_order_independent, temp_directory ) {
+   const bfs::path temp1 = temp;
+   const bfs::path temp2 = new_directory();
+   chainbase::state_digest before;
+   {
+      chainbase::database db1(temp1, database::read_write, 1024*1024*8);
+      chainbase::database db2(temp2, database::read_write, 1024*1024*8);
+      for( auto* db : { &db1, &db2 } ) {
+         db->add_index< book_index >();
+         db->add_index< pooled_book_index >();
+         for( int i = 0; i < 10; ++i )
+            db->create<pooled_book>( [&]( pooled_book& b ) { b.a = i; } );
+      }
+      db2.create<book>( []( book& ) {} ); /// books are not part of the hash
+      before = db1.state_hash();
+      BOOST_REQUIRE( before == db2.state_hash() );
+      BOOST_REQUIRE( before != chainbase::state_digest() );
+
+      auto session = db1.start_undo_session( true );
+      db1.modify( db1.get( pooled_book::id_type(2) ), []( pooled_book& b ) { b.a = 100; } );
+      db1.modify( db1.get( pooled_book::id_type(5) ), []( pooled_book& b ) { b.a = 200; } );
+      db1.remove( db1.get( pooled_book::id_type(7) ) );
+      db2.remove( db2.get( pooled_book::id_type(7) ) );
+      db2.modify( db2.get( pooled_book::id_type(5) ), []( pooled_book& b ) { b.a = 200; } );
+      db2.modify( db2.get( pooled_book::id_type(2) ), []( pooled_book& b ) { b.a = 100; } );
+      BOOST_REQUIRE( db1.state_hash() == db2.state_hash() );
+      BOOST_REQUIRE( db1.state_hash() != before );
+      session.undo();
+      BOOST_REQUIRE( db1.state_hash() == before );
+   }
+   {
+      chainbase::database db1(temp1, database::read_write, 1024*1024*8);
+      db1.add_index< pooled_book_index >();
+      BOOST_REQUIRE( db1.state_hash() == before ); /// kept in the database across reopening
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE( read_view_isolation, temp_directory ) {
+   for( auto mode : { pinnable_mapped_file::map_mode::mapped, pinnable_mapped_file::map_mode::heap } ) {
+      chainbase::map_options options;
+      options.track_dirty_chunks = true;
+      options.read_views = true;
+      chainbase::read_view survivor;
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, mode, {}, options);
+         db.add_index< book_index >();
+         BOOST_CHECK_THROW( db.begin_read(), std::runtime_error ); /// nothing published yet
+
+         auto session = db.start_undo_session( true );
+         for( int i = 0; i < 1000; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         session.push(); /// publishes the pushed revision
+
+         {
+            /// sessions nested in a block, and ones without undo, do not publish the block in progress
+            auto outer = db.start_undo_session( true );
+            db.modify( db.get( book::id_type(3) ), []( book& b ) { b.a = 77; } );
+            auto nested = db.start_undo_session( true );
+            db.modify( db.get( book::id_type(4) ), []( book& b ) { b.a = 88; } );
+            db.start_undo_session( true ).push();
+            db.start_undo_session( false );
+            chainbase::read_view during = db.begin_read();
+            BOOST_REQUIRE_EQUAL( during.revision(), 1 );
+            BOOST_REQUIRE_EQUAL( during.get( book::id_type(3) ).a, 3 );
+            BOOST_REQUIRE_EQUAL( during.get( book::id_type(4) ).a, 4 );
+            db.undo(); /// the pushed empty session
+            nested.squash();
+            BOOST_REQUIRE_EQUAL( db.begin_read().revision(), 1 );
+         }
+
+         auto block = db.start_undo_session( true );
+         chainbase::read_view view = db.begin_read();
+         BOOST_REQUIRE_EQUAL( view.revision(), 1 );
+         for( int i = 0; i < 1000; i += 2 )
+            db.remove( db.get( book::id_type(i) ) );
+         for( int i = 1; i < 1000; i += 2 )
+            db.modify( db.get( book::id_type(i) ), []( book& b ) { b.a += 1000; b.b -= 1000; } );
+         db.create<book>( []( book& b ) { b.a = 5000; } );
+
+         BOOST_REQUIRE( view.consistent() );
+         BOOST_REQUIRE_EQUAL( view.get_index<book_index>().indices().size(), 1000u );
+         BOOST_REQUIRE_EQUAL( view.get( book::id_type(2) ).a, 2 );
+         BOOST_REQUIRE_EQUAL( view.get( book::id_type(3) ).b, -3 );
+         BOOST_REQUIRE( view.find( book::id_type(1000) ) == nullptr );
+         BOOST_REQUIRE_EQUAL( view.get_index<book_index>().indices().get<1>().count( 999 ), 1u );
+         BOOST_REQUIRE_EQUAL( db.get( book::id_type(3) ).a, 1003 );
+         BOOST_REQUIRE( db.find( book::id_type(2) ) == nullptr );
+         block.push();
+
+         // readers on another thread always see whole blocks: every book keeps a + b == 0 between blocks
+         std::atomic<bool> done{false};
+         std::atomic<int> failures{0};
+         std::atomic<int> views{0};
+         std::thread reader( [&]() {
+            int64_t last = 0;
+            while( !done ) {
+               chainbase::read_view v = db.begin_read();
+               for( const book& b : v.get_index<book_index>().indices() )
+                  failures += b.a + b.b != 0 && b.a != 5000;
+               failures += v.revision() < last || !v.consistent();
+               last = v.revision();
+               ++views;
+            }
+         } );
+         for( int r = 0; r < 200; ++r ) {
+            auto s = db.start_undo_session( true );
+            for( int i = 1 + 2 * (r % 5); i < 1000; i += 10 ) {
+               db.modify( db.get( book::id_type(i) ), []( book& b ) { ++b.a; } );
+               db.modify( db.get( book::id_type(i) ), []( book& b ) { --b.b; } );
+            }
+            s.push();
+         }
+         done = true;
+         reader.join();
+         BOOST_REQUIRE_EQUAL( failures, 0 );
+         BOOST_REQUIRE_GT( views, 0 );
 
-      BOOST_REQUIRE_EQUAL( new_book.a, copy_new_book.a );
-      BOOST_REQUIRE_EQUAL( new_book.b, copy_new_book.b );
-   } catch ( ... ) {
+         survivor = db.begin_read();
+         BOOST_REQUIRE_EQUAL( survivor.revision(), db.revision() );
+      }
+      // a view outlives its database, but nothing guarantees it against whoever opens the file next
+      BOOST_REQUIRE_EQUAL( survivor.get( book::id_type(1000) ).a, 5000 );
+      BOOST_REQUIRE( !survivor.consistent() );
+      survivor = chainbase::read_view();
+      bfs::remove_all( temp );
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE( views_released_while_writing, temp_directory ) {
+   chainbase::map_options options;
+   options.track_dirty_chunks = true;
+   options.read_views = true;
+   chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap, {}, options);
+   db.add_index< book_index >();
+   {
+      auto session = db.start_undo_session( true );
+      for( int i = 0; i < 1000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      session.push();
+   }
+
+   // readers hold on to a few views each and drop them while the writer faults chunks into the others
+   std::atomic<bool> done{false};
+   std::atomic<int> failures{0};
+   std::vector<std::thread> readers;
+   for( int t = 0; t < 4; ++t ) {
+      readers.emplace_back( [&, t]() {
+         std::deque<chainbase::read_view> held;
+         while( !done ) {
+            held.push_back( db.begin_read() );
+            if( held.size() > 2u + t ) {
+               const chainbase::read_view& v = held.front();
+               for( const book& b : v.get_index<book_index>().indices() )
+                  failures += b.a + b.b != 0;
+               failures += !v.consistent();
+               held.pop_front();
+            }
+         }
+      } );
+   }
+   for( int r = 0; r < 100; ++r ) {
+      auto s = db.start_undo_session( true );
+      for( int i = r % 7; i < 1000; i += 7 ) {
+         db.modify( db.get( book::id_type(i) ), []( book& b ) { ++b.a; } );
+         db.modify( db.get( book::id_type(i) ), []( book& b ) { --b.b; } );
+      }
+      s.push();
+   }
+   done = true;
+   for( std::thread& reader : readers )
+      reader.join();
+   BOOST_REQUIRE_EQUAL( failures, 0 );
+}
+
+BOOST_FIXTURE_TEST_CASE( online_growth, temp_directory ) {
+   for( auto mode : { pinnable_mapped_file::map_mode::mapped, pinnable_mapped_file::map_mode::heap } ) {
+      const uint64_t initial_size = 1024*1024*4;
+      chainbase::map_options options;
+      options.track_dirty_chunks = true;
+      options.read_views = true;
+      options.max_size = 1024*1024*64;
+      options.grow_threshold = 1024*1024;
+      options.grow_increment = 1024*1024*4;
+      {
+         chainbase::database db(temp, database::read_write, initial_size, false, mode, {}, options);
+         db.add_index< book_index >();
+         BOOST_REQUIRE_EQUAL( db.max_size(), options.max_size );
+         const book* first = &db.create<book>( []( book& b ) { b.a = -1; } );
+         db.start_undo_session( true ).push(); /// publishes the single book
+         chainbase::read_view view = db.begin_read();
+
+         for( int i = 1; i < 100000; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; } );
+         BOOST_REQUIRE_GT( db.get_segment_manager()->get_size(), initial_size );
+         BOOST_REQUIRE_GE( db.get_free_memory(), options.grow_threshold / 2 );
+         BOOST_REQUIRE_EQUAL( &db.get( book::id_type(0) ), first ); /// nothing moved
+         BOOST_REQUIRE( view.consistent() );
+         BOOST_REQUIRE_EQUAL( view.get_index<book_index>().indices().size(), 1u );
+
+         db.grow( options.max_size );
+         BOOST_REQUIRE_EQUAL( db.get_segment_manager()->get_size() + header_size, options.max_size );
+         BOOST_CHECK_THROW( db.grow( options.max_size * 2 ), std::runtime_error );
+         db.create<book>( []( book& b ) { b.a = 100000; } );
+      }
+      BOOST_REQUIRE_EQUAL( bfs::file_size( temp / "shared_memory.bin" ), options.max_size );
+
+      chainbase::database reader(temp);
+      reader.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( reader.get_index<book_index>().indices().size(), 100001u );
+      BOOST_REQUIRE_EQUAL( reader.get( book::id_type(99999) ).a, 99999 );
+      BOOST_REQUIRE_EQUAL( reader.max_size(), options.max_size );
       bfs::remove_all( temp );
-      throw;
    }
 }
 
+BOOST_FIXTURE_TEST_CASE( shared_heap_attach, temp_directory ) {
+   chainbase::map_options options;
+   options.shared_name = "chainbase-test-" + temp.filename().string();
+   std::unique_ptr<chainbase::database> reader;
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      db.create<book>( []( book& b ) { b.a = 1; } );
+
+      /// the file on disk does not hold the book yet and is marked dirty
+      reader.reset( new chainbase::database(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap, {}, options) );
+      reader->add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( reader->get( book::id_type(0) ).a, 1 );
+
+      db.modify( db.get( book::id_type(0) ), []( book& b ) { b.a = 2; } );
+      db.create<book>( []( book& b ) { b.a = 3; } );
+      BOOST_REQUIRE_EQUAL( reader->get( book::id_type(0) ).a, 2 );
+      BOOST_REQUIRE_EQUAL( reader->get_index<book_index>().indices().size(), 2u );
+   }
+   BOOST_REQUIRE_EQUAL( reader->get( book::id_type(1) ).a, 3 ); /// still mapped after the writer closed
+   reader.reset();
+   BOOST_CHECK_THROW( chainbase::database(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap, {}, options),
+                      std::runtime_error );
+}
+
+BOOST_FIXTURE_TEST_CASE( huge_page_and_numa_placement, temp_directory ) {
+   for( auto mode : { pinnable_mapped_file::map_mode::mapped, pinnable_mapped_file::map_mode::heap } ) {
+      chainbase::map_options options;
+      options.transparent_huge_pages = true;
+      options.numa = chainbase::numa_policy::interleave;
+      options.numa_nodes = 1;
+      options.max_size = 1024*1024*16;
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, mode, {}, options);
+         db.add_index< book_index >();
+         const uintptr_t base = reinterpret_cast<uintptr_t>( db.get_segment_manager() ) - header_size;
+         BOOST_REQUIRE_EQUAL( base % (1024*1024*2), 0u );
+         for( int i = 0; i < 1000; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; } );
+         db.grow( options.max_size );
+         db.create<book>( []( book& b ) { b.a = 1000; } );
+      }
+      chainbase::database reader(temp);
+      reader.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( reader.get( book::id_type(1000) ).a, 1000 );
+
+      options.numa_nodes = 0;
+      BOOST_CHECK_THROW( chainbase::database(temp, database::read_write, 0, false, mode, {}, options), std::runtime_error );
+      bfs::remove_all( temp );
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE( mapped_mode_warm_up, temp_directory ) {
+   chainbase::map_options options;
+   options.warm_up = true;
+   const bfs::path sidecar = temp / "shared_memory.working_set";
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::mapped, {}, options);
+      db.add_index< book_index >();
+      for( int i = 0; i < 10000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; } );
+      BOOST_REQUIRE( !bfs::exists( sidecar ) );
+   }
+   BOOST_REQUIRE( bfs::exists( sidecar ) );
+   /// a header plus one bit per 64KB
+   BOOST_REQUIRE_EQUAL( bfs::file_size( sidecar ), 24u + 1024*1024*8 / (64*1024) / 8 );
+   {
+      std::ifstream in( sidecar.string(), std::ifstream::binary );
+      std::vector<char> bits( bfs::file_size( sidecar ) );
+      in.read( bits.data(), bits.size() );
+      BOOST_REQUIRE( std::any_of( bits.begin() + 24, bits.end(), []( char c ) { return c != 0; } ) );
+   }
+
+   for( int reopen = 0; reopen < 2; ++reopen ) {
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped, {}, options);
+      db.add_index< book_index >();
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(9999) ).a, 9999 );
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE( background_load, temp_directory ) {
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::mapped);
+      db.add_index< book_index >();
+      for( int i = 0; i < 20000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; } );
+   }
+
+   chainbase::map_options options;
+   options.track_dirty_chunks = true;
+   options.load_in_background = true;
+   options.max_size = 1024*1024*16;
+   {
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      const book* fifth = &db.get( book::id_type(5) );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(19999) ).a, 19999 );
+      /// writes that may land before or after the loader copied their chunk
+      db.modify( *fifth, []( book& b ) { b.a = -5; } );
+      db.create<book>( []( book& b ) { b.a = 20000; } );
+
+      db.finish_loading();
+      BOOST_REQUIRE( !db.loading() );
+      BOOST_REQUIRE_EQUAL( &db.get( book::id_type(5) ), fifth ); /// nothing moved
+      BOOST_REQUIRE_EQUAL( fifth->a, -5 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(20000) ).a, 20000 );
+      db.modify( *fifth, []( book& b ) { b.a = 5; } );
+      db.grow( options.max_size );
+      db.create<book>( []( book& b ) { b.a = 20001; } );
+   }
+   {
+      /// switches over by itself at a call boundary, or keeps using the file if closed before that
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      db.modify( db.get( book::id_type(6) ), []( book& b ) { b.a = -6; } );
+      for( int i = 0; i < 1000 && db.loading(); ++i ) {
+         std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+         db.start_undo_session( false );
+      }
+      BOOST_REQUIRE( !db.loading() );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(6) ).a, -6 );
+      db.create<book>( []( book& b ) { b.a = 20002; } );
+   }
+   {
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      db.create<book>( []( book& b ) { b.a = 20003; } );
+   }
+   {
+      /// without tracking, the switch copies everything again
+      options.track_dirty_chunks = false;
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      db.modify( db.get( book::id_type(7) ), []( book& b ) { b.a = -7; } );
+      db.finish_loading();
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(7) ).a, -7 );
+   }
+
+   chainbase::database reader(temp);
+   reader.add_index< book_index >();
+   BOOST_REQUIRE_EQUAL( reader.get_index<book_index>().indices().size(), 20004u );
+   BOOST_REQUIRE_EQUAL( reader.get( book::id_type(5) ).a, 5 );
+   BOOST_REQUIRE_EQUAL( reader.get( book::id_type(6) ).a, -6 );
+   BOOST_REQUIRE_EQUAL( reader.get( book::id_type(7) ).a, -7 );
+   BOOST_REQUIRE_EQUAL( reader.get( book::id_type(20003) ).a, 20003 );
+
+   options.read_views = true;
+   BOOST_CHECK_THROW( chainbase::database(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, {}, options),
+                      std::runtime_error ); /// read views need track_dirty_chunks
+   options.track_dirty_chunks = true;
+   BOOST_CHECK_THROW( chainbase::database(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, {}, options),
+                      std::runtime_error );
+}
+
+BOOST_FIXTURE_TEST_CASE( direct_file_io, temp_directory ) {
+   chainbase::map_options options;
+   options.direct_file_io = true;
+   options.track_dirty_chunks = true;
+   options.checkpoint_interval = std::chrono::seconds(1);
+   {
+      chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      for( int i = 0; i < 20000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; } );
+      db.flush();
+      db.modify( db.get( book::id_type(8) ), []( book& b ) { b.a = -8; } );
+      std::this_thread::sleep_for( std::chrono::milliseconds(1100) );
+      db.commit( db.revision() ); /// a background checkpoint, which stages what it writes
+      db.modify( db.get( book::id_type(7) ), []( book& b ) { b.a = -7; } );
+   }
+   for( bool background : { false, true } ) {
+      options.load_in_background = background;
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, {}, options);
+      db.add_index< book_index >();
+      db.finish_loading();
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 20000u + background );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(7) ).a, -7 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(8) ).a, -8 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(19999) ).a, 19999 );
+      db.create<book>( []( book& b ) { b.a = 20000; } );
+   }
+
+   chainbase::database reader(temp);
+   reader.add_index< book_index >();
+   BOOST_REQUIRE_EQUAL( reader.get_index<book_index>().indices().size(), 20002u );
+   BOOST_REQUIRE_EQUAL( reader.get( book::id_type(20001) ).a, 20000 );
+}
+
+BOOST_FIXTURE_TEST_CASE( journaled_mapped_mode, temp_directory ) {
+   const bfs::path file = temp / "shared_memory.bin";
+   const bfs::path journal = temp / "shared_memory.journal";
+   chainbase::map_options options;
+   options.journal = true;
+   /// a writer that crashes after two checkpoints, keeping a copy of the file as of the first
+   std::cout.flush();
+   const pid_t child = fork();
+   if( child == 0 ) {
+      try {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::mapped, {}, options);
+         db.add_index< book_index >();
+         for( int i = 0; i < 20000; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; } );
+         db.flush();
+         bfs::copy_file( file, temp / "first.bin" );
+         db.modify( db.get( book::id_type(8) ), []( book& b ) { b.a = -8; } );
+         db.flush();
+         bfs::copy_file( journal, temp / "second.journal" );
+         db.modify( db.get( book::id_type(7) ), []( book& b ) { b.a = -7; } );
+         _exit( 0 );
+      } catch( ... ) {
+         _exit( 1 );
+      }
+   }
+   int status = 0;
+   BOOST_REQUIRE_EQUAL( waitpid( child, &status, 0 ), child );
+   BOOST_REQUIRE( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+
+   auto reopen = [&]( int expected_8 ) {
+      {
+         /// no dirty flag to get past, and nothing written after the last checkpoint
+         chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped, {}, options);
+         db.add_index< book_index >();
+         BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 20000u );
+         BOOST_REQUIRE_EQUAL( db.get( book::id_type(8) ).a, expected_8 );
+         BOOST_REQUIRE_EQUAL( db.get( book::id_type(7) ).a, 7 );
+      }
+      BOOST_REQUIRE( !bfs::exists( journal ) );
+   };
+   reopen( -8 );
+
+   /// the crash came before the second checkpoint reached the file; its journal finishes it
+   bfs::copy_file( temp / "first.bin", file, bfs::copy_option::overwrite_if_exists );
+   bfs::copy_file( temp / "second.journal", journal );
+   reopen( -8 );
+
+   /// or while its journal was still being written, which leaves the file as it was
+   bfs::copy_file( temp / "first.bin", file, bfs::copy_option::overwrite_if_exists );
+   bfs::copy_file( temp / "second.journal", journal );
+   bfs::resize_file( journal, bfs::file_size( journal ) / 2 );
+   reopen( 8 );
+
+   /// background checkpoints, and later changes saved at close
+   options.track_dirty_chunks = true;
+   options.checkpoint_interval = std::chrono::seconds(1);
+   {
+      chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped, {}, options);
+      db.add_index< book_index >();
+      db.modify( db.get( book::id_type(8) ), []( book& b ) { b.a = -8; } );
+      std::this_thread::sleep_for( std::chrono::milliseconds(1100) );
+      db.commit( db.revision() );
+      db.modify( db.get( book::id_type(9) ), []( book& b ) { b.a = -9; } );
+   }
+   chainbase::database reader(temp);
+   reader.add_index< book_index >();
+   BOOST_REQUIRE_EQUAL( reader.get( book::id_type(8) ).a, -8 );
+   BOOST_REQUIRE_EQUAL( reader.get( book::id_type(9) ).a, -9 );
+}
+
+BOOST_FIXTURE_TEST_CASE( dense_id_lookup_table, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*32);
+   db.add_index< dense_book_index >();
+   const auto& idx = db.get_index< dense_book_index >();
+   BOOST_REQUIRE( idx.id_lookup().ready() );
+
+   auto check = [&]( int64_t last_id ) {
+      BOOST_REQUIRE_EQUAL( idx.id_lookup().size(), idx.indices().size() );
+      for( int64_t id = 0; id <= last_id; ++id ) {
+         auto itr = idx.indices().find( dense_book::id_type(id) );
+         BOOST_REQUIRE( db.find<dense_book>( id ) == ( itr == idx.indices().end() ? nullptr : &*itr ) );
+      }
+   };
+
+   for( int i = 0; i < 10000; ++i )
+      db.create<dense_book>( [&]( dense_book& b ) { b.a = i; } );
+   check( 10000 );
+   const size_t full_size = idx.id_lookup().memory_bytes();
+
+   {
+      auto session = db.start_undo_session( true );
+      for( int i = 0; i < 5000; ++i )
+         db.remove( db.get( dense_book::id_type(i) ) );
+      BOOST_REQUIRE_LT( idx.id_lookup().memory_bytes(), full_size ); /// the first chunk was freed
+      for( int i = 0; i < 5000; ++i )
+         db.create<dense_book>( [&]( dense_book& b ) { b.a = i; } );
+      BOOST_REQUIRE_EQUAL( db.get( dense_book::id_type(14999) ).a, 4999 );
+      check( 15000 );
+   }
+   check( 15000 ); /// undone
+   BOOST_REQUIRE_EQUAL( db.get( dense_book::id_type(0) ).a, 0 );
+   BOOST_REQUIRE( db.find<dense_book>( 10000 ) == nullptr );
+
+   db.get_mutable_index< dense_book_index >().remove_object( 42 );
+   BOOST_REQUIRE( db.find<dense_book>( 42 ) == nullptr );
+   BOOST_CHECK_THROW( db.get<dense_book>( 42 ), std::out_of_range );
+   BOOST_REQUIRE_GT( db.stats().indices[0].id_table_bytes, 0u );
+
+   chainbase::database reader(temp, database::read_only, 0, true); /// the writer still has it open
+   reader.add_index< dense_book_index >();
+   BOOST_REQUIRE( reader.get_index< dense_book_index >().id_lookup().ready() );
+   BOOST_REQUIRE_EQUAL( reader.get( dense_book::id_type(9999) ).a, 9999 );
+}
+
+BOOST_FIXTURE_TEST_CASE( throwing_modifier, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*32);
+   db.add_index< dense_book_index >();
+   db.add_index< blob_book_index >();
+   const auto& idx = db.get_index< dense_book_index >();
+   for( int i = 0; i < 4; ++i ) {
+      db.create<dense_book>( [&]( dense_book& b ) { b.a = i; } );
+      db.create<blob_book>( [&]( blob_book& b ) { b.counter = i; b.payload.assign( "abc", 3 ); } );
+   }
+   auto fail = []( auto& obj ) {
+      obj.a = -1;
+      throw std::runtime_error( "modifier failed" );
+   };
+
+   /// outside of a session the object is just gone
+   BOOST_CHECK_THROW( db.modify( db.get( dense_book::id_type(0) ), fail ), std::runtime_error );
+   BOOST_REQUIRE( db.find<dense_book>( 0 ) == nullptr );
+   BOOST_REQUIRE_EQUAL( idx.id_lookup().size(), idx.indices().size() );
+
+   {
+      auto session = db.start_undo_session( true );
+      db.modify( db.get( dense_book::id_type(2) ), [&]( dense_book& b ) { b.a = 20; } );
+      BOOST_CHECK_THROW( db.modify( db.get( dense_book::id_type(1) ), fail ), std::runtime_error );
+      BOOST_CHECK_THROW( db.modify( db.get( dense_book::id_type(2) ), fail ), std::runtime_error );
+      const auto& created = db.create<dense_book>( [&]( dense_book& b ) { b.a = 4; } );
+      BOOST_CHECK_THROW( db.modify( created, fail ), std::runtime_error );
+      BOOST_REQUIRE( db.find<dense_book>( 1 ) == nullptr );
+      BOOST_REQUIRE( db.find<dense_book>( 2 ) == nullptr );
+      BOOST_REQUIRE( db.find<dense_book>( 4 ) == nullptr );
+      BOOST_REQUIRE_EQUAL( idx.indices().size(), 1u );
+      BOOST_REQUIRE_EQUAL( idx.id_lookup().size(), 1u );
+
+      db.modify( db.get( blob_book::id_type(3) ), [&]( blob_book& b ) { b.counter = 30; } );
+      BOOST_CHECK_THROW( db.modify( db.get( blob_book::id_type(3) ), [&]( blob_book& b ) {
+         b.counter = 300;
+         throw std::runtime_error( "modifier failed" );
+      } ), std::runtime_error );
+      BOOST_REQUIRE( db.find( blob_book::id_type(3) ) == nullptr );
+   }
+   /// undone, the objects come back as they were before the session
+   BOOST_REQUIRE_EQUAL( db.get( dense_book::id_type(1) ).a, 1 );
+   BOOST_REQUIRE_EQUAL( db.get( dense_book::id_type(2) ).a, 2 );
+   BOOST_REQUIRE( db.find<dense_book>( 4 ) == nullptr );
+   BOOST_REQUIRE_EQUAL( idx.id_lookup().size(), 3u );
+   BOOST_REQUIRE_EQUAL( db.get( blob_book::id_type(3) ).counter, 3 );
+   BOOST_REQUIRE( db.get( blob_book::id_type(3) ).payload == "abc" );
+
+   /// the state hash leaves out an object erased by a throwing modifier, and takes it back in when undone
+   db.add_index< pooled_book_index >();
+   const auto& hashed = db.get_index< pooled_book_index >();
+   for( int i = 0; i < 4; ++i )
+      db.create<pooled_book>( [&]( pooled_book& b ) { b.a = i; } );
+   BOOST_CHECK_THROW( db.modify( db.get( pooled_book::id_type(0) ), fail ), std::runtime_error );
+   BOOST_REQUIRE( db.find( pooled_book::id_type(0) ) == nullptr );
+   BOOST_REQUIRE( *hashed.state_hash() == pooled_book_digest( db ) );
+   const chainbase::state_digest before = db.state_hash();
+   {
+      auto session = db.start_undo_session( true );
+      db.modify( db.get( pooled_book::id_type(1) ), [&]( pooled_book& b ) { b.a = 10; } );
+      BOOST_CHECK_THROW( db.modify( db.get( pooled_book::id_type(1) ), fail ), std::runtime_error );
+      BOOST_REQUIRE( db.find( pooled_book::id_type(1) ) == nullptr );
+      BOOST_REQUIRE( *hashed.state_hash() == pooled_book_digest( db ) );
+   }
+   BOOST_REQUIRE( *hashed.state_hash() == pooled_book_digest( db ) );
+   BOOST_REQUIRE( db.state_hash() == before );
+}
+
+BOOST_FIXTURE_TEST_CASE( bulk_create_objects, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*32);
+   db.add_index< book_index >();
+   db.add_index< pooled_book_index >();
+   db.add_index< dense_book_index >();
+
+   db.create<book>( []( book& b ) { b.a = -1; } );
+   BOOST_REQUIRE_EQUAL( db.bulk_create<book>( 10000, []( book& b, size_t i ) { b.a = i; b.b = -int(i); } )._id, 1 );
+   BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 10001u );
+   BOOST_REQUIRE_EQUAL( db.get( book::id_type(10000) ).a, 9999 );
+   BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().get<2>().begin()->b, -9999 );
+   BOOST_REQUIRE_EQUAL( db.create<book>( []( book& ) {} ).id._id, 10001 );
+
+   // the nodes missing from the pool are reserved in one block, handed out in order before the pool's older free nodes
+   db.bulk_create<pooled_book>( 200, []( pooled_book& b, size_t i ) { b.a = i; } );
+   for( int i = 1; i < 192; ++i )
+      BOOST_REQUIRE_GT( (const char*)&db.get( pooled_book::id_type(i) ), (const char*)&db.get( pooled_book::id_type(i-1) ) );
+   BOOST_REQUIRE_EQUAL( db.stats().indices[1].pool_free_nodes, 256u - 200 - 1 );
+
+   db.bulk_create<dense_book>( 5000, []( dense_book& b, size_t i ) { b.a = i; } );
+   {
+      /// not undoable, so refused while there is an undo stack
+      auto session = db.start_undo_session( true );
+      BOOST_CHECK_THROW( db.bulk_create<dense_book>( 5000, []( dense_book& b, size_t i ) { b.a = 5000 + i; } ), std::logic_error );
+      BOOST_CHECK_THROW( db.get_mutable_index<dense_book_index>().bulk_emplace( 1, []( dense_book&, size_t ) {} ), std::logic_error );
+   }
+   BOOST_REQUIRE_EQUAL( db.get_index<dense_book_index>().indices().size(), 5000u );
+   BOOST_REQUIRE( db.find<dense_book>( 5000 ) == nullptr );
+   BOOST_REQUIRE_EQUAL( db.get_index<dense_book_index>().id_lookup().size(), 5000u );
+}
+
+BOOST_FIXTURE_TEST_CASE( database_stats_report, temp_directory ) {
+   chainbase::database db(temp, database::read_write, 1024*1024*8);
+   db.add_index< book_index >();
+   db.add_index< pooled_book_index >();
+   for( int i = 0; i < 10; ++i )
+      db.create<book>( []( book& ) {} );
+
+   auto session = db.start_undo_session( true );
+   for( int i = 0; i < 4; ++i )
+      db.modify( db.get( book::id_type(i) ), []( book& b ) { ++b.a; } );
+   db.remove( db.get( book::id_type(9) ) );
+   db.create<pooled_book>( []( pooled_book& ) {} );
+
+   chainbase::database_stats stats = db.stats();
+   BOOST_REQUIRE_EQUAL( stats.undo_depth, 1u );
+   BOOST_REQUIRE_EQUAL( stats.indices.size(), 2u );
+   const chainbase::index_stats& books = stats.indices[0];
+   BOOST_REQUIRE_EQUAL( books.type_name, "book" );
+   BOOST_REQUIRE_EQUAL( books.row_count, 9u );
+   BOOST_REQUIRE_EQUAL( books.undo_sessions, 1u );
+   BOOST_REQUIRE_EQUAL( books.undo_values, 5u );
+   BOOST_REQUIRE_GT( books.undo_bytes, 5 * sizeof(book) );
+   BOOST_REQUIRE_EQUAL( stats.indices[1].undo_values, 0u ); /// creations leave no undo values
+   BOOST_REQUIRE_GE( books.node_bytes, 9 * sizeof(book) );
+   BOOST_REQUIRE_EQUAL( books.pool_bytes, 0u );
+   BOOST_REQUIRE_GE( stats.indices[1].pool_bytes, stats.indices[1].node_bytes );
+   BOOST_REQUIRE_EQUAL( stats.indices[1].pool_free_nodes, chainbase::node_pool<int>::nodes_per_block - 2 ); /// the row and the container's header
+
+   BOOST_REQUIRE_EQUAL( stats.size, db.get_segment_manager()->get_size() );
+   BOOST_REQUIRE_EQUAL( stats.free_memory, db.get_free_memory() );
+#ifdef CHAINBASE_COLLECT_STATS
+   BOOST_REQUIRE( stats.operations_collected );
+   BOOST_REQUIRE_EQUAL( books.operations[size_t(chainbase::index_operation::emplace)].count, 10u );
+   BOOST_REQUIRE_EQUAL( books.operations[size_t(chainbase::index_operation::modify)].count, 4u );
+   BOOST_REQUIRE_EQUAL( books.operations[size_t(chainbase::index_operation::find)].count, 5u );
+   BOOST_REQUIRE_EQUAL( stats.start_undo_session.count, 1u );
+#else
+   BOOST_REQUIRE( !stats.operations_collected );
+#endif
+
+   std::stringstream prometheus;
+   chainbase::write_prometheus( prometheus, stats );
+   BOOST_REQUIRE( prometheus.str().find( "# TYPE chainbase_index_rows gauge\n" ) != std::string::npos );
+   BOOST_REQUIRE( prometheus.str().find( "chainbase_index_rows{index=\"book\"} 9\n" ) != std::string::npos );
+   BOOST_REQUIRE( prometheus.str().find( "chainbase_undo_depth 1\n" ) != std::string::npos );
+
+   session.undo();
+   BOOST_REQUIRE_EQUAL( db.stats().indices[0].undo_sessions, 0u );
+}
+
 // BOOST_AUTO_TEST_SUITE_END()